@@ -18,6 +18,7 @@ SOURCES += \
 
 HEADERS += \
     synchronizelists_p.h \
+    transferrecord_p.h \
     declarativetransfermodel.h
 
 OTHER_FILES = qmldir *.qml *.js
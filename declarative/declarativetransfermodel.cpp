@@ -24,18 +24,22 @@
 
 #include "declarativetransfermodel.h"
 #include "synchronizelists_p.h"
+#include "transferrecord_p.h"
 #include "transferdbrecord.h"
 
 #include <QQmlEngine>
 #include <qqml.h>
 #include <qqmlinfo.h>
 
+#include <QDateTime>
 #include <QSqlQuery>
 #include <QSqlError>
 #include <QThreadStorage>
 
 #define DB_PATH ".local/nemo-transferengine"
 #define DB_NAME "transferdb.sqlite"
+// Number of transfers read at a time, enough to fill the first screen
+#define FETCH_PAGE_SIZE 40
 
 template <> bool compareIdentity<TransferDBRecord>(
         const TransferDBRecord &item, const TransferDBRecord &reference)
@@ -49,6 +53,22 @@ public:
     TransferDatabase() : QSqlDatabase(QLatin1String("QSQLITE")) {}
 };
 
+namespace {
+
+bool execQuery(QSqlQuery &query, QString *errorString)
+{
+    if (!query.exec()) {
+        qWarning() << "TransferModel: Failed to query transfers";
+        qWarning() << query.lastQuery();
+        qWarning() << query.lastError().text();
+        *errorString = query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+}
+
 TransferModel::TransferModel(QObject *parent)
     : QAbstractListModel(parent)
     , m_rows(new QVector<TransferDBRecord>())
@@ -157,6 +177,24 @@ QVariant TransferModel::data(const QModelIndex &index, int role) const
     }
 }
 
+bool TransferModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && m_canFetchMore && m_status == Finished;
+}
+
+void TransferModel::fetchMore(const QModelIndex &parent)
+{
+    if (!canFetchMore(parent)) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_asyncFetchMore = true;
+    }
+    refresh();
+}
+
 void TransferModel::classBegin()
 {
 }
@@ -181,6 +219,7 @@ void TransferModel::componentComplete()
     m_roles[TransferDBRecord::ThumbnailIcon]      = "thumbnailIcon";
     m_roles[TransferDBRecord::CancelSupported]    = "cancelEnabled";
     m_roles[TransferDBRecord::RestartSupported]   = "restartEnabled";
+    m_roles[TransferDBRecord::DateTime]           = "dateTime";
 
     refresh();
 
@@ -189,12 +228,106 @@ void TransferModel::componentComplete()
                                            QDBusConnection::sessionBus(),
                                            this);
 
-    connect(m_client, SIGNAL(progressChanged(int,double)),
-            this, SLOT(refresh()));
+    // Progress and status changes are applied directly to the affected row, only
+    // added or removed transfers require querying the database again.
+    TransferProgress::registerType();
+    connect(m_client, SIGNAL(progressBatch(QList<TransferProgress>)),
+            this, SLOT(updateProgressBatch(QList<TransferProgress>)));
     connect(m_client, SIGNAL(transfersChanged()),
             this, SLOT(refresh()));
     connect(m_client, SIGNAL(statusChanged(int,int)),
-            this, SLOT(refresh()));
+            this, SLOT(updateStatus(int,int)));
+}
+
+void TransferModel::updateProgressBatch(const QList<TransferProgress> &progress)
+{
+    Q_FOREACH(const TransferProgress &update, progress) {
+        updateProgress(update.transfer_id, update.progress);
+    }
+}
+
+void TransferModel::updateProgress(int transferId, double progress)
+{
+    const int row = rowOf(transferId);
+    if (row < 0) {
+        refreshForTransfer(transferId);
+        return;
+    }
+
+    TransferDBRecord &record = (*m_rows)[row];
+    if (record.progress == progress) {
+        return;
+    }
+
+    record.progress = progress;
+    const QModelIndex modelIndex = createIndex(row, 0);
+    emit dataChanged(modelIndex, modelIndex, QVector<int>() << TransferDBRecord::Progress);
+}
+
+void TransferModel::updateStatus(int transferId, int status)
+{
+    const int row = rowOf(transferId);
+    if (row < 0) {
+        refreshForTransfer(transferId);
+        return;
+    }
+
+    TransferDBRecord &record = (*m_rows)[row];
+    if (record.status == status) {
+        return;
+    }
+
+    const int previousStatus = record.status;
+    QVector<int> roles;
+    roles << TransferDBRecord::Status << TransferDBRecord::Timestamp << TransferDBRecord::DateTime;
+
+    // Keep in sync with DbManager::updateTransferStatus()
+    record.status = status;
+    record.setTimestamp(QDateTime::currentMSecsSinceEpoch());
+    if (status == TransferStarted && record.progress != 0) {
+        record.progress = 0;
+        roles << TransferDBRecord::Progress;
+    }
+
+    const QModelIndex modelIndex = createIndex(row, 0);
+    emit dataChanged(modelIndex, modelIndex, roles);
+
+    if (previousStatus == TransferStarted || status == TransferStarted) {
+        m_transfersInProgress += (status == TransferStarted) ? 1 : -1;
+        emit transfersInProgressChanged();
+    }
+}
+
+// The model has all the transfers from the oldest loaded one up, so a transfer missing from
+// it is only new if it's newer than the loaded ones. Older transfers are outside of the loaded
+// window and the others have been removed, neither needs a query.
+void TransferModel::refreshForTransfer(int transferId)
+{
+    if (!m_rows->isEmpty() && transferId <= m_rows->first().transfer_id) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        if (transferId < m_asyncOldestId) {
+            return;
+        }
+    }
+
+    refresh();
+}
+
+int TransferModel::rowOf(int transferId)
+{
+    if (m_rowIndexDirty) {
+        m_rowIndex.clear();
+        m_rowIndex.reserve(m_rows->count());
+        for (int i = 0; i < m_rows->count(); ++i) {
+            m_rowIndex.insert(m_rows->at(i).transfer_id, i);
+        }
+        m_rowIndexDirty = false;
+    }
+    return m_rowIndex.value(transferId, -1);
 }
 
 void TransferModel::insertRange(
@@ -206,6 +339,7 @@ void TransferModel::insertRange(
         for (int i = 0; i < count; ++i) {
             m_rows->insert(index + i, source.at(sourceIndex + i));
         }
+        m_rowIndexDirty = true;
 
         endInsertRows();
         emit countChanged();
@@ -242,6 +376,7 @@ void TransferModel::removeRange(int index, int count)
         beginRemoveRows(QModelIndex(), index, index + count - 1);
 
         m_rows->remove(index, count);
+        m_rowIndexDirty = true;
 
         endRemoveRows();
         emit countChanged();
@@ -258,7 +393,10 @@ bool TransferModel::event(QEvent *event)
         m_status = m_asyncStatus;
         m_notified = false;
 
-        const QVector<TransferDBRecord> rows = m_asyncRows;
+        // The rows are only needed until they have been synchronized to the model
+        const QVector<TransferDBRecord> rows = std::move(m_asyncRows);
+        m_asyncRows.clear();
+        m_canFetchMore = m_asyncCanFetchMore;
 
         locker.unlock();
 
@@ -305,15 +443,24 @@ void TransferModel::run()
                 continue;
             }
 
+            const int oldestId = m_asyncOldestId;
+            const bool fetchMore = m_asyncFetchMore;
+            m_asyncFetchMore = false;
+
             locker.unlock();
 
             QVector<TransferDBRecord> rows;
             QString errorString;
             int activeTransfers = 0;
-            const bool ok = executeQuery(&rows, &activeTransfers, &errorString);
+            bool canFetchMore = false;
+            const bool ok = executeQuery(oldestId, fetchMore, &rows, &activeTransfers, &canFetchMore, &errorString);
 
             locker.relock();
 
+            if (ok) {
+                m_asyncOldestId = rows.isEmpty() ? 0 : rows.last().transfer_id;
+                m_asyncCanFetchMore = canFetchMore;
+            }
             m_asyncRows = std::move(rows);
             m_asyncTransfersInProgress = activeTransfers;
 
@@ -334,7 +481,8 @@ void TransferModel::run()
 }
 
 
-bool TransferModel::executeQuery(QVector<TransferDBRecord> *rows, int *activeTransfers, QString *errorString)
+bool TransferModel::executeQuery(int oldestId, bool fetchMore, QVector<TransferDBRecord> *rows, int *activeTransfers,
+                                 bool *canFetchMore, QString *errorString)
 {
     // Query items from the database
     QSqlDatabase db = database();
@@ -346,48 +494,51 @@ bool TransferModel::executeQuery(QVector<TransferDBRecord> *rows, int *activeTra
     QSqlQuery query(db);
     query.setForwardOnly(true);
 
-    if (!query.exec(QString(QStringLiteral("SELECT * FROM transfers ORDER BY transfer_id DESC")))) {
-        qWarning() << Q_FUNC_INFO;
-        qWarning() << "Failed to create tmp table";
-        qWarning() << query.lastQuery();
-        qWarning() << query.lastError().text();
-        *errorString = query.lastError().text();
-        return false;
+    // The pool only needs to live as long as the rows read with it share the values, so it's
+    // started over on every query instead of growing with every value ever read
+    m_stringPool.clear();
+
+    // Reload the transfers the model already has and the ones added since. Paging by
+    // transfer id keeps the window stable while transfers are added or removed.
+    if (oldestId > 0) {
+        query.prepare(QStringLiteral("SELECT * FROM transfers WHERE transfer_id>=:oldest ORDER BY transfer_id DESC"));
+        query.bindValue(QStringLiteral(":oldest"), oldestId);
+        if (!execQuery(query, errorString)) {
+            return false;
+        }
+        while (query.next()) {
+            rows->append(readRecord(query, &m_stringPool));
+        }
+        query.finish();
     }
 
-    *activeTransfers = 0;
-    while (query.next()) {
-        int i = 0;
-        TransferDBRecord record;
-        record.transfer_id          = query.value(i++).toInt();
-        record.transfer_type        = query.value(i++).toInt();
-        record.timestamp            = query.value(i++).toString();
-        record.status               = query.value(i++).toInt();
-        record.progress             = query.value(i++).toDouble();
-        record.display_name         = query.value(i++).toString();
-        record.application_icon     = query.value(i++).toString();
-        record.thumbnail_icon       = query.value(i++).toString();
-        record.service_icon         = query.value(i++).toString();
-        record.url                  = query.value(i++).toString();
-        record.resource_name        = query.value(i++).toString();
-        record.mime_type            = query.value(i++).toString();
-        record.size                 = query.value(i++).toInt();
-        record.plugin_id            = query.value(i++).toString();
-        i++; // account id
-        i++; // strip metadata
-        i++; // scale percent
-        record.cancel_supported     = query.value(i++).toBool();
-        record.restart_supported    = query.value(i++).toBool();
-
-        if (record.status == TransferModel::TransferStarted) {
-            ++(*activeTransfers);
-        }
+    // Read the next page, or a single row to know if there is one
+    const int pageSize = (fetchMore || rows->isEmpty()) ? FETCH_PAGE_SIZE : 0;
+    if (oldestId > 0) {
+        query.prepare(QStringLiteral("SELECT * FROM transfers WHERE transfer_id<:oldest ORDER BY transfer_id DESC LIMIT :limit"));
+        query.bindValue(QStringLiteral(":oldest"), oldestId);
+    } else {
+        query.prepare(QStringLiteral("SELECT * FROM transfers ORDER BY transfer_id DESC LIMIT :limit"));
+    }
+    query.bindValue(QStringLiteral(":limit"), pageSize + 1);
+    if (!execQuery(query, errorString)) {
+        return false;
+    }
+    for (int i = 0; i < pageSize && query.next(); ++i) {
+        rows->append(readRecord(query, &m_stringPool));
+    }
+    *canFetchMore = query.next();
+    query.finish();
 
-        rows->append(record);
+    // Count all the active transfers, not only the loaded ones
+    query.prepare(QStringLiteral("SELECT COUNT(*) FROM transfers WHERE status=:status"));
+    query.bindValue(QStringLiteral(":status"), TransferModel::TransferStarted);
+    if (!execQuery(query, errorString)) {
+        return false;
     }
+    *activeTransfers = query.next() ? query.value(0).toInt() : 0;
+    query.finish();
 
-    QMutexLocker locker(&m_mutex);
-    m_asyncRows = *rows;
     return true;
 }
 
@@ -408,7 +559,8 @@ QSqlDatabase TransferModel::database()
 
         TransferDatabase database;
         database.setDatabaseName(absDbPath);
-        database.setConnectOptions(QLatin1String("QSQLITE_OPEN_READONLY")); // sanity check
+        // Wait instead of failing if the engine is checkpointing the write-ahead log
+        database.setConnectOptions(QLatin1String("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=1000")); // sanity check
         thread_database.setLocalData(database);
     }
 
@@ -30,6 +30,7 @@
 #include <QMutex>
 #include <QQmlParserStatus>
 #include <QRunnable>
+#include <QSet>
 #include <QStringList>
 #include <QWaitCondition>
 #include <QSqlDatabase>
@@ -87,6 +88,8 @@ public:
     int rowCount(const QModelIndex &parent = QModelIndex()) const;
     QModelIndex index(int row, int column, const QModelIndex &parent) const;
     QVariant data(const QModelIndex &index, int role) const;
+    bool canFetchMore(const QModelIndex &parent) const;
+    void fetchMore(const QModelIndex &parent);
 
     void classBegin();
     void componentComplete();
@@ -102,6 +105,10 @@ public:
 public slots:
     void refresh();
 
+private slots:
+    void updateProgressBatch(const QList<TransferProgress> &progress);
+    void updateStatus(int transferId, int status);
+
 signals:
     void queryChanged();
     void classNamesChanged();
@@ -111,20 +118,30 @@ signals:
 
 private:
     void run();
-    bool executeQuery(QVector<TransferDBRecord> *rows, int *activeTransfers, QString *errorString);
+    bool executeQuery(int oldestId, bool fetchMore, QVector<TransferDBRecord> *rows, int *activeTransfers,
+                      bool *canFetchMore, QString *errorString);
 
     QSqlDatabase database();
+    int rowOf(int transferId);
+    void refreshForTransfer(int transferId);
+    void updateProgress(int transferId, double progress);
 
     QString m_asyncErrorString;
     QVector<TransferDBRecord> m_asyncRows;
     QVector<TransferDBRecord> *m_rows = nullptr;
     QHash<int, QByteArray> m_roles;
+    // Values repeated across the rows, only used by the query thread
+    QSet<QString> m_stringPool;
+    // Transfer id -> row in m_rows, rebuilt lazily after rows are inserted or removed
+    QHash<int, int> m_rowIndex;
 
     QMutex m_mutex;
     QWaitCondition m_condition;
 
     int m_rowsIndex = 0;
     int m_asyncIndex = 0;
+    // The oldest transfer loaded, the model has all the transfers newer than it
+    int m_asyncOldestId = 0;
     int m_asyncTransfersInProgress = 0;
     int m_transfersInProgress = 0;
 
@@ -132,9 +149,13 @@ private:
     Status m_asyncStatus = Null;
     bool m_asyncPending = false;
     bool m_asyncRunning = false;
+    bool m_asyncFetchMore = false;
+    bool m_asyncCanFetchMore = false;
+    bool m_canFetchMore = false;
     bool m_notified = false;
     bool m_complete = false;
     bool m_rowsChanges = false;
+    bool m_rowIndexDirty = true;
 
     TransferEngineInterface *m_client = nullptr;
 };
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef TRANSFERRECORD_P_H
+#define TRANSFERRECORD_P_H
+
+#include "transferdbrecord.h"
+
+#include <QDateTime>
+#include <QSet>
+#include <QSqlQuery>
+
+// Returns the pooled copy of a string, so that the rows share the data of the values they repeat.
+// Without a pool the value is returned as is.
+inline QString intern(QSet<QString> *pool, const QString &value)
+{
+    if (!pool) {
+        return value;
+    }
+    QSet<QString>::const_iterator it = pool->constFind(value);
+    if (it != pool->constEnd()) {
+        return *it;
+    }
+    pool->insert(value);
+    return value;
+}
+
+// Reads a row of SELECT * FROM transfers
+inline TransferDBRecord readRecord(const QSqlQuery &query, QSet<QString> *pool)
+{
+    int i = 0;
+    TransferDBRecord record;
+    record.transfer_id          = query.value(i++).toInt();
+    record.transfer_type        = query.value(i++).toInt();
+    const QVariant timestamp    = query.value(i++);
+    // The engine converts ISO 8601 timestamps when it migrates the database
+    record.setTimestamp(timestamp.type() == QVariant::String
+            ? QDateTime::fromString(timestamp.toString(), Qt::ISODate).toMSecsSinceEpoch()
+            : timestamp.toLongLong());
+    record.status               = query.value(i++).toInt();
+    record.progress             = query.value(i++).toDouble();
+    record.display_name         = query.value(i++).toString();
+    record.application_icon     = intern(pool, query.value(i++).toString());
+    record.thumbnail_icon       = query.value(i++).toString();
+    record.service_icon         = intern(pool, query.value(i++).toString());
+    record.url                  = query.value(i++).toString();
+    record.resource_name        = query.value(i++).toString();
+    record.mime_type            = intern(pool, query.value(i++).toString());
+    record.size                 = query.value(i++).toInt();
+    record.plugin_id            = intern(pool, query.value(i++).toString());
+    i++; // account id
+    i++; // strip metadata
+    i++; // scale percent
+    record.cancel_supported     = query.value(i++).toBool();
+    record.restart_supported    = query.value(i++).toBool();
+    return record;
+}
+
+#endif // TRANSFERRECORD_P_H
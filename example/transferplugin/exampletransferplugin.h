@@ -35,7 +35,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 class Q_DECL_EXPORT ExampleTransferPlugin : public QObject, public TransferPluginInterface
 {
     Q_OBJECT
-    Q_PLUGIN_METADATA(IID "com.myapp.transfer.plugin.example")
+    Q_PLUGIN_METADATA(IID "com.myapp.transfer.plugin.example" FILE "exampletransferplugin.json")
     Q_INTERFACES(TransferPluginInterface)
 public:
     ExampleTransferPlugin();
@@ -15,5 +15,7 @@ SOURCES += \
     exampleuploader.cpp \
     exampletransferplugin.cpp
 
+OTHER_FILES += exampletransferplugin.json
+
 target.path = $$LIBDIR/nemo-transferengine/plugins/transfer
 INSTALLS += target
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "imagecache_p.h"
+#include "imageoperation.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QTemporaryFile>
+#include <QtDebug>
+
+#include <utime.h>
+
+// The cache keeps copies of the shared photos, so it is used only when enabled
+#define IMAGE_CACHE_MAX_SIZE 0
+// Changing the output of an operation must bump this to stop serving the old results
+#define IMAGE_CACHE_FORMAT_VERSION 1
+// Block size used for copying files
+#define COPY_BLOCK_SIZE (1024 * 1024)
+
+/*
+    ImageCache keeps the results of the image operations in ~/.cache/nemo-transferengine, so
+    sharing the same photo again, e.g. to another service or when retrying a failed transfer,
+    only copies the earlier result.
+
+    The entries are named by key(), which combines a hash of the source path, the modification
+    time and size of the source, and a hash of the operation and its parameters. A changed
+    source gets a new key, and the entries of its earlier versions are removed when the new
+    result is inserted. The modification time of an entry is its last use, which the least
+    recently used entries are evicted by when the cache grows over maxSize(). The entries are
+    plain files written atomically, so the processes using ImageOperation can share the cache.
+
+    The callers always get a copy of an entry, so they may modify or remove their results
+    freely, and the modification time of a result is the time it was copied.
+
+    The cache is disabled until setMaxSize() is called with a positive size.
+*/
+
+ImageCache::ImageCache()
+    : m_path(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+             + QLatin1String("/nemo-transferengine"))
+    , m_maxSize(IMAGE_CACHE_MAX_SIZE)
+{
+}
+
+ImageCache *ImageCache::instance()
+{
+    static ImageCache cache;
+    return &cache;
+}
+
+/*
+    Returns the cache key for running \a operation with \a parameters on \a sourceFile, or an
+    empty string if the source can't be read.
+*/
+QString ImageCache::key(const QString &sourceFile, const QString &operation, const QStringList &parameters)
+{
+    const QFileInfo info(sourceFile);
+    const QString path = info.canonicalFilePath();
+    if (path.isEmpty()) {
+        return QString();
+    }
+
+    QCryptographicHash operationHash(QCryptographicHash::Sha1);
+    operationHash.addData(QByteArray::number(IMAGE_CACHE_FORMAT_VERSION));
+    operationHash.addData(operation.toUtf8());
+    foreach (const QString &parameter, parameters) {
+        operationHash.addData("\0", 1);
+        operationHash.addData(parameter.toUtf8());
+    }
+
+    return QStringLiteral("%1-%2-%3-%4").arg(
+                QString::fromLatin1(QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Sha1).toHex().left(16)),
+                QString::number(info.lastModified().toMSecsSinceEpoch(), 16),
+                QString::number(info.size(), 16),
+                QString::fromLatin1(operationHash.result().toHex().left(16)));
+}
+
+bool ImageCache::copyFile(const QString &sourceFile, const QString &targetFile)
+{
+    QFile source(sourceFile);
+    QFile target(targetFile);
+    if (!source.open(QIODevice::ReadOnly) || !target.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QByteArray block;
+    while (!(block = source.read(COPY_BLOCK_SIZE)).isEmpty()) {
+        if (target.write(block) != block.size()) {
+            return false;
+        }
+    }
+    return source.error() == QFile::NoError && target.flush();
+}
+
+/*
+    Copies the cached result for \a key to \a targetFile, or to a new temporary file next to
+    the other temporary files of \a sourceFile if \a targetFile is empty. Returns the path of
+    the result, or an empty string if the result isn't cached.
+*/
+QString ImageCache::fetch(const QString &key, const QString &sourceFile, const QString &targetFile)
+{
+    if (key.isEmpty() || maxSize() <= 0) {
+        return QString();
+    }
+
+    const QString entry = m_path + QLatin1Char('/') + key;
+    QString file;
+    if (QFile::exists(entry)) {
+        file = targetFile.isEmpty() ? ImageOperation::uniqueFilePath(sourceFile) : targetFile;
+        if (!file.isEmpty() && !copyFile(entry, file)) {
+            // Evicted by another process in the meantime
+            if (targetFile.isEmpty()) {
+                QFile::remove(file);
+            }
+            file.clear();
+        }
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (file.isEmpty()) {
+        ++m_misses;
+        return QString();
+    }
+
+    ++m_hits;
+    // Mark the entry as recently used
+    utime(QFile::encodeName(entry).constData(), nullptr);
+    return file;
+}
+
+/*
+    Stores a copy of \a file as the result for \a key and evicts the least recently used
+    entries if the cache grows too large.
+*/
+void ImageCache::insert(const QString &key, const QString &file)
+{
+    const qint64 limit = maxSize();
+    if (key.isEmpty() || limit <= 0 || QFileInfo(file).size() > limit) {
+        return;
+    }
+
+    if (!QDir().mkpath(m_path)) {
+        qWarning() << Q_FUNC_INFO << "Failed to create the cache directory" << m_path;
+        return;
+    }
+
+    // An existing entry has the same content. Otherwise copy to a temporary file first so
+    // that nobody reads a partially written entry.
+    const QString entryPath = m_path + QLatin1Char('/') + key;
+    if (!QFile::exists(entryPath)) {
+        QTemporaryFile entry(entryPath + QLatin1String(".XXXXXX"));
+        if (!entry.open() || !copyFile(file, entry.fileName())) {
+            qWarning() << Q_FUNC_INFO << "Failed to cache" << file;
+            return;
+        }
+        if (entry.rename(entryPath)) {
+            entry.setAutoRemove(false);
+        }
+    }
+
+    QMutexLocker locker(&m_mutex);
+    prune(key);
+}
+
+void ImageCache::clear()
+{
+    QDir(m_path).removeRecursively();
+}
+
+void ImageCache::prune(const QString &key)
+{
+    // Entries of the same source with another modification time or size are outdated
+    const QString source = key.section(QLatin1Char('-'), 0, 0) + QLatin1Char('-');
+    const QString version = key.section(QLatin1Char('-'), 0, 2) + QLatin1Char('-');
+
+    qint64 size = 0;
+    foreach (const QFileInfo &info, QDir(m_path).entryInfoList(QDir::Files, QDir::Time)) {
+        const QString name = info.fileName();
+        if (name.startsWith(source) && !name.startsWith(version)) {
+            QFile::remove(info.filePath());
+        } else if (size + info.size() > m_maxSize && name != key) {
+            // Sorted from the most recently used, so the rest are evicted
+            QFile::remove(info.filePath());
+        } else {
+            size += info.size();
+        }
+    }
+}
+
+qint64 ImageCache::maxSize() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_maxSize;
+}
+
+void ImageCache::setMaxSize(qint64 maxSize)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxSize = maxSize;
+}
+
+quint64 ImageCache::hits() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_hits;
+}
+
+quint64 ImageCache::misses() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_misses;
+}
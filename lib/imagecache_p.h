@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef IMAGECACHE_P_H
+#define IMAGECACHE_P_H
+
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+
+class ImageCache
+{
+public:
+    static ImageCache *instance();
+
+    static QString key(const QString &sourceFile, const QString &operation, const QStringList &parameters = QStringList());
+    static bool copyFile(const QString &sourceFile, const QString &targetFile);
+
+    QString fetch(const QString &key, const QString &sourceFile, const QString &targetFile);
+    void insert(const QString &key, const QString &file);
+    void clear();
+
+    qint64 maxSize() const;
+    void setMaxSize(qint64 maxSize);
+    quint64 hits() const;
+    quint64 misses() const;
+
+private:
+    ImageCache();
+    void prune(const QString &key);
+
+    const QString m_path;
+    mutable QMutex m_mutex;
+    qint64 m_maxSize;
+    quint64 m_hits = 0;
+    quint64 m_misses = 0;
+};
+
+#endif // IMAGECACHE_P_H
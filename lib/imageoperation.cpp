@@ -23,13 +23,508 @@
  */
 
 #include "imageoperation.h"
+#include "imageoperation_p.h"
+#include "imagecache_p.h"
 #include <QuillMetadata>
 
+#include <QBuffer>
 #include <QFileInfo>
+#include <QFutureInterface>
 #include <QtDebug>
 #include <QImageReader>
+#include <QMutex>
+#include <QRunnable>
+#include <QSet>
 #include <QSize>
+#include <QTemporaryDir>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QtEndian>
+#include <QThreadPool>
 #include <QtCore/qmath.h>
+
+#include <climits>
+#include <cstring>
+#include <functional>
+
+// Decoding a large photo takes hundreds of megabytes, so only a couple of images are
+// processed at a time
+#define IMAGE_OPERATION_MAX_THREADS 2
+
+namespace {
+
+// The job running on the current thread, which the operations poll to stop early when canceled
+thread_local QFutureInterfaceBase *currentJob = nullptr;
+
+bool jobCanceled()
+{
+    return currentJob && currentJob->isCanceled();
+}
+
+class ImageOperationJob : public QRunnable
+{
+public:
+    explicit ImageOperationJob(const std::function<QString()> &operation)
+        : m_operation(operation)
+    {
+        m_interface.reportStarted();
+    }
+
+    QFuture<QString> future()
+    {
+        return m_interface.future();
+    }
+
+    void run()
+    {
+        if (!m_interface.isCanceled()) {
+            currentJob = &m_interface;
+            const QString result = m_operation();
+            currentJob = nullptr;
+
+            // Canceling between the check and the report would leak the file, so check after it
+            m_interface.reportResult(result);
+            if (m_interface.isCanceled() && !result.isEmpty()) {
+                // Nobody is going to use or remove the file
+                QFile::remove(result);
+            }
+        }
+        m_interface.reportFinished();
+    }
+
+private:
+    std::function<QString()> m_operation;
+    QFutureInterface<QString> m_interface;
+};
+
+QFuture<QString> startJob(const std::function<QString()> &operation)
+{
+    ImageOperationJob *job = new ImageOperationJob(operation);
+    const QFuture<QString> future = job->future();
+    ImageOperation::threadPool()->start(job);
+    return future;
+}
+
+QByteArray encodeImage(const QImage &image, const QByteArray &format, int quality)
+{
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    if (!image.save(&buffer, format.constData(), quality)) {
+        return QByteArray();
+    }
+    return data;
+}
+
+// Block size used for copying the compressed image data
+#define COPY_BLOCK_SIZE (1024 * 1024)
+
+// Edits the Exif data of a JPEG APP1 segment in place. Removed entries are dropped from their
+// IFD and their values are overwritten with zeros, so no other offset in the segment changes.
+class ExifEditor
+{
+public:
+    explicit ExifEditor(QByteArray *segment)
+        : m_data(segment)
+    {
+    }
+
+    // Removes the author, description, timestamp and location entries. Returns false if the
+    // Exif data is malformed.
+    bool removePrivateEntries()
+    {
+        if (m_data->size() < TiffStart + 8) {
+            return false;
+        }
+        const char *header = m_data->constData() + TiffStart;
+        if (header[0] == 'I' && header[1] == 'I') {
+            m_littleEndian = true;
+        } else if (header[0] == 'M' && header[1] == 'M') {
+            m_littleEndian = false;
+        } else {
+            return false;
+        }
+        return stripIfd(read32(4), true);
+    }
+
+private:
+    enum {
+        TiffStart = 6, // after "Exif\0\0"
+        EntrySize = 12,
+        TagImageDescription = 0x010e,
+        TagArtist = 0x013b,
+        TagExifIfd = 0x8769,
+        TagGpsIfd = 0x8825,
+        TagDateTimeOriginal = 0x9003,
+        TagXPTitle = 0x9c9b,
+        TagXPSubject = 0x9c9f
+    };
+
+    bool isPrivate(quint16 tag) const
+    {
+        return tag == TagImageDescription || tag == TagArtist || tag == TagDateTimeOriginal
+                || (tag >= TagXPTitle && tag <= TagXPSubject);
+    }
+
+    bool contains(quint32 offset, quint32 length) const
+    {
+        return offset <= quint32(m_data->size() - TiffStart)
+                && length <= quint32(m_data->size() - TiffStart) - offset;
+    }
+
+    quint16 read16(quint32 offset) const
+    {
+        const uchar *p = reinterpret_cast<const uchar *>(m_data->constData()) + TiffStart + offset;
+        return m_littleEndian ? qFromLittleEndian<quint16>(p) : qFromBigEndian<quint16>(p);
+    }
+
+    quint32 read32(quint32 offset) const
+    {
+        const uchar *p = reinterpret_cast<const uchar *>(m_data->constData()) + TiffStart + offset;
+        return m_littleEndian ? qFromLittleEndian<quint32>(p) : qFromBigEndian<quint32>(p);
+    }
+
+    void write16(quint32 offset, quint16 value)
+    {
+        uchar *p = reinterpret_cast<uchar *>(m_data->data()) + TiffStart + offset;
+        if (m_littleEndian) {
+            qToLittleEndian(value, p);
+        } else {
+            qToBigEndian(value, p);
+        }
+    }
+
+    void clear(quint32 offset, quint32 length)
+    {
+        memset(m_data->data() + TiffStart + offset, 0, length);
+    }
+
+    // Overwrites the value of an entry with zeros, whether it's stored in the entry or elsewhere
+    bool clearValue(quint32 entry)
+    {
+        static const quint32 typeSizes[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8 };
+        const quint16 type = read16(entry + 2);
+        const quint64 size = quint64(type < sizeof(typeSizes) / sizeof(typeSizes[0]) ? typeSizes[type] : 1)
+                * read32(entry + 4);
+        if (size <= 4) {
+            clear(entry + 8, 4);
+            return true;
+        }
+        const quint32 offset = read32(entry + 8);
+        if (size > UINT_MAX || !contains(offset, size)) {
+            return false;
+        }
+        clear(offset, size);
+        return true;
+    }
+
+    // Clears the whole GPS IFD including the values of its entries
+    bool clearIfd(quint32 ifd)
+    {
+        if (!contains(ifd, 2)) {
+            return false;
+        }
+        const quint16 count = read16(ifd);
+        if (!contains(ifd, 2 + count * EntrySize + 4)) {
+            return false;
+        }
+        for (quint16 i = 0; i < count; ++i) {
+            if (!clearValue(ifd + 2 + i * EntrySize)) {
+                return false;
+            }
+        }
+        clear(ifd, 2 + count * EntrySize + 4);
+        return true;
+    }
+
+    bool stripIfd(quint32 ifd, bool followExifIfd)
+    {
+        if (!contains(ifd, 2)) {
+            return false;
+        }
+        const quint16 count = read16(ifd);
+        const quint32 end = ifd + 2 + count * EntrySize;
+        if (!contains(ifd, 2 + count * EntrySize + 4)) {
+            return false;
+        }
+
+        quint16 kept = 0;
+        for (quint16 i = 0; i < count; ++i) {
+            const quint32 entry = ifd + 2 + i * EntrySize;
+            const quint16 tag = read16(entry);
+            bool remove = false;
+            if (tag == TagGpsIfd) {
+                if (!clearIfd(read32(entry + 8))) {
+                    return false;
+                }
+                remove = true;
+            } else if (isPrivate(tag)) {
+                if (!clearValue(entry)) {
+                    return false;
+                }
+                remove = true;
+            } else if (tag == TagExifIfd && followExifIfd) {
+                if (!stripIfd(read32(entry + 8), false)) {
+                    return false;
+                }
+            }
+
+            if (!remove) {
+                const quint32 target = ifd + 2 + kept * EntrySize;
+                if (target != entry) {
+                    memmove(m_data->data() + TiffStart + target, m_data->constData() + TiffStart + entry, EntrySize);
+                }
+                ++kept;
+            }
+        }
+
+        if (kept != count) {
+            // Move the offset of the next IFD after the remaining entries and clear the gap
+            const quint32 keptEnd = ifd + 2 + kept * EntrySize;
+            memmove(m_data->data() + TiffStart + keptEnd, m_data->constData() + TiffStart + end, 4);
+            clear(keptEnd + 4, end - keptEnd);
+            write16(ifd, kept);
+        }
+        return true;
+    }
+
+    QByteArray *m_data;
+    bool m_littleEndian = false;
+};
+
+// Copies a JPEG file removing the private metadata in one pass: the XMP (APP1) and IPTC (APP13)
+// segments are dropped, the Exif segment is edited in place and the compressed image data
+// after the segments is copied in large blocks as is.
+bool stripJpegMetadata(const QString &sourceFile, const QString &targetFile)
+{
+    QFile source(sourceFile);
+    QFile target(targetFile);
+    if (!source.open(QIODevice::ReadOnly) || !target.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    // Start of image
+    QByteArray marker = source.read(2);
+    if (marker.size() != 2 || uchar(marker[0]) != 0xff || uchar(marker[1]) != 0xd8) {
+        return false;
+    }
+    target.write(marker);
+
+    for (;;) {
+        char prefix;
+        char type;
+        if (!source.getChar(&prefix) || uchar(prefix) != 0xff || !source.getChar(&type)) {
+            return false;
+        }
+        while (uchar(type) == 0xff) { // fill bytes
+            if (!source.getChar(&type)) {
+                return false;
+            }
+        }
+
+        const uchar code = uchar(type);
+        if (code == 0xda || code == 0xd9) {
+            // Start of scan or end of image, the rest is copied unchanged
+            target.putChar(prefix);
+            target.putChar(type);
+            break;
+        } else if (code == 0x01 || (code >= 0xd0 && code <= 0xd7)) {
+            // Markers without a payload
+            target.putChar(prefix);
+            target.putChar(type);
+            continue;
+        }
+
+        const QByteArray length = source.read(2);
+        if (length.size() != 2) {
+            return false;
+        }
+        const int payloadSize = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(length.constData())) - 2;
+        if (payloadSize < 0) {
+            return false;
+        }
+        QByteArray payload = source.read(payloadSize);
+        if (payload.size() != payloadSize) {
+            return false;
+        }
+
+        if (code == 0xed) {
+            continue; // IPTC
+        } else if (code == 0xe1) {
+            if (payload.startsWith(QByteArray("Exif\0\0", 6))) {
+                // Drop the whole segment if it can't be edited
+                if (!ExifEditor(&payload).removePrivateEntries()) {
+                    qWarning() << "Dropping malformed Exif data from" << sourceFile;
+                    continue;
+                }
+            } else if (payload.startsWith("http://ns.adobe.com/")) {
+                continue; // XMP and extended XMP
+            }
+        }
+
+        target.putChar(prefix);
+        target.putChar(type);
+        target.write(length);
+        target.write(payload);
+    }
+
+    QByteArray block;
+    while (!(block = source.read(COPY_BLOCK_SIZE)).isEmpty()) {
+        if (target.write(block) != block.size()) {
+            return false;
+        }
+        if (jobCanceled()) {
+            return false;
+        }
+    }
+    return source.error() == QFile::NoError && target.flush();
+}
+
+// Directory for the files created by this process, removed with its content when the process exits
+QString scratchPath()
+{
+    static QTemporaryDir dir(QDir::tempPath() + QLatin1String("/nemo-transferengine-XXXXXX"));
+    return dir.isValid() ? dir.path() : QDir::tempPath();
+}
+
+// Directories which are removed together with their content, see registerScratchDirectory()
+struct ScratchDirectories
+{
+    QMutex mutex;
+    QSet<QString> paths;
+};
+Q_GLOBAL_STATIC(ScratchDirectories, scratchDirectories)
+
+bool isScratchDirectory(const QString &path)
+{
+    ScratchDirectories *directories = scratchDirectories();
+    QMutexLocker locker(&directories->mutex);
+    return directories->paths.contains(QDir::cleanPath(QDir(path).absolutePath()));
+}
+
+bool isJpeg(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QByteArray header = file.read(2);
+    return header.size() == 2 && uchar(header[0]) == 0xff && uchar(header[1]) == 0xd8;
+}
+
+}
+
+// Encodes the image in memory into at most targetSize bytes. First the highest quality that
+// fits is searched, and only if even the lowest quality is too large the dimensions are
+// reduced. The search stops at the first encoding within ENCODE_SIZE_TOLERANCE of the target,
+// and tries at most ENCODE_MAX_ATTEMPTS encodings. If none of them fits, the dimensions are
+// halved until the image fits, which takes a few more encodes. The number of encodes is stored
+// to encodeCount if given. Returns an empty array if the image can't be encoded, or if the
+// target size is too small even for a single pixel.
+QByteArray encodeImageToSize(const QImage &image, const QByteArray &format, quint64 targetSize,
+                             int *encodeCount)
+{
+    const quint64 goodEnough = targetSize * (1 - ENCODE_SIZE_TOLERANCE);
+    QByteArray best;
+    int encodes = 0;
+    const auto finish = [&encodes, encodeCount](const QByteArray &result) {
+        if (encodeCount) {
+            *encodeCount = encodes;
+        }
+        return result;
+    };
+
+    // Binary search the quality. When nothing fits, the last encode is the lowest quality.
+    int lowQuality = ENCODE_MIN_QUALITY;
+    int highQuality = ENCODE_MAX_QUALITY;
+    quint64 lowestQualitySize = 0;
+    while (lowQuality <= highQuality && encodes < ENCODE_MAX_ATTEMPTS) {
+        const int quality = (lowQuality + highQuality) / 2;
+        const QByteArray data = encodeImage(image, format, quality);
+        ++encodes;
+        if (data.isEmpty()) {
+            return finish(QByteArray());
+        } else if (quint64(data.size()) <= targetSize) {
+            best = data;
+            if (quint64(data.size()) >= goodEnough) {
+                return finish(best);
+            }
+            lowQuality = quality + 1;
+        } else {
+            lowestQualitySize = data.size();
+            highQuality = quality - 1;
+        }
+    }
+    if (!best.isEmpty() || lowestQualitySize == 0) {
+        return finish(best);
+    }
+
+    // Search the dimensions at the lowest quality. The encoded size is roughly proportional to
+    // the number of pixels, so the next scale is guessed from the square root of the size ratio
+    // and the search falls back to bisecting when the guess is out of the known bounds.
+    qreal lowScale = 0;
+    qreal highScale = 1;
+    qreal scale = qSqrt(qreal(targetSize) / lowestQualitySize);
+    while (encodes < ENCODE_MAX_ATTEMPTS) {
+        const QImage scaled = image.scaled(image.size() * scale, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        if (scaled.isNull()) {
+            break;
+        }
+        const QByteArray data = encodeImage(scaled, format, ENCODE_MIN_QUALITY);
+        ++encodes;
+        if (data.isEmpty()) {
+            break;
+        } else if (quint64(data.size()) <= targetSize) {
+            best = data;
+            if (quint64(data.size()) >= goodEnough) {
+                break;
+            }
+            lowScale = scale;
+        } else {
+            highScale = scale;
+        }
+
+        scale *= qSqrt(qreal(targetSize) / data.size());
+        if (scale <= lowScale || scale >= highScale) {
+            scale = (lowScale + highScale) / 2;
+        }
+    }
+
+    // The attempts ran out before anything fit. Each halving quarters the number of pixels,
+    // so the smallest fitting image is found in a few more encodes.
+    scale = highScale;
+    while (best.isEmpty() && encodes >= ENCODE_MAX_ATTEMPTS) {
+        scale /= 2;
+        const QImage scaled = image.scaled(image.size() * scale, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        if (scaled.isNull()) {
+            break;
+        }
+        const QByteArray data = encodeImage(scaled, format, ENCODE_MIN_QUALITY);
+        ++encodes;
+        if (data.isEmpty()) {
+            break;
+        } else if (quint64(data.size()) <= targetSize) {
+            best = data;
+        }
+    }
+    return finish(best);
+}
+
+// Files in the scratch directories keep their names, see ImageOperation::uniqueFilePath()
+void registerScratchDirectory(const QString &path)
+{
+    ScratchDirectories *directories = scratchDirectories();
+    QMutexLocker locker(&directories->mutex);
+    directories->paths.insert(QDir::cleanPath(QDir(path).absolutePath()));
+}
+
+void unregisterScratchDirectory(const QString &path)
+{
+    ScratchDirectories *directories = scratchDirectories();
+    QMutexLocker locker(&directories->mutex);
+    directories->paths.remove(QDir::cleanPath(QDir(path).absolutePath()));
+}
+
 /*!
     \class ImageOperation
     \brief The ImageOperation class is a helper class to manipulate images.
@@ -40,20 +535,43 @@
         \li Scaling image
         \li Create a temp files from the image paths
     \endlist
+
+    The results of removeImageMetadata(), scaleImage() and scaleImageToSize() can be cached on
+    disk, keyed by the source file, its modification time and size, and the parameters of the
+    operation. Running the same operation again, e.g. when the same photo is shared to another
+    service or a failed transfer is retried, only copies the cached result. The cache is
+    disabled by default, see setCacheMaxSize().
+
+    The operations take seconds for large photos, so the ones which are not called from a
+    worker thread should use the asynchronous variants, such as scaleImageAsync(). They run
+    the operation in threadPool() and return a QFuture for the resulting file path. Canceling
+    the future stops the operation at the next step and removes its output. Note that the
+    result of a canceled future must not be read.
 */
 
 /*!
     Creates a file path from the \a sourceFilePath to the \a path location.
-    If the path is not given it uses system default temp path e.g. '/var/tmp'.
-    This function uses sourceFilePath as a template to generate a temp file name.
 
-    NOTE: This function doesn't create the file, it only generates the file path to
-    the temporary file.
+    If the path is not given, or it is a scratch directory of a transfer (see
+    MediaTransferInterface::scratchDirectory()), the file has the same name as
+    \a sourceFilePath in a new directory with a unique name in that location. Without a path
+    the directory is created in a temporary directory of the process, which is removed with its
+    content when the process exits. The file doesn't exist, so it can be created e.g. with
+    QFile::copy().
+
+    Otherwise the file is created directly to \a path with a unique name based on
+    \a sourceFilePath, so the caller only needs to remove the file. The file is empty and
+    the image operations writing to it overwrite it.
+
+    Either way the path is reserved atomically and doesn't depend on how many files the
+    location has, so the path stays unique even if other processes use the same location at
+    the same time.
 
     Temporary file will be e.g:
 
     Source file: "/home/nemo/Pictures/img_001.jpg"
-    Temporary file: "/var/tmp/img_001_0.jpg"
+    Temporary file: "/var/tmp/nemo-transferengine-x1Y2z3/img_001_a1B2c3/img_001.jpg"
+    Temporary file to "/home/nemo/Documents": "/home/nemo/Documents/img_001_a1B2c3.jpg"
  */
 QString ImageOperation::uniqueFilePath(const QString &sourceFilePath, const QString &path)
 {
@@ -62,47 +580,43 @@ QString ImageOperation::uniqueFilePath(const QString &sourceFilePath, const QStr
         return QString();
     }
 
-    if (path.isEmpty()) {
-        qWarning() << Q_FUNC_INFO << "'path' argument is empty!";
-        return QString();
-    }
-
     QFileInfo fileInfo(sourceFilePath);
 
-    // Construct target temp file path first:
-    QDir dir(path);
-    QStringList prevFiles = dir.entryList(QStringList() << fileInfo.baseName() + QLatin1String("*"), QDir::Files);
-    int count = prevFiles.count();
-
-    // Create temp file with increasing index in a file name e.g.
-    // /var/temp/img_001_0.jpg, /var/temp/img_001_1.jpg
-    // In a case there already is a file with the same filename
-    QString filePath = dir.absolutePath() + QDir::separator();
-    QString fileName =  fileInfo.baseName() +
-                        QLatin1String("_") +
-                        QString::number(count) +
-                        QLatin1String(".") +
-                        fileInfo.suffix();
-
-    // This makes sure that we don't generate a file name which already exists. E.g. there are files:
-    // img_001_0, img_001_1, img_001_2 and img_001 gets deleted. Then this code would generate a
-    // filename img_001_2 which already exists
-    while(prevFiles.contains(fileName)) {
-        ++count;
-        fileName =  fileInfo.baseName() +
-                    QLatin1String("_") +
-                    QString::number(count) +
-                    QLatin1String(".") +
-                    fileInfo.suffix();
-    }
-
-    return filePath + fileName;
+    // QTemporaryFile and QTemporaryDir replace the X's with random characters and create the
+    // entry exclusively, retrying with another name if it exists.
+    if (!path.isEmpty() && !isScratchDirectory(path)) {
+        QString name = fileInfo.completeBaseName() + QLatin1String("_XXXXXX");
+        if (!fileInfo.suffix().isEmpty()) {
+            name += QLatin1Char('.') + fileInfo.suffix();
+        }
+        QTemporaryFile file(QDir(path).absoluteFilePath(name));
+        file.setAutoRemove(false);
+        if (!file.open()) {
+            qWarning() << Q_FUNC_INFO << "Failed to create a file to" << path << file.errorString();
+            return QString();
+        }
+        return file.fileName();
+    }
+
+    const QString location = path.isEmpty() ? scratchPath() : path;
+    QTemporaryDir dir(QDir(location).absoluteFilePath(fileInfo.baseName() + QLatin1String("_XXXXXX")));
+    dir.setAutoRemove(false);
+    if (!dir.isValid()) {
+        qWarning() << Q_FUNC_INFO << "Failed to create a directory to" << location;
+        return QString();
+    }
+    return dir.path() + QDir::separator() + fileInfo.fileName();
 }
 
 /*!
    Helper method to remove metadata from jpeg files. Only author and location related
    metadata will be removed. \a sourceFile is the path to the original file.
 
+   JPEG files are rewritten in a single pass which drops the XMP and IPTC segments and removes
+   the private Exif entries, keeping e.g. the orientation. The compressed image data is copied
+   unchanged. Other formats are copied and then edited through QuillMetadata. The result is
+   cached if the cache is enabled.
+
    Returns a path to the copy of the image with metadata removed.
  */
 QString ImageOperation::removeImageMetadata(const QString &sourceFile)
@@ -113,11 +627,35 @@ QString ImageOperation::removeImageMetadata(const QString &sourceFile)
         return QString();
     }
 
+    const QString cacheKey = ImageCache::key(sourceFile, QStringLiteral("removeImageMetadata"));
+    const QString cachedFile = ImageCache::instance()->fetch(cacheKey, sourceFile, QString());
+    if (!cachedFile.isEmpty()) {
+        return cachedFile;
+    }
+
     QString targetFile = uniqueFilePath(sourceFile);
 
+    if (isJpeg(sourceFile)) {
+        if (!stripJpegMetadata(sourceFile, targetFile)) {
+            if (!jobCanceled()) {
+                qWarning() << Q_FUNC_INFO << "Failed to strip metadata from" << sourceFile;
+            }
+            QFile::remove(targetFile);
+            return QString();
+        }
+        ImageCache::instance()->insert(cacheKey, targetFile);
+        return targetFile;
+    }
+
     // Copy image content first
     if (!QFile::copy(sourceFile, targetFile)) {
         qWarning() << Q_FUNC_INFO << "Failed to copy content!";
+        QFile::remove(targetFile);
+        return QString();
+    }
+
+    if (jobCanceled()) {
+        QFile::remove(targetFile);
         return QString();
     }
 
@@ -145,6 +683,7 @@ QString ImageOperation::removeImageMetadata(const QString &sourceFile)
         qWarning() << Q_FUNC_INFO << "Failed to clear metadata!";
         return QString();
     }
+    ImageCache::instance()->insert(cacheKey, targetFile);
     // Return new file with removed metadata
     return targetFile;
 }
@@ -158,7 +697,8 @@ QString ImageOperation::removeImageMetadata(const QString &sourceFile)
     directory. Nothing guarantees that created file will remain in that diretory forewer so the caller is
     reponsible of copying file for more permanent storing.
 
-    Returns a path to the scaled image.
+    Returns a path to the scaled image. If the cache is enabled, the scaled image is cached so
+    that scaling the same image again only copies the earlier result.
 
     It is also recommended that if the caller doesn't use the scaled file, which is stored to the temp
     directory later, the caller should remove the file.
@@ -175,9 +715,13 @@ QString ImageOperation::scaleImage(const QString &sourceFile, qreal scaleFactor,
         return QString();
     }
 
-    QString tmpFile = targetFile;
-    if (tmpFile.isEmpty()) {
-        tmpFile = uniqueFilePath(sourceFile);
+    // The format of the result follows the suffix of the target file
+    const QString cacheKey = ImageCache::key(sourceFile, QStringLiteral("scaleImage"), QStringList()
+            << QString::number(scaleFactor, 'g', 17)
+            << QFileInfo(targetFile.isEmpty() ? sourceFile : targetFile).suffix().toLower());
+    const QString cachedFile = ImageCache::instance()->fetch(cacheKey, sourceFile, targetFile);
+    if (!cachedFile.isEmpty()) {
+        return cachedFile;
     }
 
     // Using just basic QImage scale here. We can easily replace this implementation later, if we notice
@@ -193,6 +737,10 @@ QString ImageOperation::scaleImage(const QString &sourceFile, qreal scaleFactor,
     ir.setScaledSize(imageSize);
     QImage image = ir.read();
 
+    if (jobCanceled()) {
+        return QString();
+    }
+
     int angle;
     bool mirrored;
     imageOrientation(sourceFile, &angle, &mirrored);
@@ -207,13 +755,23 @@ QString ImageOperation::scaleImage(const QString &sourceFile, qreal scaleFactor,
         image = image.transformed(transform);
     }
 
+    // The temporary file is reserved only when there is something to save
+    QString tmpFile = targetFile;
+    if (tmpFile.isEmpty()) {
+        tmpFile = uniqueFilePath(sourceFile);
+    }
+
     if (!image.save(tmpFile)) {
         qWarning() << Q_FUNC_INFO
                    << "Failed to save scaled image to temp file!"
                    << tmpFile;
+        if (targetFile.isEmpty()) {
+            QFile::remove(tmpFile);
+        }
         return QString();
     }
 
+    ImageCache::instance()->insert(cacheKey, tmpFile);
     return tmpFile;
 }
 
@@ -221,11 +779,15 @@ QString ImageOperation::scaleImage(const QString &sourceFile, qreal scaleFactor,
     Scale image from a \a sourceFile to the \a targetSize. If user gives \a targetFile argument, it is used for
     saving the scaled image to that location.
 
-    NOTE: It's hard to predict what will be the actual file size after scaling because it depends on image data.
-          Therefore it's good to remember that \a targetSize is used by this algorithm, but the final file size
-          may varie a lot.
+    The image is encoded in memory with the highest quality that fits into \a targetSize bytes. If it
+    doesn't fit even with the lowest quality, the dimensions are reduced further. The size of the
+    resulting file is at most \a targetSize. It is usually within 5% of it, but it is smaller when
+    the image doesn't fill the target size even with the highest quality, or when the search runs
+    out of attempts. In the latter case the dimensions are halved until the image fits. The scaled
+    image is cached like with scaleImage().
 
-    Returns a path to the scaled image.
+    Returns a path to the scaled image, or an empty string if \a targetSize is too small for any
+    encoding of the image.
  */
 QString ImageOperation::scaleImageToSize(const QString &sourceFile, quint64 targetSize, const QString &targetFile)
 {
@@ -245,9 +807,12 @@ QString ImageOperation::scaleImageToSize(const QString &sourceFile, quint64 targ
         return QString();
     }
 
-    QString tmpFile = targetFile;
-    if (tmpFile.isEmpty()) {
-        tmpFile = uniqueFilePath(sourceFile);
+    const QString cacheKey = ImageCache::key(sourceFile, QStringLiteral("scaleImageToSize"), QStringList()
+            << QString::number(targetSize)
+            << QFileInfo(targetFile.isEmpty() ? sourceFile : targetFile).suffix().toLower());
+    const QString cachedFile = ImageCache::instance()->fetch(cacheKey, sourceFile, targetFile);
+    if (!cachedFile.isEmpty()) {
+        return cachedFile;
     }
 
     QImageReader ir(sourceFile);
@@ -256,10 +821,9 @@ QString ImageOperation::scaleImageToSize(const QString &sourceFile, quint64 targ
         return QString();
     }
 
-    // NOTE: We really don't know the size on the disk after scaling and saving
-    //
-    // So this is a home made algorithm to downscale image based on give target size using the following
-    // logic:
+    // The image is decoded directly to the dimensions it would have at the compression of the
+    // original file, and encodeImageToSize() then adjusts the quality and dimensions to the target size.
+    // The dimensions are estimated with the following logic:
     //
     // 1) First we figure out magic number (a) from the original image size (s) and width (w) and height(h).
     //    Magic number is basically a combination of the image depth (bits per pixel) and compression:
@@ -292,6 +856,10 @@ QString ImageOperation::scaleImageToSize(const QString &sourceFile, quint64 targ
                    << "NULL image";
         return QString();
     }
+
+    if (jobCanceled()) {
+        return QString();
+    }
     // Make sure orientation is right.
     int angle;
     bool mirrored;
@@ -307,16 +875,128 @@ QString ImageOperation::scaleImageToSize(const QString &sourceFile, quint64 targ
         image = image.transformed(transform);
     }
 
-    if (!image.save(tmpFile)) {
+    QByteArray format = QFileInfo(targetFile.isEmpty() ? sourceFile : targetFile).suffix().toLatin1();
+    if (format.isEmpty()) {
+        format = ir.format();
+    }
+
+    const QByteArray data = encodeImageToSize(image, format, targetSize);
+    if (data.isEmpty()) {
+        qWarning() << Q_FUNC_INFO
+                   << "Failed to encode the image to" << targetSize << "bytes";
+        return QString();
+    }
+
+    if (jobCanceled()) {
+        return QString();
+    }
+
+    QString tmpFile = targetFile;
+    if (tmpFile.isEmpty()) {
+        tmpFile = uniqueFilePath(sourceFile);
+    }
+
+    QFile file(tmpFile);
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()) {
         qWarning() << Q_FUNC_INFO
                    << "Failed to save scaled image to temp file!"
                    << tmpFile;
+        file.remove();
         return QString();
     }
 
+    ImageCache::instance()->insert(cacheKey, tmpFile);
     return tmpFile;
 }
 
+/*!
+    Removes the metadata of \a sourceFile like removeImageMetadata() in threadPool().
+
+    Returns a future for the path to the copy of the image with metadata removed.
+ */
+QFuture<QString> ImageOperation::removeImageMetadataAsync(const QString &sourceFile)
+{
+    return startJob([sourceFile] {
+        return removeImageMetadata(sourceFile);
+    });
+}
+
+/*!
+    Scales \a sourceFile using \a scaleFactor like scaleImage() in threadPool(). The scaled
+    image is stored to the \a targetFile or to a temporary file.
+
+    Returns a future for the path to the scaled image.
+ */
+QFuture<QString> ImageOperation::scaleImageAsync(const QString &sourceFile, qreal scaleFactor, const QString &targetFile)
+{
+    return startJob([sourceFile, scaleFactor, targetFile] {
+        return scaleImage(sourceFile, scaleFactor, targetFile);
+    });
+}
+
+/*!
+    Scales \a sourceFile to the \a targetSize like scaleImageToSize() in threadPool(). The
+    scaled image is stored to the \a targetFile or to a temporary file.
+
+    Returns a future for the path to the scaled image.
+ */
+QFuture<QString> ImageOperation::scaleImageToSizeAsync(const QString &sourceFile, quint64 targetSize, const QString &targetFile)
+{
+    return startJob([sourceFile, targetSize, targetFile] {
+        return scaleImageToSize(sourceFile, targetSize, targetFile);
+    });
+}
+
+/*!
+    Returns the thread pool running the asynchronous image operations. It runs at most two
+    operations at a time to bound the memory used for decoding the images.
+ */
+QThreadPool *ImageOperation::threadPool()
+{
+    static QThreadPool *pool = [] {
+        QThreadPool *pool = new QThreadPool;
+        pool->setMaxThreadCount(qBound(1, QThread::idealThreadCount(), IMAGE_OPERATION_MAX_THREADS));
+        return pool;
+    }();
+    return pool;
+}
+
+/*!
+    Returns the number of operations which have been served from the cache of processed images.
+ */
+quint64 ImageOperation::cacheHits()
+{
+    return ImageCache::instance()->hits();
+}
+
+/*!
+    Returns the number of operations which had to process the image because the result wasn't
+    in the cache.
+ */
+quint64 ImageOperation::cacheMisses()
+{
+    return ImageCache::instance()->misses();
+}
+
+/*!
+    Sets the maximum total size of the cached images to \a maxSize bytes. The least recently
+    used images are evicted when the next image is added. The default is 0, which disables the
+    cache. The cached images are copies of the source images, so clearCache() should be called
+    when the cache is disabled again.
+ */
+void ImageOperation::setCacheMaxSize(qint64 maxSize)
+{
+    ImageCache::instance()->setMaxSize(maxSize);
+}
+
+/*!
+    Removes all the cached images.
+ */
+void ImageOperation::clearCache()
+{
+    ImageCache::instance()->clear();
+}
+
 void ImageOperation::imageOrientation(const QString &sourceFile, int *angle, bool *mirror)
 {
     *angle = 0;
@@ -27,15 +27,28 @@
 
 #include <QString>
 #include <QDir>
+#include <QFuture>
+
+class QThreadPool;
 
 class ImageOperation
 {
 public:
-    static QString uniqueFilePath(const QString &sourceFilePath, const QString &path = QDir::tempPath());
+    static QString uniqueFilePath(const QString &sourceFilePath, const QString &path = QString());
     static QString removeImageMetadata(const QString &sourceFile);
     static QString scaleImage(const QString &sourceFile, qreal scaleFactor, const QString &targetFile=QString());
     static QString scaleImageToSize(const QString &sourceFile, quint64 targetSize, const QString &targetFile=QString());
     static void imageOrientation(const QString &sourceFile, int *angle, bool *mirror);
+
+    static QFuture<QString> removeImageMetadataAsync(const QString &sourceFile);
+    static QFuture<QString> scaleImageAsync(const QString &sourceFile, qreal scaleFactor, const QString &targetFile=QString());
+    static QFuture<QString> scaleImageToSizeAsync(const QString &sourceFile, quint64 targetSize, const QString &targetFile=QString());
+    static QThreadPool *threadPool();
+
+    static quint64 cacheHits();
+    static quint64 cacheMisses();
+    static void setCacheMaxSize(qint64 maxSize);
+    static void clearCache();
 };
 
 #endif // IMAGEOPERATION_H
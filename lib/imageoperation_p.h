@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef IMAGEOPERATION_P_H
+#define IMAGEOPERATION_P_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+
+// Quality range searched when encoding an image to a target size
+#define ENCODE_MIN_QUALITY 50
+#define ENCODE_MAX_QUALITY 95
+// An encoding this close below the target size is good enough
+#define ENCODE_SIZE_TOLERANCE 0.05
+// Upper bound of encodes tried to reach a target size
+#define ENCODE_MAX_ATTEMPTS 16
+
+QByteArray encodeImageToSize(const QImage &image, const QByteArray &format, quint64 targetSize,
+                             int *encodeCount = nullptr);
+
+// Directories removed together with their content, in which ImageOperation::uniqueFilePath()
+// keeps the file names, see MediaTransferInterface::scratchDirectory()
+void registerScratchDirectory(const QString &path);
+void unregisterScratchDirectory(const QString &path);
+
+#endif // IMAGEOPERATION_P_H
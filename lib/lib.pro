@@ -12,6 +12,7 @@ system(qdbusxml2cpp -v -c TransferEngineInterface -p transferengineinterface.h:t
 
 PUBLIC_HEADERS += \
     transferdbrecord.h \
+    transferprogress.h \
     metatypedeclarations.h \
     transfertypes.h \
     mediatransferinterface.h \
@@ -29,16 +30,20 @@ PUBLIC_HEADERS += \
 
 HEADERS += \
     sharingpluginloader_p.h \
+    imagecache_p.h \
+    imageoperation_p.h
 
 SOURCES += \
     transferdbrecord.cpp \
+    transferprogress.cpp \
     mediatransferinterface.cpp \
     mediaitem.cpp \
     sharingmethodinfo.cpp \
     sharingcontenthints.cpp \
     sharingpluginloader.cpp \
     transferengineclient.cpp \
-    imageoperation.cpp
+    imageoperation.cpp \
+    imagecache.cpp
 
 # generated files
 PUBLIC_HEADERS += \
@@ -24,6 +24,10 @@
 
 #include "mediatransferinterface.h"
 #include "mediaitem.h"
+#include "imageoperation_p.h"
+#include <QDir>
+#include <QFutureWatcher>
+#include <QTemporaryDir>
 #include <QtDebug>
 
 // Update progress (to dbus) only in every 5% progress changes
@@ -36,6 +40,9 @@ public:
     MediaTransferInterface::TransferStatus m_status = MediaTransferInterface::NotStarted;
     qreal m_progress = 0;
     qreal m_prevProgress = 0;
+    QList<QFutureWatcher<QString> *> m_imageOperations;
+    int m_nextImageOperationId = 0;
+    QTemporaryDir *m_scratchDirectory = nullptr;
 };
 
 
@@ -139,6 +146,15 @@ public:
     emitted by the subclass. It's emitted automatically when subclass calls setProgress().
 */
 
+/*!
+    \fn void MediaTransferInterface::imageProcessed(int operationId, const QString &filePath)
+
+    This signal is emitted when an image operation passed to processImage() has finished.
+    \a operationId is the id returned by processImage() and \a filePath is the path to the
+    processed file, or empty if the operation failed. The signal is not emitted for canceled
+    operations.
+*/
+
 
 
 /*!
@@ -152,6 +168,8 @@ MediaTransferInterface::MediaTransferInterface(QObject *parent):
 
 MediaTransferInterface::~MediaTransferInterface()
 {
+    cancelImageProcessing();
+    removeScratchDirectory();
     delete d_ptr;
     d_ptr = 0;
 }
@@ -232,15 +250,23 @@ void MediaTransferInterface::setStatus(TransferStatus status)
         emit progressUpdated(1);
     }
 
-    // Make sure that progress is set to 0 if transfer is canceled or
-    // interrupted
+    // Make sure that progress is set to 0 and images are not processed anymore if
+    // transfer is canceled or interrupted
     if (status == MediaTransferInterface::TransferCanceled ||
         status == MediaTransferInterface::TransferInterrupted) {
+        cancelImageProcessing();
         d->m_progress = 0;
         d->m_prevProgress = 0;
         emit progressUpdated(0);
     }
 
+    // The temporary files are not needed once the transfer has ended
+    if (status == MediaTransferInterface::TransferFinished ||
+        status == MediaTransferInterface::TransferCanceled ||
+        status == MediaTransferInterface::TransferInterrupted) {
+        removeScratchDirectory();
+    }
+
     // And update the status
     if (d->m_status != status) {
         d->m_status = status;
@@ -277,4 +303,78 @@ void MediaTransferInterface::setProgress(qreal progress)
     }
 }
 
+/*!
+    Watches an asynchronous image \a operation, e.g. one started with
+    ImageOperation::scaleImageAsync(), and emits imageProcessed() when the processed file
+    is ready. This lets the subclass start uploading as soon as the file is ready without
+    blocking the engine while the image is processed.
+
+    Returns an id which identifies the operation in imageProcessed(), so that several images
+    can be processed at the same time.
+
+    The operation is canceled if the transfer is canceled or interrupted, or if this object
+    is destroyed before the operation finishes.
+ */
+int MediaTransferInterface::processImage(const QFuture<QString> &operation)
+{
+    Q_D(MediaTransferInterface);
+    const int operationId = ++d->m_nextImageOperationId;
+    QFutureWatcher<QString> *watcher = new QFutureWatcher<QString>(this);
+    d->m_imageOperations.append(watcher);
+    connect(watcher, &QFutureWatcherBase::finished, this, [this, watcher, operationId] {
+        Q_D(MediaTransferInterface);
+        d->m_imageOperations.removeOne(watcher);
+        watcher->deleteLater();
+        if (!watcher->isCanceled()) {
+            emit imageProcessed(operationId, watcher->result());
+        } else if (watcher->future().resultCount() > 0) {
+            // Canceled after the operation had finished, so nobody is going to use the file
+            const QString filePath = watcher->result();
+            if (!filePath.isEmpty()) {
+                QFile::remove(filePath);
+            }
+        }
+    });
+    watcher->setFuture(operation);
+    return operationId;
+}
+
+void MediaTransferInterface::cancelImageProcessing()
+{
+    Q_D(MediaTransferInterface);
+    Q_FOREACH (QFutureWatcher<QString> *watcher, d->m_imageOperations) {
+        watcher->cancel();
+    }
+}
+
+/*!
+    Returns a directory for the temporary files of this transfer, e.g. to be passed to
+    ImageOperation::uniqueFilePath(). The directory is created on first use
+    and removed together with its content when the transfer finishes, is canceled or
+    interrupted, or when this object is destroyed. Returns an empty string if the directory
+    can't be created.
+ */
+QString MediaTransferInterface::scratchDirectory()
+{
+    Q_D(MediaTransferInterface);
+    if (!d->m_scratchDirectory) {
+        d->m_scratchDirectory = new QTemporaryDir(QDir::tempPath() + QLatin1String("/nemo-transfer-XXXXXX"));
+        if (!d->m_scratchDirectory->isValid()) {
+            qWarning() << "MediaTransferInterface::scratchDirectory: Failed to create a temporary directory";
+            removeScratchDirectory();
+            return QString();
+        }
+        registerScratchDirectory(d->m_scratchDirectory->path());
+    }
+    return d->m_scratchDirectory->path();
+}
 
+void MediaTransferInterface::removeScratchDirectory()
+{
+    Q_D(MediaTransferInterface);
+    if (d->m_scratchDirectory && d->m_scratchDirectory->isValid()) {
+        unregisterScratchDirectory(d->m_scratchDirectory->path());
+    }
+    delete d->m_scratchDirectory;
+    d->m_scratchDirectory = nullptr;
+}
@@ -25,6 +25,7 @@
 #ifndef MEDIATRANSFERINTERFACE_H
 #define MEDIATRANSFERINTERFACE_H
 #include <QObject>
+#include <QFuture>
 #include <QUrl>
 #include "transfertypes.h"
 
@@ -61,6 +62,8 @@ protected:
     void setMediaItem(MediaItem *mediaItem);
     void setStatus(MediaTransferInterface::TransferStatus status);
     void setProgress(qreal progress);
+    int processImage(const QFuture<QString> &operation);
+    QString scratchDirectory();
 
 public Q_SLOTS:
     virtual void start() = 0;
@@ -69,8 +72,12 @@ public Q_SLOTS:
 Q_SIGNALS:
     void statusChanged(MediaTransferInterface::TransferStatus status);
     void progressUpdated(qreal progress);
+    void imageProcessed(int operationId, const QString &filePath);
 
 private:
+    void cancelImageProcessing();
+    void removeScratchDirectory();
+
     MediaTransferInterfacePrivate *d_ptr = nullptr;
     Q_DECLARE_PRIVATE(MediaTransferInterface)
     friend class TransferEngine;
@@ -27,11 +27,14 @@
 #define METATYPEDECLARATIONS_H
 
 #include "transferdbrecord.h"
+#include "transferprogress.h"
 #include "sharingmethodinfo.h"
 #include <QList>
 
 Q_DECLARE_METATYPE(TransferDBRecord)
 Q_DECLARE_METATYPE(QList<TransferDBRecord>)
+Q_DECLARE_METATYPE(TransferProgress)
+Q_DECLARE_METATYPE(QList<TransferProgress>)
 Q_DECLARE_METATYPE(SharingMethodInfo)
 Q_DECLARE_METATYPE(QList<SharingMethodInfo>)
 
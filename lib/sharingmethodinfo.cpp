@@ -228,6 +228,10 @@ void SharingMethodInfo::setCapabilities(const QStringList &capabilities)
     d->capabilities = capabilities;
 }
 
+/*!
+    Returns true if this method can take multiple files at once. Such files should be
+    passed to the transfer engine in a single uploadMediaItems() D-Bus call.
+*/
 bool SharingMethodInfo::supportsMultipleFiles() const
 {
     Q_D(const SharingMethodInfo);
@@ -27,6 +27,8 @@
 
 #include <QtDBus>
 
+#include <utility>
+
 /*!
     \class TransferDBRecord
     \brief The TransferDBRecord class is a wrapper class for TransferEngine DBus message.
@@ -62,6 +64,7 @@
     \value ThumbnailIcon Thumbnail url
     \value CancelSupported Boolean to indicate if cancel is supported
     \value RestartSupported Boolean to indicate if cancel is supported
+    \value DateTime The time of the latest status change of the transfer as QDateTime
 */
 
 TransferDBRecord::TransferDBRecord()
@@ -89,6 +92,7 @@ TransferDBRecord &TransferDBRecord::operator=(const TransferDBRecord &other)
     thumbnail_icon  = other.thumbnail_icon;
     cancel_supported = other.cancel_supported;
     restart_supported = other.restart_supported;
+    timestamp_msecs = other.timestamp_msecs;
     return *this;
 }
 
@@ -111,10 +115,21 @@ TransferDBRecord::TransferDBRecord(const TransferDBRecord &other):
     application_icon(other.application_icon),
     thumbnail_icon(other.thumbnail_icon),
     cancel_supported(other.cancel_supported),
-    restart_supported(other.restart_supported)
+    restart_supported(other.restart_supported),
+    timestamp_msecs(other.timestamp_msecs)
 {
 }
 
+/*!
+    Move-assigns \a other to this transfer db record and returns a reference to this transfer db record.
+ */
+TransferDBRecord &TransferDBRecord::operator=(TransferDBRecord &&other) = default;
+
+/*!
+    Move-constructs a transfer db record from \a other.
+ */
+TransferDBRecord::TransferDBRecord(TransferDBRecord &&other) = default;
+
 TransferDBRecord::~TransferDBRecord()
 {
 }
@@ -170,6 +185,7 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, TransferDBRecord
              >> record.cancel_supported
              >> record.restart_supported;
     argument.endStructure();
+    record.timestamp_msecs = QDateTime::fromString(record.timestamp, Qt::ISODate).toMSecsSinceEpoch();
     return argument;
 }
 
@@ -237,12 +253,33 @@ QVariant TransferDBRecord::value(int index) const
     case  RestartSupported:
         return restart_supported;
 
+    case DateTime:
+        return dateTime();
+
     default:
         qWarning() << Q_FUNC_INFO << "Unknown index: " << index;
         return QVariant();
     }
 }
 
+/*!
+    Returns the time of the latest status change of the transfer in UTC.
+*/
+QDateTime TransferDBRecord::dateTime() const
+{
+    return QDateTime::fromMSecsSinceEpoch(timestamp_msecs, Qt::UTC);
+}
+
+/*!
+    Sets the time of the latest status change of the transfer to \a msecsSinceEpoch, updating
+    both timestamp_msecs and the ISO 8601 timestamp string.
+*/
+void TransferDBRecord::setTimestamp(qint64 msecsSinceEpoch)
+{
+    timestamp_msecs = msecsSinceEpoch;
+    timestamp = dateTime().toString(Qt::ISODate);
+}
+
 bool TransferDBRecord::isValid() const
 {
     return transfer_id > 0 && transfer_type > 0;
@@ -26,6 +26,7 @@
 #define TRANSFERDBRECORD_H
 
 #include <QtGlobal>
+#include <QDateTime>
 #include <QDBusArgument>
 
 class TransferDBRecord
@@ -47,12 +48,15 @@ public:
         ApplicationIcon,
         ThumbnailIcon,
         CancelSupported,
-        RestartSupported
+        RestartSupported,
+        DateTime
     };
 
     TransferDBRecord();
     TransferDBRecord &operator=(const TransferDBRecord &other);
     TransferDBRecord(const TransferDBRecord &other);
+    TransferDBRecord &operator=(TransferDBRecord &&other);
+    TransferDBRecord(TransferDBRecord &&other);
     ~TransferDBRecord();
 
 
@@ -63,6 +67,9 @@ public:
 
     QVariant value(int index) const;
 
+    QDateTime dateTime() const;
+    void setTimestamp(qint64 msecsSinceEpoch);
+
     bool isValid() const;
 
     friend bool operator ==(const TransferDBRecord &left, const TransferDBRecord &right);
@@ -87,6 +94,7 @@ public:
     QString thumbnail_icon;
     bool    cancel_supported = false;
     bool    restart_supported = false;
+    qint64  timestamp_msecs = 0; // the time of timestamp in milliseconds since the epoch
 };
 
 bool operator ==(const TransferDBRecord &left, const TransferDBRecord &right);
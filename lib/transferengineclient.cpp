@@ -26,6 +26,8 @@
 #include "transferengineclient.h"
 #include "transferengineinterface.h"
 
+#include <QMetaMethod>
+
 
 class CallbackInterfacePrivate {
 public:
@@ -100,6 +102,7 @@ class TransferEngineClientPrivate
 {
 public:
     TransferEngineInterface *m_client = nullptr;
+    bool m_progressConnected = false;
 };
 
 /*!
@@ -201,6 +204,37 @@ TransferEngineClient::~TransferEngineClient()
     d_ptr = 0;
 }
 
+/*!
+    \fn void TransferEngineClient::progressChanged(int transferId, qreal progress)
+
+    The signal is emitted when \a progress for a transfer with a \a transferId has changed.
+    Progress changes are delivered by TransferEngine in batches, so the signal may be emitted
+    for several transfers at once.
+*/
+
+/*!
+    \reimp
+
+    Subscribes to the progress updates of TransferEngine only once progressChanged()
+    is connected, clients which don't follow the progress are not woken up by them.
+*/
+void TransferEngineClient::connectNotify(const QMetaMethod &signal)
+{
+    Q_D(TransferEngineClient);
+    if (d->m_progressConnected || signal != QMetaMethod::fromSignal(&TransferEngineClient::progressChanged)) {
+        return;
+    }
+
+    TransferProgress::registerType();
+    d->m_progressConnected = true;
+    connect(d->m_client, &TransferEngineInterface::progressBatch,
+            this, [this](const QList<TransferProgress> &progress) {
+        Q_FOREACH(const TransferProgress &update, progress) {
+            emit progressChanged(update.transfer_id, update.progress);
+        }
+    });
+}
+
 /*!
     Creates a download event to the TransferEngine. This method requires the following parameters
     \a displayName, a human readable name for the entry. \a applicationIcon is the \c QUrl to the icon
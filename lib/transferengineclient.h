@@ -76,6 +76,12 @@ public:
     void updateTransferProgress(int transferId, qreal progress);
     void finishTransfer(int transferId, Status status, const QString &reason = QString());
 
+Q_SIGNALS:
+    void progressChanged(int transferId, qreal progress);
+
+protected:
+    void connectNotify(const QMetaMethod &signal);
+
 private:
     void cbCancelTransfer(int transferId);
     void cbRestartTransfer(int transferId);
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "transferprogress.h"
+#include "metatypedeclarations.h"
+
+#include <QtDBus>
+
+/*!
+    \class TransferProgress
+    \brief The TransferProgress class is a wrapper class for a single progress update in TransferEngine DBus message.
+
+    \ingroup transfer-engine-lib
+
+    TransferEngine collects progress changes of the transfers over a short period of time and
+    passes them to the clients as a list of TransferProgress instances in the progressBatch signal.
+ */
+
+TransferProgress::TransferProgress()
+{
+}
+
+/*!
+    Constructs a progress update with \a progress for the transfer with a \a transferId.
+ */
+TransferProgress::TransferProgress(int transferId, double progress)
+    : transfer_id(transferId)
+    , progress(progress)
+{
+}
+
+/*!
+    Writes the given \a progress to specified \a argument.
+*/
+QDBusArgument &operator<<(QDBusArgument &argument, const TransferProgress &progress)
+{
+    argument.beginStructure();
+    argument << progress.transfer_id
+             << progress.progress;
+    argument.endStructure();
+    return argument;
+}
+
+/*!
+    Reads the given \a argument and stores it to the specified \a progress.
+*/
+const QDBusArgument &operator>>(const QDBusArgument &argument, TransferProgress &progress)
+{
+    argument.beginStructure();
+    argument >> progress.transfer_id
+             >> progress.progress;
+    argument.endStructure();
+    return argument;
+}
+
+/*!
+    Registers TransferProgress and QList<TransferProgress> as DBus types.
+ */
+void TransferProgress::registerType()
+{
+    qDBusRegisterMetaType<TransferProgress>();
+    qDBusRegisterMetaType<QList<TransferProgress> >();
+}
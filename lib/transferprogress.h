@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef TRANSFERPROGRESS_H
+#define TRANSFERPROGRESS_H
+
+#include <QtGlobal>
+#include <QDBusArgument>
+
+class TransferProgress
+{
+public:
+    TransferProgress();
+    TransferProgress(int transferId, double progress);
+
+    friend QDBusArgument &operator<<(QDBusArgument &argument, const TransferProgress &progress);
+    friend const QDBusArgument &operator>>(const QDBusArgument &argument, TransferProgress &progress);
+
+    static void registerType();
+
+    int     transfer_id = 0;
+    double  progress = 0;
+};
+
+#endif // TRANSFERPROGRESS_H
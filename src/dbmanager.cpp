@@ -23,6 +23,8 @@
  */
 
 #include "dbmanager.h"
+#include "dbmigration.h"
+#include "dbworker.h"
 #include "transfertypes.h"
 #include "mediaitem.h"
 
@@ -34,164 +36,921 @@
 #include <QDateTime>
 #include <QFile>
 #include <QDir>
+#include <QCache>
+#include <QHash>
+#include <QMap>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QTimer>
+
+#include <climits>
 
 #define DB_PATH ".local/nemo-transferengine"
 #define DB_NAME "transferdb.sqlite"
+#define DB_CONNECTION "transferengine"
+
+// Default interval for writing buffered progress updates to the database
+#define PROGRESS_FLUSH_INTERVAL 2000 // 2 seconds in ms
+
+// Maximum number of transfers kept in the in-memory transfer cache
+#define TRANSFER_CACHE_SIZE 100
+
+// Time to wait for a lock held by a reader before failing a write
+#define BUSY_TIMEOUT 5000 // 5 seconds in ms
 
-// Table for metadata
-#define DROP_METADATA   "DROP TABLE metadata;"
-#define TABLE_METADATA  "CREATE TABLE metadata  (metadata_id INTEGER PRIMARY KEY AUTOINCREMENT,\n" \
-                        "title TEXT,\n" \
-                        "description TEXT,\n" \
-                        "transfer_id INTEGER NOT NULL,\n" \
-                        "FOREIGN KEY(transfer_id) REFERENCES transfers(transfer_id) ON DELETE CASCADE\n" \
-                        ");\n"
-
-// Table for callbacks. In practice there are dbus interfaces
-#define DROP_CALLBACK   "DROP TABLE callback;"
-#define TABLE_CALLBACK  "CREATE TABLE callback	(callback_id INTEGER PRIMARY KEY AUTOINCREMENT,\n" \
-                        "service TEXT,\n" \
-                        "path TEXT,\n" \
-                        "interface TEXT,\n"\
-                        "cancel_method TEXT,\n"\
-                        "restart_method TEXT,\n"\
-                        "transfer_id INTEGER NOT NULL,\n"\
-                        "FOREIGN KEY(transfer_id) REFERENCES transfers(transfer_id) ON DELETE CASCADE\n"\
-                        ");\n"
-
-// Table for all the transfers
-#define DROP_TRANSFERS  "DROP TABLE transfers;"
-#define TABLE_TRANSFERS "CREATE TABLE transfers (transfer_id INTEGER PRIMARY KEY AUTOINCREMENT,\n" \
-                        "transfer_type INTEGER,\n" \
-                        "timestamp TEXT,\n" \
-                        "status INTEGER,\n" \
-                        "progress REAL,\n" \
-                        "display_name TEXT,\n" \
-                        "application_icon TEXT,\n"\
-                        "thumbnail_icon TEXT,\n"\
-                        "service_icon TEXT,\n" \
-                        "url TEXT,\n" \
-                        "resource_name TEXT,\n" \
-                        "mime_type TEXT,\n" \
-                        "file_size INTEGER,\n" \
-                        "plugin_id TEXT,\n" \
-                        "account_id TEXT,\n"\
-                        "strip_metadata INTEGER,\n" \
-                        "scale_percent REAL,\n" \
-                        "cancel_supported INTEGER,\n" \
-                        "restart_supported INTEGER,\n" \
-                        "notification_id INTEGER\n" \
-                        ");\n"
-
-// Cascade trigger i.e. when transfer is removed and it has metadata or callbacks, this
-// trigger make sure that they are also removed
-#define DROP_TRIGGER    "DROP TRIGGER delete_cascade;"
-#define TRIGGER         "CREATE TRIGGER delete_cascade\n" \
-                        "BEFORE DELETE ON transfers\n" \
-                        "FOR EACH ROW BEGIN\n" \
-                        "    DELETE FROM metadata WHERE transfer_id = OLD.transfer_id;\n" \
-                        "    DELETE FROM callback WHERE transfer_id = OLD.transfer_id;\n" \
-                        "END;\n"
-
-// Update the following version if database schema changes.
-#define USER_VERSION 2
-#define PRAGMA_USER_VERSION   QString("PRAGMA user_version=%1").arg(USER_VERSION)
+// Interval for moving committed pages from the write-ahead log to the database file
+#define WAL_CHECKPOINT_INTERVAL 60000 // 1 minute in ms
+
+// Value of the auto_vacuum pragma in incremental mode
+#define AUTO_VACUUM_INCREMENTAL 2
+
+// Columns needed for filling TransferDBRecord, in the order read by DbManager::transfers()
+#define RECORD_COLUMNS  "transfer_id, transfer_type, progress, url, status, plugin_id, display_name, " \
+                        "resource_name, mime_type, timestamp, file_size, application_icon, thumbnail_icon, " \
+                        "service_icon, cancel_supported, restart_supported"
+
+// In-memory copy of a single transfer, which is kept up to date on every write so that
+// the frequent lookups by transfer id don't need to touch the database.
+class TransferCacheEntry {
+public:
+    TransferEngineData::TransferType type = TransferEngineData::Undefined;
+    TransferEngineData::TransferStatus status = TransferEngineData::Unknown;
+    qreal progress = 0;
+    int notificationId = 0;
+    int priority = 0;
+    QStringList callback;
+    QMap<MediaItem::ValueKey, QVariant> values;
+};
+
+// New transfer, which has been assigned its keys but hasn't been written to the database yet.
+// Metadata and callback keys are -1 if the transfer doesn't have them.
+class PendingTransfer {
+public:
+    int key = -1;
+    int metadataKey = -1;
+    int callbackKey = -1;
+    qint64 timestamp = 0;
+    TransferCacheEntry entry;
+};
 
 class DbManagerPrivate {
 public:
+    // Statements of the frequent operations, see statement()
+    enum Statement {
+        InsertTransfer = 0,
+        InsertMetadata,
+        InsertCallback,
+        SelectTransfer,
+        SelectMetadata,
+        SelectCallback,
+        SelectTransfers,
+        SelectTransfersByStatus,
+        SelectTransfersPage,
+        SelectTransfersPageByStatus,
+        CountTransfers,
+        CountTransfersByStatus,
+        UpdateStatus,
+        UpdateStatusResetProgress,
+        UpdateProgress,
+        UpdateNotificationId,
+        InterruptUnfinishedTransfers,
+        DeleteTransfer,
+        DeleteInactiveTransfer,
+        DeleteInactiveTransfers,
+        DeleteFailedTransfers,
+        SelectExpiredTransfers,
+        StatementCount
+    };
+
+    DbManagerPrivate()
+        : m_cache(TRANSFER_CACHE_SIZE)
+    {
+        m_progressFlushTimer.setSingleShot(true);
+        m_progressFlushTimer.setInterval(PROGRESS_FLUSH_INTERVAL);
+        QObject::connect(&m_progressFlushTimer, &QTimer::timeout, [this] {
+            flushProgress();
+        });
+
+        m_checkpointTimer.setInterval(WAL_CHECKPOINT_INTERVAL);
+        QObject::connect(&m_checkpointTimer, &QTimer::timeout, [this] {
+            m_worker.post([this] {
+                checkpoint(QStringLiteral("PASSIVE"));
+            });
+        });
+    }
 
-    QString currentDateTime()
+    // Opens the connection, which is owned by the worker thread, and brings the schema up to date.
+    // Returns true if the database is ready for use.
+    bool openDatabase(const QString &path)
     {
-        QDateTime dt = QDateTime::currentDateTimeUtc();
-        return dt.toString(Qt::ISODate);
+        m_db = QSqlDatabase::addDatabase("QSQLITE", DB_CONNECTION);
+        m_db.setDatabaseName(path);
+        m_db.setConnectOptions(QStringLiteral("foreign_keys = ON;QSQLITE_BUSY_TIMEOUT=%1").arg(BUSY_TIMEOUT)); // sanity check
+        if (!m_db.open()) {
+            qWarning() << "DbManagerPrivate::openDatabase: Failed to open the database"
+                       << m_db.lastError().text();
+            return false;
+        }
+
+        // Journal mode can't be changed inside a transaction, so set it up before touching the schema
+        const bool walEnabled = configureDatabase();
+
+        // Existing databases are upgraded step by step keeping the transfers. A failed upgrade
+        // is retried on the next start, the tables are recreated from scratch only if the
+        // database is corrupt.
+        if (!DbMigration::migrate(m_db)) {
+            if (DbMigration::isCorrupt(m_db)) {
+                qWarning() << "DbManagerPrivate::openDatabase: The database is corrupt, recreating it";
+                if (!DbMigration::recreate(m_db)) {
+                    qCritical("DbManagerPrivate::openDatabase: Failed to create DB schema. Can't continue!");
+                    return false;
+                }
+            } else {
+                qWarning() << "DbManagerPrivate::openDatabase: Failed to migrate the database, keeping version"
+                           << DbMigration::userVersion(m_db) << "until the next start";
+            }
+        }
+
+        readNextKeys();
+        return walEnabled;
     }
 
-    bool createDatabaseSchema()
+    void closeDatabase()
     {
-        bool ok = true;
-        QSqlQuery query;
-        if (!query.exec(TABLE_METADATA)) {
-            qWarning() << "DbManagerPrivate::createDatabase: create metadata table: "
-                       << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+        for (int i = 0; i < StatementCount; ++i) {
+            m_statements[i] = QSqlQuery();
+        }
+        if (m_db.isOpen()) {
+            checkpoint(QStringLiteral("TRUNCATE"));
+            m_db.close();
         }
-        if (!query.exec(TABLE_CALLBACK)) {
-            qWarning() << "DbManagerPrivate::createDatabase: create callback table: "
+        m_db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(DB_CONNECTION);
+    }
+
+    // Keys are assigned when the transfers are created, before the rows are written. The
+    // sequences of the AUTOINCREMENT tables hold the largest key ever used.
+    void readNextKeys()
+    {
+        QSqlQuery query(m_db);
+        if (!query.exec(QStringLiteral("SELECT name, seq FROM sqlite_sequence"))) {
+            qWarning() << "DbManagerPrivate::readNextKeys: Failed to read the key sequences"
                        << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+            return;
         }
-        if (!query.exec(TABLE_TRANSFERS)) {
-            qWarning() << "DbManagerPrivate::createDatabase: create transfer table: "
+        while (query.next()) {
+            const QString table = query.value(0).toString();
+            const int next = query.value(1).toInt() + 1;
+            if (table == QLatin1String("transfers")) {
+                m_nextTransferKey = next;
+            } else if (table == QLatin1String("metadata")) {
+                m_nextMetadataKey = next;
+            } else if (table == QLatin1String("callback")) {
+                m_nextCallbackKey = next;
+            }
+        }
+        query.finish();
+    }
+
+    // Uses write-ahead logging so that TransferModel instances can read the database while
+    // the engine writes to it. With WAL a commit is durable after the next checkpoint when
+    // synchronous is NORMAL, losing the latest progress on power loss is acceptable.
+    bool configureDatabase()
+    {
+        QSqlQuery query(m_db);
+        if (!query.exec(QStringLiteral("PRAGMA journal_mode=WAL")) || !query.next()
+                || query.value(0).toString().compare(QLatin1String("wal"), Qt::CaseInsensitive) != 0) {
+            qWarning() << "DbManagerPrivate::configureDatabase: Failed to enable WAL journal mode"
                        << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+            return false;
         }
-        if (!query.exec(TRIGGER)) {
-            qWarning() << "DbManagerPrivate::createDatabase: create cascade trigger: "
+        query.finish();
+
+        if (!query.exec(QStringLiteral("PRAGMA synchronous=NORMAL"))) {
+            qWarning() << "DbManagerPrivate::configureDatabase: Failed to set synchronous mode"
                        << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+            return false;
         }
-        if (!query.exec(PRAGMA_USER_VERSION)) {
-            qWarning() << "DbManagerPrivate::createDatabase: pragma user_version: "
+
+        // A new database uses incremental auto vacuum from the start. Existing ones are
+        // switched by incrementalVacuum() while the engine is idle.
+        if (query.exec(QStringLiteral("SELECT COUNT(*) FROM sqlite_master")) && query.next()
+                && query.value(0).toInt() == 0) {
+            query.finish();
+            if (!query.exec(QStringLiteral("PRAGMA auto_vacuum=INCREMENTAL"))) {
+                qWarning() << "DbManagerPrivate::configureDatabase: Failed to enable incremental vacuum"
+                           << query.lastError().text() << ":" << query.lastError().databaseText();
+            }
+        }
+        query.finish();
+        return true;
+    }
+
+    bool checkpoint(const QString &mode)
+    {
+        QSqlQuery query(m_db);
+        if (!query.exec(QStringLiteral("PRAGMA wal_checkpoint(%1)").arg(mode))) {
+            qWarning() << "DbManagerPrivate::checkpoint: Failed to checkpoint the database"
                        << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+            return false;
         }
         query.finish();
-        return ok;
+        return true;
+    }
+
+    // Returns the prepared statement, which is prepared on first use and kept for the lifetime
+    // of the connection so that SQLite parses and plans it only once. Callers must bind all
+    // the values and finish() the statement after use.
+    QSqlQuery &statement(Statement statement) const
+    {
+        static const char * const sql[StatementCount] = {
+            // InsertTransfer
+            "INSERT INTO transfers (transfer_id, transfer_type, timestamp, status, progress, display_name, application_icon, thumbnail_icon, "
+            "  service_icon, url, resource_name, mime_type, file_size, plugin_id, account_id, strip_metadata, scale_percent, "
+            "  cancel_supported, restart_supported, notification_id, priority)"
+            "VALUES (:transfer_id, :transfer_type, :timestamp, :status, :progress, :display_name, :application_icon, :thumbnail_icon, "
+            "  :service_icon, :url, :resource_name, :mime_type, :file_size, :plugin_id, :account_id, :strip_metadata, :scale_percent, "
+            "  :cancel_supported, :restart_supported, :notification_id, :priority)",
+            // InsertMetadata
+            "INSERT INTO metadata (metadata_id, title, description, transfer_id)"
+            "VALUES (:metadata_id, :title, :description, :transfer_id)",
+            // InsertCallback
+            "INSERT INTO callback (callback_id, service, path, interface, cancel_method, restart_method, transfer_id)"
+            "VALUES (:callback_id, :service, :path, :interface, :cancel_method, :restart_method, :transfer_id)",
+            // SelectTransfer
+            "SELECT * FROM transfers WHERE transfer_id=:transfer_id;",
+            // SelectMetadata
+            "SELECT title, description FROM metadata WHERE transfer_id=:transfer_id;",
+            // SelectCallback
+            "SELECT service, path, interface, cancel_method, restart_method FROM callback WHERE transfer_id=:transfer_id;",
+            // SelectTransfers
+            "SELECT " RECORD_COLUMNS " FROM transfers ORDER BY transfer_id DESC",
+            // SelectTransfersByStatus
+            "SELECT " RECORD_COLUMNS " FROM transfers WHERE status=:status ORDER BY transfer_id DESC",
+            // SelectTransfersPage
+            "SELECT " RECORD_COLUMNS " FROM transfers WHERE transfer_id<:cursor ORDER BY transfer_id DESC LIMIT :limit",
+            // SelectTransfersPageByStatus
+            "SELECT " RECORD_COLUMNS " FROM transfers WHERE status=:status AND transfer_id<:cursor "
+            "ORDER BY transfer_id DESC LIMIT :limit",
+            // CountTransfers
+            "SELECT COUNT(transfer_id) FROM transfers",
+            // CountTransfersByStatus
+            "SELECT COUNT(transfer_id) FROM transfers WHERE status=:status",
+            // UpdateStatus
+            "UPDATE transfers SET status=:status, timestamp=:timestamp WHERE transfer_id=:transfer_id;",
+            // UpdateStatusResetProgress
+            "UPDATE transfers SET status=:status, progress=0, timestamp=:timestamp WHERE transfer_id=:transfer_id;",
+            // UpdateProgress
+            "UPDATE transfers SET progress=:progress WHERE transfer_id=:transfer_id;",
+            // UpdateNotificationId
+            "UPDATE transfers SET notification_id=:notification_id WHERE transfer_id=:transfer_id;",
+            // InterruptUnfinishedTransfers
+            "UPDATE transfers SET status=:interrupted, timestamp=:timestamp WHERE status IN (:not_started, :started);",
+            // DeleteTransfer
+            "DELETE FROM transfers WHERE transfer_id=:transfer_id;",
+            // DeleteInactiveTransfer
+            "DELETE FROM transfers WHERE transfer_id=:transfer_id AND (status=:finished OR status=:canceled OR status=:interrupted);",
+            // DeleteInactiveTransfers
+            "DELETE FROM transfers WHERE status=:finished OR status=:canceled OR status=:interrupted;",
+            // DeleteFailedTransfers
+            "DELETE FROM transfers WHERE transfer_id!=:exclude_id AND status=:status AND transfer_type=:transfer_type "
+            "AND display_name=(SELECT display_name FROM transfers WHERE transfer_id=:name_id);",
+            // SelectExpiredTransfers
+            "SELECT transfer_id FROM transfers WHERE (status=:finished OR status=:canceled OR status=:interrupted) "
+            "AND (timestamp<:expired OR (status=:failed AND timestamp<:failed_expired) "
+            "  OR transfer_id<=(SELECT transfer_id FROM transfers ORDER BY transfer_id DESC LIMIT 1 OFFSET :max_transfers)) "
+            "ORDER BY transfer_id LIMIT :batch_size;"
+        };
+
+        QSqlQuery &query = m_statements[statement];
+        if (query.lastQuery().isEmpty()) {
+            query = QSqlQuery(m_db);
+            if (!query.prepare(QLatin1String(sql[statement]))) {
+                qWarning() << "DbManagerPrivate::statement: Failed to prepare SQL query" << sql[statement]
+                           << query.lastError().text() << ": "
+                           << query.lastError().databaseText();
+                query = QSqlQuery();
+            }
+        }
+        return query;
+    }
+
+    void bindInactiveStatuses(QSqlQuery &query)
+    {
+        query.bindValue(":finished",    TransferEngineData::TransferFinished);
+        query.bindValue(":canceled",    TransferEngineData::TransferCanceled);
+        query.bindValue(":interrupted", TransferEngineData::TransferInterrupted);
     }
 
-    bool deleteOldTables()
+    // Reads the rows of a query selecting RECORD_COLUMNS
+    void readRecords(QSqlQuery &query, QList<TransferDBRecord> *records) const
     {
+        // The record could actually contain eg. QVariantList instead of hardcoded and
+        // typed members. Columns are read in the order of RECORD_COLUMNS.
+        while (query.next()) {
+            int i = 0;
+            TransferDBRecord record;
+            record.transfer_id          = query.value(i++).toInt();
+            record.transfer_type        = query.value(i++).toInt();
+            record.progress             = query.value(i++).toDouble();
+            record.url                  = query.value(i++).toString();
+            record.status               = query.value(i++).toInt();
+            record.plugin_id            = query.value(i++).toString();
+            record.display_name         = query.value(i++).toString();
+            record.resource_name        = query.value(i++).toString();
+            record.mime_type            = query.value(i++).toString();
+            record.setTimestamp(query.value(i++).toLongLong());
+            record.size                 = query.value(i++).toInt();
+            record.application_icon     = query.value(i++).toString();
+            record.thumbnail_icon       = query.value(i++).toString();
+            record.service_icon         = query.value(i++).toString();
+            record.cancel_supported     = query.value(i++).toBool();
+            record.restart_supported    = query.value(i++).toBool();
+            *records << record;
+        }
+        query.finish();
+    }
+
+    // Progress which hasn't been flushed yet is more recent than the stored one
+    void applyPendingProgress(QList<TransferDBRecord> *records) const
+    {
+        if (!m_pendingProgress.isEmpty()) {
+            for (TransferDBRecord &record : *records) {
+                record.progress = m_pendingProgress.value(record.transfer_id, record.progress);
+            }
+        }
+    }
+
+    // Timestamps are stored as milliseconds since the epoch
+    qint64 currentDateTime()
+    {
+        return QDateTime::currentMSecsSinceEpoch();
+    }
+
+    // Hands all the buffered progress values to the worker thread. If the write fails, the
+    // values are retried with the next flush, see retryProgress().
+    void flushProgress()
+    {
+        m_progressFlushTimer.stop();
+        if (m_pendingProgress.isEmpty()) {
+            return;
+        }
+
+        const QHash<int, qreal> pending = m_pendingProgress;
+        m_pendingProgress.clear();
+        const QSharedPointer<bool> ok(new bool(false));
+        const quint64 statusChanges = m_statusChanges;
+        ++m_progressWrites;
+        m_worker.post([this, pending, ok] {
+            *ok = writeProgress(pending);
+        }, &m_callbackContext, [this, pending, ok, statusChanges] {
+            --m_progressWrites;
+            if (!*ok) {
+                retryProgress(pending, statusChanges);
+            }
+            if (m_progressWrites == 0) {
+                m_statusChangesDuringWrite.clear();
+            }
+        });
+    }
+
+    // Buffers the progress values of a failed write again for the next flush, except the ones
+    // which have been updated since or whose status has changed after the write was started.
+    // A status change may have reset the progress, which the old value must not overwrite.
+    void retryProgress(const QHash<int, qreal> &pending, quint64 statusChanges)
+    {
+        QList<int> dropped;
+        for (QHash<int, qreal>::const_iterator i = pending.constBegin(); i != pending.constEnd(); ++i) {
+            if (m_statusChangesDuringWrite.value(i.key()) > statusChanges
+                    || m_progressFlushTimer.interval() <= 0) {
+                dropped << i.key();
+            } else if (!m_pendingProgress.contains(i.key())) {
+                m_pendingProgress.insert(i.key(), i.value());
+            }
+        }
+        if (!dropped.isEmpty()) {
+            qWarning() << "DbManagerPrivate::flushProgress: Dropped the progress of transfers" << dropped;
+        }
+        if (!m_pendingProgress.isEmpty() && !m_progressFlushTimer.isActive() && m_progressFlushTimer.interval() > 0) {
+            m_progressFlushTimer.start();
+        }
+    }
+
+    // Records a status change of the transfer with the key for the progress writes in flight
+    void statusChanged(int key)
+    {
+        ++m_statusChanges;
+        if (m_progressWrites > 0) {
+            m_statusChangesDuringWrite.insert(key, m_statusChanges);
+        }
+    }
+
+    // Writes the progress values to the database in a single transaction
+    bool writeProgress(const QHash<int, qreal> &pending)
+    {
+
+        if (!m_db.transaction()) {
+            qWarning() << "DbManagerPrivate::writeProgress: Failed to begin transaction"
+                       << m_db.lastError().text();
+        }
+
         bool ok = true;
-        QSqlQuery query;
-        if (!query.exec(DROP_TRIGGER)) {
-            qWarning() << Q_FUNC_INFO << "Drop trigger:"
-                       << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+        QSqlQuery &query = statement(UpdateProgress);
+        for (QHash<int, qreal>::const_iterator i = pending.constBegin(); i != pending.constEnd(); ++i) {
+            query.bindValue(":progress",    i.value());
+            query.bindValue(":transfer_id", i.key());
+            if (!query.exec()) {
+                qWarning() << "DbManagerPrivate::writeProgress: Failed to execute SQL query. Couldn't update the progress!"
+                           << query.lastError().text() << ": "
+                           << query.lastError().databaseText();
+                ok = false;
+            }
         }
-        if (!query.exec(DROP_METADATA)) {
-            qWarning() << Q_FUNC_INFO << "Drop metadata:"
-                       << query.lastError().text() << ":" << query.lastError().databaseText();
+        query.finish();
+
+        if (!m_db.commit()) {
+            qWarning() << "DbManagerPrivate::writeProgress: Failed to commit progress updates"
+                       << m_db.lastError().text();
+            m_db.rollback();
             ok = false;
         }
-        if (!query.exec(DROP_CALLBACK)) {
-            qWarning() << Q_FUNC_INFO << "Drop callback:"
-                       << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+        return ok;
+    }
+
+    // Returns the cached transfer with the key or loads it from the database. Returns null
+    // if the transfer doesn't exist.
+    TransferCacheEntry *cachedTransfer(int key) const
+    {
+        TransferCacheEntry *entry = m_cache.object(key);
+        if (entry) {
+            ++m_cacheHits;
+            return entry;
         }
-        if (!query.exec(DROP_TRANSFERS)) {
-            qWarning() << Q_FUNC_INFO << "Drop transfers:"
-                       << query.lastError().text() << ":" << query.lastError().databaseText();
-            ok = false;
+
+        ++m_cacheMisses;
+        m_worker.call([this, key, &entry] {
+            entry = loadTransfer(key);
+        });
+        if (entry) {
+            // Progress which hasn't been flushed yet is more recent than the stored one
+            entry->progress = m_pendingProgress.value(key, entry->progress);
+            m_cache.insert(key, entry);
+        }
+        return entry;
+    }
+
+    TransferCacheEntry *loadTransfer(int key) const
+    {
+        QSqlQuery &query = statement(SelectTransfer);
+        query.bindValue(":transfer_id", key);
+        if (!query.exec()) {
+            qWarning() << "DbManagerPrivate::loadTransfer: Failed to execute SQL query. Couldn't get the transfer!"
+                       << query.lastError().text() << ": "
+                       << query.lastError().databaseText();
+            return 0;
+        }
+
+        QSqlRecord rec = query.record();
+        if (!query.next()) {
+            query.finish();
+            return 0;
         }
 
+        TransferCacheEntry *entry = new TransferCacheEntry;
+        entry->type = static_cast<TransferEngineData::TransferType>(query.value(rec.indexOf("transfer_type")).toInt());
+        entry->status = static_cast<TransferEngineData::TransferStatus>(query.value(rec.indexOf("status")).toInt());
+        entry->progress = query.value(rec.indexOf("progress")).toReal();
+        entry->notificationId = query.value(rec.indexOf("notification_id")).toInt();
+        entry->priority = query.value(rec.indexOf("priority")).toInt();
+        entry->values.insert(MediaItem::Url,             query.value(rec.indexOf("url")));
+        entry->values.insert(MediaItem::MetadataStripped,query.value(rec.indexOf("strip_metadata")));
+        entry->values.insert(MediaItem::ScalePercent,    query.value(rec.indexOf("scale_percent")));
+        entry->values.insert(MediaItem::ResourceName,    query.value(rec.indexOf("resource_name")));
+        entry->values.insert(MediaItem::MimeType,        query.value(rec.indexOf("mime_type")));
+        entry->values.insert(MediaItem::TransferType,    query.value(rec.indexOf("transfer_type")));
+        entry->values.insert(MediaItem::FileSize,        query.value(rec.indexOf("file_size")));
+        entry->values.insert(MediaItem::PluginId,        query.value(rec.indexOf("plugin_id")));
+        entry->values.insert(MediaItem::AccountId,       query.value(rec.indexOf("account_id")));
+        entry->values.insert(MediaItem::DisplayName,     query.value(rec.indexOf("display_name")));
+        entry->values.insert(MediaItem::ServiceIcon,     query.value(rec.indexOf("service_icon")));
+        entry->values.insert(MediaItem::ApplicationIcon, query.value(rec.indexOf("application_icon")));
+        entry->values.insert(MediaItem::ThumbnailIcon,   query.value(rec.indexOf("thumbnail_icon")));
+        entry->values.insert(MediaItem::CancelSupported, query.value(rec.indexOf("cancel_supported")));
+        entry->values.insert(MediaItem::RestartSupported,query.value(rec.indexOf("restart_supported")));
         query.finish();
+
+        // NOTE: There might be that user hasn't set any title or description
+        QSqlQuery &metadataQuery = statement(SelectMetadata);
+        metadataQuery.bindValue(":transfer_id", key);
+        if (!metadataQuery.exec()) {
+            qWarning() << "DbManagerPrivate::loadTransfer: Failed to execute SQL query. Couldn't get the metadata!"
+                       << metadataQuery.lastError().text() << ": "
+                       << metadataQuery.lastError().databaseText();
+            delete entry;
+            return 0;
+        }
+        if (metadataQuery.next()) {
+            entry->values.insert(MediaItem::Title,       metadataQuery.value(0));
+            entry->values.insert(MediaItem::Description, metadataQuery.value(1));
+        }
+        metadataQuery.finish();
+
+        QSqlQuery &callbackQuery = statement(SelectCallback);
+        callbackQuery.bindValue(":transfer_id", key);
+        if (!callbackQuery.exec()) {
+            qWarning() << "DbManagerPrivate::loadTransfer: Failed to execute SQL query. Couldn't get the callback!"
+                       << callbackQuery.lastError().text() << ": "
+                       << callbackQuery.lastError().databaseText();
+            delete entry;
+            return 0;
+        }
+        if (callbackQuery.next()) {
+            entry->callback << callbackQuery.value(0).toString()
+                            << callbackQuery.value(1).toString()
+                            << callbackQuery.value(2).toString()
+                            << callbackQuery.value(3).toString()
+                            << callbackQuery.value(4).toString();
+        }
+        callbackQuery.finish();
+
+        return entry;
+    }
+
+    // Reserves the keys for a new transfer and copies the values stored for it from the media item
+    PendingTransfer newTransfer(const MediaItem *mediaItem)
+    {
+        PendingTransfer transfer;
+        transfer.key = m_nextTransferKey++;
+        transfer.timestamp = currentDateTime();
+
+        TransferCacheEntry &entry = transfer.entry;
+        entry.type = static_cast<TransferEngineData::TransferType>(mediaItem->value(MediaItem::TransferType).toInt());
+        entry.status = TransferEngineData::NotStarted;
+        entry.priority = mediaItem->value(MediaItem::UserData).toMap().value("priority").toInt();
+
+        static const MediaItem::ValueKey storedKeys[] = {
+            MediaItem::Url, MediaItem::MetadataStripped, MediaItem::ScalePercent, MediaItem::ResourceName,
+            MediaItem::MimeType, MediaItem::TransferType, MediaItem::FileSize, MediaItem::PluginId,
+            MediaItem::AccountId, MediaItem::DisplayName, MediaItem::ServiceIcon, MediaItem::ApplicationIcon,
+            MediaItem::ThumbnailIcon, MediaItem::CancelSupported, MediaItem::RestartSupported
+        };
+        for (MediaItem::ValueKey valueKey : storedKeys) {
+            entry.values.insert(valueKey, mediaItem->value(valueKey));
+        }
+
+        // Create a metadata entry if user has passed any
+        const QString title = mediaItem->value(MediaItem::Title).toString();
+        const QString desc  = mediaItem->value(MediaItem::Description).toString();
+        if (!title.isEmpty() || !desc.isEmpty()) {
+            entry.values.insert(MediaItem::Title, title);
+            entry.values.insert(MediaItem::Description, desc);
+            transfer.metadataKey = m_nextMetadataKey++;
+        }
+
+        // Create a callback entry if it's been provided
+        const QStringList callback  = mediaItem->value(MediaItem::Callback).toStringList();
+        const QString cancelMethod  = mediaItem->value(MediaItem::CancelCBMethod).toString();
+        const QString restartMethod = mediaItem->value(MediaItem::RestartCBMethod).toString();
+
+        // One of the methods must exist if the callback has been provided
+        if (callback.count() == 3 && (!cancelMethod.isEmpty() || !restartMethod.isEmpty())) {
+            entry.callback = callback;
+            entry.callback << cancelMethod << restartMethod;
+            transfer.callbackKey = m_nextCallbackKey++;
+        }
+
+        return transfer;
+    }
+
+    // Writes the transfers together with their metadata and callbacks in a single transaction,
+    // so that a transfer is never stored without them and all the rows share one commit
+    bool writeTransfers(const QList<PendingTransfer> &transfers)
+    {
+        if (!m_db.transaction()) {
+            qWarning() << "DbManagerPrivate::writeTransfers: Failed to begin transaction"
+                       << m_db.lastError().text();
+            return false;
+        }
+
+        bool ok = true;
+        Q_FOREACH(const PendingTransfer &transfer, transfers) {
+            if (!insertTransfer(transfer)) {
+                ok = false;
+                break;
+            }
+        }
+
+        if (ok && !m_db.commit()) {
+            qWarning() << "DbManagerPrivate::writeTransfers: Failed to commit transfer entries"
+                       << m_db.lastError().text();
+            ok = false;
+        }
+
+        if (!ok) {
+            m_db.rollback();
+        }
         return ok;
     }
 
-    int userVersion()
+    bool insertTransfer(const PendingTransfer &transfer)
+    {
+        const QMap<MediaItem::ValueKey, QVariant> &values = transfer.entry.values;
+        QSqlQuery &query = statement(InsertTransfer);
+        query.bindValue(":transfer_id",         transfer.key);
+        query.bindValue(":transfer_type",       values.value(MediaItem::TransferType));
+        query.bindValue(":status",              TransferEngineData::NotStarted);
+        query.bindValue(":timestamp",           transfer.timestamp);
+        query.bindValue(":progress",            0);
+        query.bindValue(":display_name",        values.value(MediaItem::DisplayName));
+        query.bindValue(":application_icon",    values.value(MediaItem::ApplicationIcon));
+        query.bindValue(":thumbnail_icon",      values.value(MediaItem::ThumbnailIcon));
+        query.bindValue(":service_icon",        values.value(MediaItem::ServiceIcon));
+        query.bindValue(":url",                 values.value(MediaItem::Url));
+        query.bindValue(":resource_name",       values.value(MediaItem::ResourceName));
+        query.bindValue(":mime_type",           values.value(MediaItem::MimeType));
+        query.bindValue(":file_size",           values.value(MediaItem::FileSize));
+        query.bindValue(":plugin_id",           values.value(MediaItem::PluginId));
+        query.bindValue(":account_id",          values.value(MediaItem::AccountId));
+        query.bindValue(":strip_metadata",      values.value(MediaItem::MetadataStripped));
+        query.bindValue(":scale_percent",       values.value(MediaItem::ScalePercent));
+        query.bindValue(":cancel_supported",    values.value(MediaItem::CancelSupported));
+        query.bindValue(":restart_supported",   values.value(MediaItem::RestartSupported));
+        query.bindValue(":notification_id",     0);
+        query.bindValue(":priority",            transfer.entry.priority);
+
+        if (!query.exec()) {
+            qWarning() << "DbManagerPrivate::insertTransfer: Failed to execute SQL query. Couldn't create an entry!"
+                       << query.lastError().text() << ": "
+                       << query.lastError().databaseText();
+            return false;
+        }
+        query.finish();
+
+        if (transfer.metadataKey >= 0
+                && !insertMetadata(transfer.metadataKey, transfer.key,
+                                   values.value(MediaItem::Title).toString(),
+                                   values.value(MediaItem::Description).toString())) {
+            qWarning() << "DbManagerPrivate::insertTransfer: Failed to create metadata entry";
+            return false;
+        }
+
+        const QStringList &callback = transfer.entry.callback;
+        if (transfer.callbackKey >= 0
+                && !insertCallback(transfer.callbackKey, transfer.key, callback.at(0), callback.at(1),
+                                   callback.at(2), callback.at(3), callback.at(4))) {
+            qWarning() << "DbManagerPrivate::insertTransfer: Failed to create callback entry";
+            return false;
+        }
+        return true;
+    }
+
+    bool insertMetadata(int metadataKey, int key, const QString &title, const QString &description)
     {
-        const QString queryStr = QString("PRAGMA user_version");
+        QSqlQuery &query = statement(InsertMetadata);
+        query.bindValue(":metadata_id", metadataKey);
+        query.bindValue(":title",       title);
+        query.bindValue(":description", description);
+        query.bindValue(":transfer_id", key);
+
+        if (!query.exec()) {
+            qWarning() << "DbManagerPrivate::insertMetadata: Failed to execute SQL query. Couldn't create an entry!"
+                       << query.lastError().text() << ": "
+                       << query.lastError().databaseText();
+            return false;
+        }
+        query.finish();
+        return true;
+    }
 
-        QSqlQuery query;
-        if (!query.exec(queryStr)) {
-            qWarning() << "DbManager::callback: Failed to execute SQL query for user_version."
+    bool insertCallback(int callbackKey, int key, const QString &service, const QString &path,
+                        const QString &interface, const QString &cancelMethod, const QString &restartMethod)
+    {
+        QSqlQuery &query = statement(InsertCallback);
+        query.bindValue(":callback_id",     callbackKey);
+        query.bindValue(":service",         service);
+        query.bindValue(":path",            path);
+        query.bindValue(":interface",       interface);
+        query.bindValue(":cancel_method",   cancelMethod);
+        query.bindValue(":restart_method",  restartMethod);
+        query.bindValue(":transfer_id",     key);
+
+        if (!query.exec()) {
+            qWarning() << "DbManagerPrivate::insertCallback: Failed to execute SQL query. Couldn't create an entry!"
                        << query.lastError().text() << ": "
                        << query.lastError().databaseText();
+            return false;
+        }
+        query.finish();
+        return true;
+    }
+
+    // Writes the new transfers in the worker thread. If the write fails, the transfers are
+    // dropped from the cache before done is called with their keys and the result.
+    void writeLater(const QList<PendingTransfer> &transfers, QObject *context,
+                    const DbManager::CreateCallback &done)
+    {
+        const QSharedPointer<bool> ok(new bool(false));
+        const QPointer<QObject> guard(context);
+        m_worker.post([this, transfers, ok] {
+            *ok = writeTransfers(transfers);
+        }, &m_callbackContext, [this, transfers, ok, guard, done] {
+            QList<int> keys;
+            Q_FOREACH (const PendingTransfer &transfer, transfers) {
+                if (!*ok) {
+                    m_cache.remove(transfer.key);
+                }
+                keys << transfer.key;
+            }
+            if (done && guard) {
+                done(keys, *ok);
+            }
+        });
+    }
+
+    // Runs a single statement in the worker thread, the statement is finished afterwards. If the
+    // statement fails, the cached transfer with evictKey is dropped so that the next lookup reads
+    // the stored values instead.
+    void execLater(Statement id, const QVariantMap &values, const char *error, int evictKey = -1)
+    {
+        const QSharedPointer<bool> ok(new bool(true));
+        m_worker.post([this, id, values, error, ok] {
+            QSqlQuery &query = statement(id);
+            for (QVariantMap::const_iterator i = values.constBegin(); i != values.constEnd(); ++i) {
+                query.bindValue(i.key(), i.value());
+            }
+            if (!query.exec()) {
+                qWarning() << error << query.lastError().text() << ": "
+                           << query.lastError().databaseText();
+                *ok = false;
+            }
+            query.finish();
+        }, &m_callbackContext, [this, ok, evictKey] {
+            if (!*ok && evictKey >= 0) {
+                m_cache.remove(evictKey);
+            }
+        });
+    }
+
+    // Deletes a batch of transfers exceeding the retention policy, see DbManager::pruneTransfers()
+    bool deleteExpiredTransfers(qint64 expired, qint64 failedExpired, int maxTransfers,
+                                int batchSize, QList<int> *keys)
+    {
+        QSqlQuery &query = statement(SelectExpiredTransfers);
+        bindInactiveStatuses(query);
+        query.bindValue(":expired",         expired);
+        query.bindValue(":failed",          TransferEngineData::TransferInterrupted);
+        query.bindValue(":failed_expired",  failedExpired);
+        query.bindValue(":max_transfers",   maxTransfers);
+        query.bindValue(":batch_size",      batchSize);
+
+        if (!query.exec()) {
+            qWarning() << "DbManagerPrivate::deleteExpiredTransfers: Failed to execute SQL query. Couldn't get expired transfers!"
+                       << query.lastError().text() << ": "
+                       << query.lastError().databaseText();
+            return false;
+        }
+
+        while (query.next()) {
+            keys->append(query.value(0).toInt());
+        }
+        query.finish();
+
+        if (keys->isEmpty()) {
+            return true;
+        }
+
+        if (!m_db.transaction()) {
+            qWarning() << "DbManagerPrivate::deleteExpiredTransfers: Failed to begin transaction"
+                       << m_db.lastError().text();
+            return false;
+        }
+
+        QSqlQuery &deleteQuery = statement(DeleteTransfer);
+        Q_FOREACH (int key, *keys) {
+            deleteQuery.bindValue(":transfer_id", key);
+            if (!deleteQuery.exec()) {
+                qWarning() << "DbManagerPrivate::deleteExpiredTransfers: Failed to execute SQL query. Couldn't delete transfer" << key
+                           << deleteQuery.lastError().text() << ": "
+                           << deleteQuery.lastError().databaseText();
+                deleteQuery.finish();
+                m_db.rollback();
+                return false;
+            }
+        }
+        deleteQuery.finish();
+
+        if (!m_db.commit()) {
+            qWarning() << "DbManagerPrivate::deleteExpiredTransfers: Failed to commit"
+                       << m_db.lastError().text();
+            m_db.rollback();
+            return false;
+        }
+        return true;
+    }
+
+    qint64 incrementalVacuum()
+    {
+        QSqlQuery query(m_db);
+        if (!query.exec(QStringLiteral("PRAGMA page_size")) || !query.next()) {
+            qWarning() << "DbManagerPrivate::incrementalVacuum: Failed to read page size"
+                       << query.lastError().text() << ": " << query.lastError().databaseText();
             return -1;
         }
-        QSqlRecord rec = query.record();
-        if (query.isActive() && query.isSelect()) {
-            query.first();
-            QString v = query.value(rec.indexOf("user_version")).toString();
-            if (v.isEmpty()) {
+        const qint64 pageSize = query.value(0).toLongLong();
+
+        auto freePages = [&query]() -> qint64 {
+            if (!query.exec(QStringLiteral("PRAGMA freelist_count")) || !query.next()) {
                 return -1;
             }
-            return v.toInt();
+            return query.value(0).toLongLong();
+        };
+
+        const qint64 before = freePages();
+        if (before <= 0) {
+            return before == 0 ? 0 : -1;
         }
-        return -1;
+
+        // Incremental auto vacuum lets the pages freed by the pruned transfers be returned to
+        // the file system without rewriting the whole database. Databases created before need
+        // one full vacuum to switch the mode, which is done here rather than when opening the
+        // database since it rewrites the whole file.
+        if (!query.exec(QStringLiteral("PRAGMA auto_vacuum")) || !query.next()) {
+            qWarning() << "DbManagerPrivate::incrementalVacuum: Failed to read auto vacuum mode"
+                       << query.lastError().text() << ": " << query.lastError().databaseText();
+            return -1;
+        }
+        if (query.value(0).toInt() != AUTO_VACUUM_INCREMENTAL) {
+            query.finish();
+            if (!query.exec(QStringLiteral("PRAGMA auto_vacuum=INCREMENTAL"))
+                    || !query.exec(QStringLiteral("VACUUM"))) {
+                qWarning() << "DbManagerPrivate::incrementalVacuum: Failed to enable incremental vacuum"
+                           << query.lastError().text() << ": " << query.lastError().databaseText();
+                return -1;
+            }
+            query.finish();
+            // The full vacuum has returned all the free pages
+            return before * pageSize;
+        }
+
+        // The pragma frees a page on each step, so run it until completion
+        if (!query.exec(QStringLiteral("PRAGMA incremental_vacuum"))) {
+            qWarning() << "DbManagerPrivate::incrementalVacuum: Failed to vacuum"
+                       << query.lastError().text() << ": " << query.lastError().databaseText();
+            return -1;
+        }
+        while (query.next()) {
+        }
+
+        const qint64 after = freePages();
+        query.finish();
+        return after < 0 ? -1 : (before - after) * pageSize;
     }
 
+    // Drops cached transfers which have been finished, canceled or interrupted.
+    void removeCachedInactiveTransfers()
+    {
+        Q_FOREACH (int key, m_cache.keys()) {
+            const TransferEngineData::TransferStatus status = m_cache.object(key)->status;
+            if (status == TransferEngineData::TransferFinished
+                    || status == TransferEngineData::TransferCanceled
+                    || status == TransferEngineData::TransferInterrupted) {
+                m_cache.remove(key);
+            }
+        }
+    }
+
+    // Owned by the worker thread together with the prepared statements
     QSqlDatabase m_db;
+    mutable QSqlQuery m_statements[StatementCount];
+
+    // Keys of the next created rows, used by the main thread only
+    int m_nextTransferKey = 1;
+    int m_nextMetadataKey = 1;
+    int m_nextCallbackKey = 1;
+
+    // Retention policy, zero disables the limit
+    int m_maxTransfers = 0;
+    int m_maxAge = 0;
+    int m_failedMaxAge = 0;
+
+    mutable QCache<int, TransferCacheEntry> m_cache;
+    mutable quint64 m_cacheHits = 0;
+    mutable quint64 m_cacheMisses = 0;
+
+    // Latest progress per transfer id, which hasn't been written to the database yet
+    QHash<int, qreal> m_pendingProgress;
+    // Progress writes in flight, and the transfers whose status has changed meanwhile
+    // together with the count of status changes at the time, see retryProgress()
+    int m_progressWrites = 0;
+    quint64 m_statusChanges = 0;
+    QHash<int, quint64> m_statusChangesDuringWrite;
+    QTimer m_progressFlushTimer;
+    QTimer m_checkpointTimer;
+
+    mutable DbWorker m_worker;
+    // Context of the worker callbacks which update the cache
+    QObject m_callbackContext;
+    bool m_closed = false;
 };
 
 /*! \class DbManager
@@ -201,6 +960,14 @@ public:
 
     DbManager class takes care of reading and writing transfer database used by Nemo Transfer
     Engine. It's a singleton class and it can be instantiated using DbManager::instance() method.
+
+    The database connection is owned by a worker thread, which runs the reads and writes in the
+    order they are made. Writes return without waiting for the worker, and transfer lookups are
+    served from an in-memory cache. Reads which need the database wait for the preceding writes.
+
+    Only the creation of transfers reports the result of the write, through a callback. The
+    other writes are fire-and-forget: a failure is logged, and the affected transfer is dropped
+    from the cache so that later lookups return what is actually stored.
 */
 
 
@@ -225,6 +992,8 @@ DbManager::DbManager():
                             + DB_PATH + QDir::separator()
                             + DB_NAME;
 
+    TransferDBRecord::registerType();
+
     bool dbExists = QFile::exists(absDbPath);
 
     if (!dbExists) {
@@ -234,59 +1003,53 @@ DbManager::DbManager():
         }
     }
 
-    d->m_db = QSqlDatabase::addDatabase("QSQLITE");
-    d->m_db.setDatabaseName(absDbPath);
-    d->m_db.setConnectOptions("foreign_keys = ON"); // sanity check
-    d->m_db.open();
-
-    // Create database schema if db didn't exist
-    if (!dbExists) {
-        if (!d->createDatabaseSchema()) {
-            qCritical("DbManager::DbManager: Failed to create DB schema. Can't continue!");
-        }
-    } else {
-        // Database exists, check the schema version
-        if (d->userVersion() == 1) {
-            // For this we get away with DeclarativeTransferModel directly reading database without
-            // update because notification_id is the last column
-            QSqlQuery query;
-            if (query.exec("ALTER TABLE transfers ADD COLUMN notification_id INTEGER")) {
-                qWarning() << "Extended transfers table";
-
-                if (!query.exec(PRAGMA_USER_VERSION)) {
-                    qWarning() << "DbManager pragma user_version update:"
-                               << query.lastError().text() << ":" << query.lastError().databaseText();
-                }
-            } else {
-                qWarning() << "Failed to extend transfers table!"
-                           << query.lastError().text() << ":" << query.lastError().databaseText();
-            }
-        }
-
-        if (d->userVersion() != USER_VERSION) {
-            d->deleteOldTables();
-            d->createDatabaseSchema();
-        }
+    bool walEnabled = false;
+    d->m_worker.call([d, absDbPath, &walEnabled] {
+        walEnabled = d->openDatabase(absDbPath);
+    });
+    if (walEnabled) {
+        d->m_checkpointTimer.start();
     }
-
-    TransferDBRecord::registerType();
 }
 
 /*!
     Destroys the DbManager. Clients should not call this, instead the created DbManager instance
-    will be destroyed automatically.
+    will be destroyed automatically. The instance is destroyed after the application object, so
+    close() should be called before that.
  */
 DbManager::~DbManager()
 {
-    Q_D(DbManager);
-    if (d->m_db.isOpen()) {
-        d->m_db.close();
-    }
+    close();
 
     delete d_ptr;
     d_ptr = 0;
 }
 
+/*!
+    Writes the buffered progress, closes the database and stops the worker thread. The callbacks
+    of the writes made so far are delivered before this returns.
+
+    This must be called while the application object exists, e.g. when the engine is destroyed,
+    so that the timers are stopped in their thread and the callbacks can be delivered. DbManager
+    can't be used after this.
+ */
+void DbManager::close()
+{
+    Q_D(DbManager);
+    if (d->m_closed) {
+        return;
+    }
+    d->m_closed = true;
+
+    d->flushProgress();
+    d->m_progressFlushTimer.stop();
+    d->m_checkpointTimer.stop();
+    d->m_worker.call([d] {
+        d->closeDatabase();
+    });
+    d->m_worker.stop();
+}
+
 /*!
     Returns a DBus callback interface and method names for the transfer with \a key.
     If there is no callback for the \a key then an empty QStringList is returned.
@@ -302,28 +1065,9 @@ DbManager::~DbManager()
  */
 QStringList DbManager::callback(int key) const
 {
-    QString queryStr = QString("SELECT service, path, interface, cancel_method, restart_method FROM callback WHERE transfer_id='%1';")
-            .arg(QString::number(key));
-
-    QStringList result;
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::callback: Failed to execute SQL query. Couldn't get callback!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return result;
-    }
-
-    QSqlRecord rec = query.record();
-    if (query.isActive() && query.isSelect()) {
-        query.first();
-        result <<  query.value(rec.indexOf("service")).toString()
-                << query.value(rec.indexOf("path")).toString()
-                << query.value(rec.indexOf("interface")).toString()
-                << query.value(rec.indexOf("cancel_method")).toString()
-                << query.value(rec.indexOf("restart_method")).toString();
-    }
-    return result;
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->callback : QStringList();
 }
 
 /*!
@@ -333,31 +1077,25 @@ QStringList DbManager::callback(int key) const
     Metadata entry will be created to the metadata table. Argument \a key must point to the
     existing entry in transfers table.
 
-    This method returns a key of the created record in metadata table or -1 on failure.
+    This method returns a key of the created record in metadata table. The record is written
+    to the database in the background.
 
     NOTE: Deleting the record from the  transfer which has a \a key, also deletes related
     metadata entry.
  */
 int DbManager::createMetadataEntry(int key, const QString &title, const QString &description)
 {
-    QSqlQuery query;
-    query.prepare("INSERT INTO metadata (title, description, transfer_id)"
-                  "VALUES (:title, :description, :transfer_id)");
-    query.bindValue(":title",       title);
-    query.bindValue(":description", description);
-    query.bindValue(":transfer_id", key);
-
-    if (!query.exec()) {
-        qWarning() << "DbManager::createMetadataEntry: Failed to execute SQL query. Couldn't create an entry!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return -1;
+    Q_D(DbManager);
+    const int metadataKey = d->m_nextMetadataKey++;
+    d->m_worker.post([d, metadataKey, key, title, description] {
+        d->insertMetadata(metadataKey, key, title, description);
+    });
+
+    if (TransferCacheEntry *entry = d->m_cache.object(key)) {
+        entry->values.insert(MediaItem::Title, title);
+        entry->values.insert(MediaItem::Description, description);
     }
-
-    // Return the id of the last record
-    QVariant rowId = query.lastInsertId();
-    query.finish();
-    return rowId.isValid()? rowId.toInt() : -1;
+    return metadataKey;
 }
 
 /*!
@@ -372,8 +1110,8 @@ int DbManager::createMetadataEntry(int key, const QString &title, const QString
         \li \a restartMethod The name of the restart method
     \endlist
 
-    This method returns a key of the created callback record in a callback table or -1 on
-    failure.
+    This method returns a key of the created callback record in a callback table. The record
+    is written to the database in the background.
 
     NOTE: Deleting the record from the  transfer which has a \a key, also deletes related
     callback entry.
@@ -386,27 +1124,16 @@ int DbManager::createCallbackEntry(int key,
                                    const QString &cancelMethod,
                                    const QString &restartMethod)
 {
-    QSqlQuery query;
-    query.prepare("INSERT INTO callback (service, path, interface, cancel_method, restart_method, transfer_id)"
-                  "VALUES (:service, :path, :interface, :cancel_method, :restart_method, :transfer_id)");
-    query.bindValue(":service",         service);
-    query.bindValue(":path",            path);
-    query.bindValue(":interface",       interface);
-    query.bindValue(":cancel_method",   cancelMethod);
-    query.bindValue(":restart_method",  restartMethod);
-    query.bindValue(":transfer_id",     key);
-
-    if (!query.exec()) {
-        qWarning() << "DbManager::createCallbackEntry: Failed to execute SQL query. Couldn't create an entry!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return -1;
-    }
+    Q_D(DbManager);
+    const int callbackKey = d->m_nextCallbackKey++;
+    d->m_worker.post([=] {
+        d->insertCallback(callbackKey, key, service, path, interface, cancelMethod, restartMethod);
+    });
 
-    // Return the id of the last record
-    QVariant rowId = query.lastInsertId();
-    query.finish();
-    return rowId.isValid()? rowId.toInt() : -1;
+    if (TransferCacheEntry *entry = d->m_cache.object(key)) {
+        entry->callback = QStringList() << service << path << interface << cancelMethod << restartMethod;
+    }
+    return callbackKey;
 }
 
 /*!
@@ -415,173 +1142,181 @@ int DbManager::createCallbackEntry(int key,
     MediaItem instance contains all the required information for the single Upload,
     Download or a Sync item. Based on this information, DbManager creates a record
     to the transfers table, but also to the callback and metadata tables if these
-    are defined.
+    are defined. All the records are written in a single transaction.
+
+    This method returns a key of the created transfer. The key is assigned immediately and the
+    records are written to the database in the background, so the caller doesn't wait on disk.
+    Any later reads and writes of the transfer are served in the order they were made.
 
-    This method returns a key of the created transfer or -1 on failure.
+    Once the records have been written or the write has failed, \a done is called in the calling
+    thread with the key and the result, unless \a context has been destroyed. If the write fails, the transfer
+    doesn't exist and the key must not be used anymore.
 */
-int DbManager::createTransferEntry(const MediaItem *mediaItem)
+int DbManager::createTransferEntry(const MediaItem *mediaItem, QObject *context,
+                                   const CreateCallback &done)
 {
     Q_D(DbManager);
-    QSqlQuery query;
-    query.prepare("INSERT INTO transfers (transfer_type, timestamp, status, progress, display_name, application_icon, thumbnail_icon, "
-                  "  service_icon, url, resource_name, mime_type, file_size, plugin_id, account_id, strip_metadata, scale_percent, "
-                  "  cancel_supported, restart_supported, notification_id)"
-                  "VALUES (:transfer_type, :timestamp, :status, :progress, :display_name, :application_icon, :thumbnail_icon, "
-                  "  :service_icon, :url, :resource_name, :mime_type, :file_size, :plugin_id, :account_id, :strip_metadata, :scale_percent, "
-                  "  :cancel_supported, :restart_supported, :notification_id)");
-    query.bindValue(":transfer_type",       mediaItem->value(MediaItem::TransferType));
-    query.bindValue(":status",              TransferEngineData::NotStarted);
-    query.bindValue(":timestamp",           d->currentDateTime());
-    query.bindValue(":progress",            0);
-    query.bindValue(":display_name",        mediaItem->value(MediaItem::DisplayName));
-    query.bindValue(":application_icon",    mediaItem->value(MediaItem::ApplicationIcon));
-    query.bindValue(":thumbnail_icon",      mediaItem->value(MediaItem::ThumbnailIcon));
-    query.bindValue(":service_icon",        mediaItem->value(MediaItem::ServiceIcon));
-    query.bindValue(":url",                 mediaItem->value(MediaItem::Url));
-    query.bindValue(":resource_name",       mediaItem->value(MediaItem::ResourceName));
-    query.bindValue(":mime_type",           mediaItem->value(MediaItem::MimeType));
-    query.bindValue(":file_size",           mediaItem->value(MediaItem::FileSize));
-    query.bindValue(":plugin_id",           mediaItem->value(MediaItem::PluginId));
-    query.bindValue(":account_id",          mediaItem->value(MediaItem::AccountId));
-    query.bindValue(":strip_metadata",      mediaItem->value(MediaItem::MetadataStripped));
-    query.bindValue(":scale_percent",       mediaItem->value(MediaItem::ScalePercent));
-    query.bindValue(":cancel_supported",    mediaItem->value(MediaItem::CancelSupported));
-    query.bindValue(":restart_supported",   mediaItem->value(MediaItem::RestartSupported));
-    query.bindValue(":notification_id",     0);
-
-    if (!query.exec()) {
-        qWarning() << "DbManager::createTransferEntry: Failed to execute SQL query. Couldn't create an entry!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return -1;
-    }
-
-    // Return the id of the last record
-    QVariant rowId = query.lastInsertId();
-    query.finish();
-
-    if (!rowId.isValid()) {
-        qWarning() << "DbManager::createShareEntry: Invalid row ID!";
-        return -1;
-    }
+    const PendingTransfer transfer = d->newTransfer(mediaItem);
+    d->m_cache.insert(transfer.key, new TransferCacheEntry(transfer.entry));
+    d->writeLater(QList<PendingTransfer>() << transfer, context, done);
+    return transfer.key;
+}
 
-    // Create a metadata entry if user has passed any
-    const QString title = mediaItem->value(MediaItem::Title).toString();
-    const QString desc  = mediaItem->value(MediaItem::Description).toString();
-    if (!title.isEmpty() || !desc.isEmpty()) {
-        if (createMetadataEntry(rowId.toInt(), title, desc) < 0){
-            qWarning() << "DbManager::createTransferEntry: Failed to create metadata entry";
-            return -1;
-        }
-    }
+/*!
+    Creates transfer entries for all the \a mediaItems in a single database transaction.
 
-    // Create a callback entry if it's been provided
-    const QStringList callback  = mediaItem->value(MediaItem::Callback).toStringList();
-    const QString cancelMethod  = mediaItem->value(MediaItem::CancelCBMethod).toString();
-    const QString restartMethod = mediaItem->value(MediaItem::RestartCBMethod).toString();
+    Either all or none of the entries are written to the database. This method returns the keys
+    of the created transfers in the same order as \a mediaItems without waiting for the write,
+    and \a done is called with the result of the write like with createTransferEntry().
 
-    // One of the methods must exist if the callback has been provided
-    if (callback.count() == 3 && (!cancelMethod.isEmpty() || !restartMethod.isEmpty())){
-        const int res = createCallbackEntry(rowId.toInt(), callback.at(0), callback.at(1), callback.at(2),
-                                            cancelMethod, restartMethod);
-        if (res < 0) {
-            qWarning() << "DbManager::createTransferEntry: Failed to create callback entry";
-            return -1;
-        }
+    \sa createTransferEntry()
+*/
+QList<int> DbManager::createTransferEntries(const QList<MediaItem*> &mediaItems, QObject *context,
+                                           const CreateCallback &done)
+{
+    Q_D(DbManager);
+    QList<int> keys;
+    QList<PendingTransfer> transfers;
+    Q_FOREACH(const MediaItem *mediaItem, mediaItems) {
+        const PendingTransfer transfer = d->newTransfer(mediaItem);
+        d->m_cache.insert(transfer.key, new TransferCacheEntry(transfer.entry));
+        transfers << transfer;
+        keys << transfer.key;
     }
 
-    return rowId.toInt();
+    d->writeLater(transfers, context, done);
+    return keys;
 }
 
 /*!
     Updates transfer \a status of the existing transfer with \a key. Changing the status updates
     the timestamp too.
 
-    This method returns true on success, false on failure.
+    Any buffered progress updates are written to the database before the status is changed, so that
+    the status change is never overtaken by an older progress value.
+
+    The change is written to the database in the background. This method returns false if
+    \a status is invalid, true otherwise. If the write fails, the transfer is dropped from the
+    cache so that later lookups return the stored status.
  */
 bool DbManager::updateTransferStatus(int key, TransferEngineData::TransferStatus status)
 {
     Q_D(DbManager);
-    QString queryStr;
+    d->flushProgress();
+
+    DbManagerPrivate::Statement statement = DbManagerPrivate::UpdateStatus;
     switch(status) {
     case TransferEngineData::TransferStarted:
-        queryStr = QString("UPDATE transfers SET status='%1', progress='0', timestamp='%2' WHERE transfer_id='%3';")
-                .arg(QString::number(status))
-                .arg(d->currentDateTime())
-                .arg(QString::number(key));
+        statement = DbManagerPrivate::UpdateStatusResetProgress;
         break;
 
     case TransferEngineData::NotStarted:
     case TransferEngineData::TransferFinished:
     case TransferEngineData::TransferInterrupted:
     case TransferEngineData::TransferCanceled:
-        queryStr = QString("UPDATE transfers SET status='%1', timestamp='%2' WHERE transfer_id='%3';")
-                .arg(QString::number(status))
-                .arg(d->currentDateTime())
-                .arg(QString::number(key));
         break;
     case TransferEngineData::Unknown:
         qWarning() << "Unknown transfer status!";
         return false;
     }
 
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "Failed to execute SQL query. Couldn't update a record!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return false;
+    QVariantMap values;
+    values.insert(":status",      status);
+    values.insert(":timestamp",   d->currentDateTime());
+    values.insert(":transfer_id", key);
+    d->execLater(statement, values, "Failed to execute SQL query. Couldn't update a record!", key);
+    d->statusChanged(key);
+
+    if (TransferCacheEntry *entry = d->m_cache.object(key)) {
+        entry->status = status;
+        if (status == TransferEngineData::TransferStarted) {
+            entry->progress = 0;
+        }
     }
-    query.finish();
     return true;
 }
 
 /*!
     Updates transfer \a progress of the existing transfer with \a key.
 
-    This method returns true on success, false on failure.
+    Progress updates are buffered in memory and only the latest value of each transfer is written
+    to the database when the progress flush interval expires, the status of any transfer changes
+    or flushProgress() is called. If the flush interval is 0, the progress is written without
+    buffering.
+
+    The progress is written to the database in the background and this method returns true.
+
+    \sa setProgressFlushInterval(), flushProgress()
  */
 bool DbManager::updateProgress(int key, qreal progress)
 {
-    QString queryStr = QString("UPDATE transfers SET progress='%1' WHERE transfer_id='%2';")
-            .arg(QString::number(progress))
-            .arg(QString::number(key));
+    Q_D(DbManager);
+    if (TransferCacheEntry *entry = d->m_cache.object(key)) {
+        entry->progress = progress;
+    }
 
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "Failed to execute SQL query. Couldn't update the progress!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return false;
+    if (d->m_progressFlushTimer.interval() > 0) {
+        d->m_pendingProgress.insert(key, progress);
+        if (!d->m_progressFlushTimer.isActive()) {
+            d->m_progressFlushTimer.start();
+        }
+        return true;
     }
-    query.finish();
+
+    QVariantMap values;
+    values.insert(":progress",    progress);
+    values.insert(":transfer_id", key);
+    d->execLater(DbManagerPrivate::UpdateProgress, values, "Failed to execute SQL query. Couldn't update the progress!");
     return true;
 }
 
 /*!
-    Removes an existing transfer with a \a key from the transfers table. If this transfer has
-    metadata or callback defined, they will be removed too.
+    Writes all the buffered progress updates to the database in a single transaction.
 
-    This method returns true on success, false on failure.
+    The updates are written in the background and this method returns true. If the write fails,
+    the updates are buffered again and retried when the flush interval expires, unless a newer
+    progress has been buffered for the transfer or its status has changed in the meantime.
+
+    \sa updateProgress()
  */
-bool DbManager::removeTransfer(int key)
+bool DbManager::flushProgress()
 {
-    QString queryStr = QString("DELETE FROM transfers WHERE transfer_id='%1' AND (status='%2' OR status='%3' OR status='%4');")
-            .arg(key)
-            .arg(TransferEngineData::TransferFinished)
-            .arg(TransferEngineData::TransferCanceled)
-            .arg(TransferEngineData::TransferInterrupted);
+    Q_D(DbManager);
+    d->flushProgress();
+    return true;
+}
 
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << Q_FUNC_INFO;
-        qWarning() << "Failed to execute SQL query: " << query.lastQuery();
-        qWarning() << query.lastError().text();
-        return false;
+/*!
+    Sets the interval in milliseconds for writing buffered progress updates to the database
+    to \a msecs. Setting the interval to 0 disables buffering and writes every progress update
+    immediately.
+ */
+void DbManager::setProgressFlushInterval(int msecs)
+{
+    Q_D(DbManager);
+    if (msecs <= 0) {
+        d->flushProgress();
     }
+    d->m_progressFlushTimer.setInterval(qMax(0, msecs));
+}
 
-    query.finish();
-    return true;
+/*!
+    Removes an existing transfer with a \a key from the transfers table. If this transfer has
+    metadata or callback defined, they will be removed too.
+
+    The transfer is removed from the database in the background. A failure is only logged.
+ */
+void DbManager::removeTransfer(int key)
+{
+    Q_D(DbManager);
+    QVariantMap values;
+    values.insert(":transfer_id", key);
+    values.insert(":finished",    TransferEngineData::TransferFinished);
+    values.insert(":canceled",    TransferEngineData::TransferCanceled);
+    values.insert(":interrupted", TransferEngineData::TransferInterrupted);
+    d->execLater(DbManagerPrivate::DeleteInactiveTransfer, values, "Failed to execute SQL query. Couldn't remove transfer!");
+
+    d->m_cache.remove(key);
 }
 
 /*!
@@ -589,62 +1324,187 @@ bool DbManager::removeTransfer(int key)
     of the removed failed transfers and can be one of TransferEngineData::Download, TransferEngineData::Upload
     or TransferEngineData::Sync.
 
-    This methods returns true on success or false on failure
+    The transfers are removed from the database in the background. A failure is only logged.
  */
-bool DbManager::clearFailedTransfers(int excludeKey, TransferEngineData::TransferType type)
+void DbManager::clearFailedTransfers(int excludeKey, TransferEngineData::TransferType type)
 {
+    Q_D(DbManager);
     // DELETE FROM transfers where transfer_id!=4584 AND status=5 AND  display_name=(SELECT display_name FROM transfers WHERE transfer_id=4584);
-    QString queryStr = QString("DELETE FROM transfers WHERE transfer_id!=%1 AND status=%2 AND transfer_type=%3 AND display_name=(SELECT display_name FROM transfers WHERE transfer_id=%1);")
-            .arg(excludeKey)
-            .arg(TransferEngineData::TransferInterrupted)
-            .arg(type);
-
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << Q_FUNC_INFO;
-        qWarning() << "Failed to execute query: " << query.lastQuery();
-        qWarning() << query.lastError().text();
-        return false;
+    QVariantMap values;
+    values.insert(":exclude_id",      excludeKey);
+    values.insert(":name_id",         excludeKey);
+    values.insert(":status",          TransferEngineData::TransferInterrupted);
+    values.insert(":transfer_type",   type);
+    d->execLater(DbManagerPrivate::DeleteFailedTransfers, values, "Failed to execute SQL query. Couldn't clear failed transfers!");
+
+    Q_FOREACH (int key, d->m_cache.keys()) {
+        const TransferCacheEntry *entry = d->m_cache.object(key);
+        if (key != excludeKey && entry->type == type && entry->status == TransferEngineData::TransferInterrupted) {
+            d->m_cache.remove(key);
+        }
     }
-    query.finish();
-    return true;
 }
 
 /*!
     Clears all finished, canceled or failed transfers from the database.
 
-    This method returns  true on success, false on failure.
+    The transfers are removed from the database in the background. A failure is only logged.
 */
-bool DbManager::clearTransfers()
+void DbManager::clearTransfers()
 {
-    QString queryStr = QString("DELETE FROM transfers WHERE status='%1' OR status='%2' OR status='%3';")
-            .arg(TransferEngineData::TransferFinished)
-            .arg(TransferEngineData::TransferCanceled)
-            .arg(TransferEngineData::TransferInterrupted);
+    Q_D(DbManager);
+    QVariantMap values;
+    values.insert(":finished",    TransferEngineData::TransferFinished);
+    values.insert(":canceled",    TransferEngineData::TransferCanceled);
+    values.insert(":interrupted", TransferEngineData::TransferInterrupted);
+    d->execLater(DbManagerPrivate::DeleteInactiveTransfers, values,
+                 "Failed to execute SQL query. Couldn't delete the list finished transfers!");
+
+    d->removeCachedInactiveTransfers();
+}
 
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "Failed to execute SQL query. Couldn't delete the list finished transfers!";
-        return false;
+/*!
+    Marks all the transfers which haven't been started or are still in progress as interrupted.
+    This is used to recover from the engine exiting or crashing while transfers were unfinished.
+
+    Returns the number of interrupted transfers or -1 on failure. If \a activeCount is given, it
+    is set to the number of interrupted transfers which were in progress.
+ */
+int DbManager::interruptUnfinishedTransfers(int *activeCount)
+{
+    Q_D(DbManager);
+    d->flushProgress();
+
+    const qint64 timestamp = d->currentDateTime();
+    int interrupted = -1;
+    int active = 0;
+    d->m_worker.call([d, timestamp, &interrupted, &active] {
+        // Both statements only visit the unfinished transfers through the status index
+        QSqlQuery &count = d->statement(DbManagerPrivate::CountTransfersByStatus);
+        count.bindValue(":status", TransferEngineData::TransferStarted);
+        if (count.exec() && count.next()) {
+            active = count.value(0).toInt();
+        }
+        count.finish();
+
+        QSqlQuery &query = d->statement(DbManagerPrivate::InterruptUnfinishedTransfers);
+        query.bindValue(":interrupted", TransferEngineData::TransferInterrupted);
+        query.bindValue(":timestamp",   timestamp);
+        query.bindValue(":not_started", TransferEngineData::NotStarted);
+        query.bindValue(":started",     TransferEngineData::TransferStarted);
+        if (query.exec()) {
+            interrupted = query.numRowsAffected();
+        } else {
+            qWarning() << "DbManager::interruptUnfinishedTransfers: Failed to execute SQL query. Couldn't update records!"
+                       << query.lastError().text() << ": "
+                       << query.lastError().databaseText();
+        }
+        query.finish();
+    });
+    if (interrupted < 0) {
+        return -1;
     }
 
-    query.finish();
-    return true;
+    Q_FOREACH (int key, d->m_cache.keys()) {
+        TransferCacheEntry *entry = d->m_cache.object(key);
+        if (entry->status == TransferEngineData::NotStarted
+                || entry->status == TransferEngineData::TransferStarted) {
+            entry->status = TransferEngineData::TransferInterrupted;
+        }
+    }
+
+    if (activeCount) {
+        *activeCount = active;
+    }
+    return interrupted;
+}
+
+/*!
+    Sets the retention policy enforced by pruneTransfers(). The history is limited to
+    \a maxTransfers transfers, and finished, canceled and failed transfers are removed
+    when they are older than \a maxAge days. Failed transfers can be removed earlier by
+    setting \a failedMaxAge days, but they are never kept longer than \a maxAge. Zero
+    disables the corresponding limit, and all of them are disabled by default.
+ */
+void DbManager::setRetentionPolicy(int maxTransfers, int maxAge, int failedMaxAge)
+{
+    Q_D(DbManager);
+    d->m_maxTransfers = qMax(0, maxTransfers);
+    d->m_maxAge = qMax(0, maxAge);
+    d->m_failedMaxAge = qMax(0, failedMaxAge);
+}
+
+/*!
+    Removes at most \a batchSize of the oldest finished, canceled or failed transfers which
+    exceed the retention policy, together with their metadata and callbacks. Transfers which
+    are still in progress are never removed.
+
+    The transfers are removed in a single transaction, so callers should keep \a batchSize
+    small and call this repeatedly while the engine is idle until it returns less than
+    \a batchSize. Returns the number of removed transfers or -1 on failure.
+ */
+int DbManager::pruneTransfers(int batchSize)
+{
+    Q_D(DbManager);
+    if (d->m_maxTransfers == 0 && d->m_maxAge == 0 && d->m_failedMaxAge == 0) {
+        return 0;
+    }
+
+    const qint64 now = d->currentDateTime();
+    const qint64 msecsPerDay = 24 * 60 * 60 * 1000;
+    // A zero timestamp and an offset past the end of the table never match
+    const qint64 expired = d->m_maxAge > 0 ? now - d->m_maxAge * msecsPerDay : 0;
+    const qint64 failedExpired = d->m_failedMaxAge > 0 ? now - d->m_failedMaxAge * msecsPerDay : 0;
+    const int maxTransfers = d->m_maxTransfers > 0 ? d->m_maxTransfers : INT_MAX;
+
+    QList<int> keys;
+    bool ok = false;
+    d->m_worker.call([&] {
+        ok = d->deleteExpiredTransfers(expired, failedExpired, maxTransfers, batchSize, &keys);
+    });
+    if (!ok) {
+        return -1;
+    }
+
+    Q_FOREACH (int key, keys) {
+        d->m_cache.remove(key);
+    }
+    return keys.count();
+}
+
+/*!
+    Returns the free pages of the database to the file system. This should be called after
+    transfers have been removed, e.g. by pruneTransfers(). Returns the number of bytes
+    reclaimed or -1 on failure.
+
+    The first call on a database created by an older version rewrites the whole database to
+    enable incremental vacuuming, so this should only be called while the engine is idle.
+ */
+qint64 DbManager::incrementalVacuum()
+{
+    Q_D(DbManager);
+    qint64 reclaimed = -1;
+    d->m_worker.call([d, &reclaimed] {
+        reclaimed = d->incrementalVacuum();
+    });
+    return reclaimed;
 }
 
 bool DbManager::clearTransfer(int key)
 {
-    QSqlQuery query;
+    Q_D(DbManager);
     TransferEngineData::TransferStatus status = transferStatus(key);
     switch (status) {
     case TransferEngineData::TransferFinished:
     case TransferEngineData::TransferCanceled:
     case TransferEngineData::TransferInterrupted:
-        if (query.exec(QString("DELETE FROM transfers WHERE transfer_id='%1';").arg(QString::number(key)))) {
-            return true;
-        }
-        qWarning() << "Failed to execute SQL query. Couldn't delete transfer" << key;
-        return false;
+    {
+        QVariantMap values;
+        values.insert(":transfer_id", key);
+        d->execLater(DbManagerPrivate::DeleteTransfer, values, "Failed to execute SQL query. Couldn't delete transfer!");
+        d->m_cache.remove(key);
+        return true;
+    }
     default:
         qWarning() << "Not clearing transfer" << key << "because its status is" << status;
         return false;
@@ -653,26 +1513,35 @@ bool DbManager::clearTransfer(int key)
 
 int DbManager::transferCount() const
 {
-    QSqlQuery query;
-    if (query.exec(QString("SELECT COUNT(transfer_id) FROM transfers"))) {
-        query.next();
-        return query.value(0).toInt();
-    } else {
-        qWarning() << "DbManager::transferCount: Failed to execute SQL query!";
-        return -1;
-    }
+    Q_D(const DbManager);
+    int count = -1;
+    d->m_worker.call([d, &count] {
+        QSqlQuery &query = d->statement(DbManagerPrivate::CountTransfers);
+        if (query.exec() && query.next()) {
+            count = query.value(0).toInt();
+        } else {
+            qWarning() << "DbManager::transferCount: Failed to execute SQL query!";
+        }
+        query.finish();
+    });
+    return count;
 }
 
 int DbManager::activeTransferCount() const
 {
-    QSqlQuery query;
-    if (query.exec(QString("SELECT COUNT(transfer_id) FROM transfers WHERE status='%1'").arg(TransferEngineData::TransferStarted))) {
-        query.next();
-        return query.value(0).toInt();
-    } else {
-        qWarning() << "DbManager::activeTransferCount: Failed to execute SQL query!";
-        return -1;
-    }
+    Q_D(const DbManager);
+    int count = -1;
+    d->m_worker.call([d, &count] {
+        QSqlQuery &query = d->statement(DbManagerPrivate::CountTransfersByStatus);
+        query.bindValue(":status", TransferEngineData::TransferStarted);
+        if (query.exec() && query.next()) {
+            count = query.value(0).toInt();
+        } else {
+            qWarning() << "DbManager::activeTransferCount: Failed to execute SQL query!";
+        }
+        query.finish();
+    });
+    return count;
 }
 
 /*!
@@ -699,41 +1568,55 @@ QList<TransferDBRecord> DbManager::activeTransfers() const
  */
 QList<TransferDBRecord> DbManager::transfers(TransferEngineData::TransferStatus status) const
 {
+    Q_D(const DbManager);
     // TODO: This should order the result based on timestamp
     QList<TransferDBRecord> records;
-    QString queryStr = (status == TransferEngineData::Unknown) ?
-        QString("SELECT * FROM transfers ORDER BY transfer_id DESC") :
-        QString("SELECT * FROM transfers WHERE status='%1' ORDER BY transfer_id DESC").arg(status);
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::transfers: Failed to execute SQL query. Couldn't get list of transfers!";
-        return records;
-    }
-
-    // The record could actually contain eg. QVariantList instead of hardcoded and
-    // typed members.
-    QSqlRecord rec = query.record();
-    while (query.next()) {
-        TransferDBRecord record;
-        record.transfer_id          = query.value(rec.indexOf("transfer_id")).toInt();
-        record.transfer_type        = query.value(rec.indexOf("transfer_type")).toInt();
-        record.progress             = query.value(rec.indexOf("progress")).toDouble();
-        record.url                  = query.value(rec.indexOf("url")).toString();
-        record.status               = query.value(rec.indexOf("status")).toInt();
-        record.plugin_id            = query.value(rec.indexOf("plugin_id")).toString();
-        record.display_name         = query.value(rec.indexOf("display_name")).toString();
-        record.resource_name        = query.value(rec.indexOf("resource_name")).toString();
-        record.mime_type            = query.value(rec.indexOf("mime_type")).toString();
-        record.timestamp            = query.value(rec.indexOf("timestamp")).toString();
-        record.size                 = query.value(rec.indexOf("file_size")).toInt();
-        record.application_icon     = query.value(rec.indexOf("application_icon")).toString();
-        record.thumbnail_icon       = query.value(rec.indexOf("thumbnail_icon")).toString();
-        record.service_icon         = query.value(rec.indexOf("service_icon")).toString();
-        record.cancel_supported     = query.value(rec.indexOf("cancel_supported")).toBool();
-        record.restart_supported    = query.value(rec.indexOf("restart_supported")).toBool();
-        records << record;
-    }
-    query.finish();
+    d->m_worker.call([d, status, &records] {
+        QSqlQuery &query = (status == TransferEngineData::Unknown)
+                ? d->statement(DbManagerPrivate::SelectTransfers)
+                : d->statement(DbManagerPrivate::SelectTransfersByStatus);
+        if (status != TransferEngineData::Unknown) {
+            query.bindValue(":status", status);
+        }
+        if (!query.exec()) {
+            qWarning() << "DbManager::transfers: Failed to execute SQL query. Couldn't get list of transfers!";
+            return;
+        }
+        d->readRecords(query, &records);
+    });
+
+    d->applyPendingProgress(&records);
+    return records;
+}
+
+/*!
+    Returns at most \a limit transfers older than the transfer with the id \a cursor, newest
+    first. A \a cursor of 0 returns the newest transfers and a negative \a limit returns all
+    of them. The id of the last returned transfer is the cursor of the next page, so pages
+    stay consistent while transfers are added or removed. If \a status is not
+    TransferEngineData::Unknown only the transfers with that status are returned.
+ */
+QList<TransferDBRecord> DbManager::transfersPage(int cursor, int limit, TransferEngineData::TransferStatus status) const
+{
+    Q_D(const DbManager);
+    QList<TransferDBRecord> records;
+    d->m_worker.call([d, cursor, limit, status, &records] {
+        QSqlQuery &query = (status == TransferEngineData::Unknown)
+                ? d->statement(DbManagerPrivate::SelectTransfersPage)
+                : d->statement(DbManagerPrivate::SelectTransfersPageByStatus);
+        if (status != TransferEngineData::Unknown) {
+            query.bindValue(":status", status);
+        }
+        query.bindValue(":cursor", cursor > 0 ? qint64(cursor) : LLONG_MAX);
+        query.bindValue(":limit",  limit);
+        if (!query.exec()) {
+            qWarning() << "DbManager::transfersPage: Failed to execute SQL query. Couldn't get list of transfers!";
+            return;
+        }
+        d->readRecords(query, &records);
+    });
+
+    d->applyPendingProgress(&records);
     return records;
 }
 
@@ -744,24 +1627,9 @@ QList<TransferDBRecord> DbManager::transfers(TransferEngineData::TransferStatus
  */
 TransferEngineData::TransferType DbManager::transferType(int key) const
 {
-    QString queryStr = QString("SELECT transfer_type FROM transfers WHERE transfer_id='%1';")
-            .arg(QString::number(key));
-
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::transferType: Failed to execute SQL query. Couldn't get transfer type!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return TransferEngineData::Undefined;
-    }
-
-
-    if (query.isActive() && query.isSelect()) {
-        query.first();
-        return static_cast<TransferEngineData::TransferType>(query.value(0).toInt());
-    } else {
-        return TransferEngineData::Undefined;
-    }
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->type : TransferEngineData::Undefined;
 }
 
 /*!
@@ -770,25 +1638,9 @@ TransferEngineData::TransferType DbManager::transferType(int key) const
  */
 TransferEngineData::TransferStatus DbManager::transferStatus(int key) const
 {
-
-    QString queryStr = QString("SELECT status FROM transfers WHERE transfer_id='%1';")
-            .arg(QString::number(key));
-
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::transferStatus: Failed to execute SQL query. Couldn't get transfer status!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return TransferEngineData::Unknown;
-    }
-
-
-    if (query.isActive() && query.isSelect()) {
-        query.first();
-        return static_cast<TransferEngineData::TransferStatus>(query.value(0).toInt());
-    } else {
-        return TransferEngineData::Unknown;
-    }
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->status : TransferEngineData::Unknown;
 }
 
 /*!
@@ -796,58 +1648,75 @@ TransferEngineData::TransferStatus DbManager::transferStatus(int key) const
  */
 qreal DbManager::transferProgress(int key) const
 {
-    QString queryStr = QString("SELECT progress FROM transfers WHERE transfer_id='%1';").arg(QString::number(key));
-
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::transferStatus: Failed to execute SQL query. Couldn't get the progress!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return -1;
-    }
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->progress : -1;
+}
 
-    if (query.isActive() && query.isSelect()) {
-        query.first();
-        return static_cast<qreal>(query.value(0).toReal());
-    } else {
-        return -1;
-    }
+/*!
+    Returns the priority of the upload with \a key in the transfer queue, which is given in the
+    "priority" user data value when the upload is created. Returns 0 in a case of error.
+ */
+int DbManager::transferPriority(int key) const
+{
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->priority : 0;
 }
 
-int DbManager::notificationId(int key)
+/*!
+    Returns the url of the transfer with \a key, or an empty url in a case of error.
+ */
+QUrl DbManager::transferUrl(int key) const
 {
-    QString queryStr = QString("SELECT notification_id FROM transfers WHERE transfer_id='%1';").arg(QString::number(key));
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->values.value(MediaItem::Url).toUrl() : QUrl();
+}
 
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::transferStatus: Failed to execute SQL query. Couldn't get the notification id!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return 0;
-    }
+/*!
+    Returns the resource name of the transfer with \a key, or an empty string in a case of error.
+ */
+QString DbManager::transferResourceName(int key) const
+{
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->values.value(MediaItem::ResourceName).toString() : QString();
+}
 
-    if (query.isActive() && query.isSelect()) {
-        query.first();
-        return static_cast<qreal>(query.value(0).toReal());
-    } else {
-        return 0;
-    }
+/*!
+    Returns true if the transfer with \a key can be canceled. Returns false in a case of error.
+ */
+bool DbManager::transferCancelSupported(int key) const
+{
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry && entry->values.value(MediaItem::CancelSupported).toBool();
 }
 
-bool DbManager::setNotificationId(int key, int notificationId)
+int DbManager::notificationId(int key)
 {
-    QString queryStr = QString("UPDATE transfers SET notification_id='%1' WHERE transfer_id='%2';")
-            .arg(QString::number(notificationId)).arg(QString::number(key));
+    Q_D(DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    return entry ? entry->notificationId : 0;
+}
 
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "Failed to execute SQL query. Couldn't update the notification id!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return false;
+/*!
+    Sets the id of the notification shown for the transfer with \a key to \a notificationId.
+    The change is written to the database in the background.
+ */
+void DbManager::setNotificationId(int key, int notificationId)
+{
+    Q_D(DbManager);
+    QVariantMap values;
+    values.insert(":notification_id", notificationId);
+    values.insert(":transfer_id",     key);
+    d->execLater(DbManagerPrivate::UpdateNotificationId, values,
+                 "Failed to execute SQL query. Couldn't update the notification id!", key);
+
+    if (TransferCacheEntry *entry = d->m_cache.object(key)) {
+        entry->notificationId = notificationId;
     }
-    query.finish();
-    return true;
 }
 
 /*!
@@ -858,94 +1727,65 @@ bool DbManager::setNotificationId(int key, int notificationId)
 */
 bool DbManager::callbackMethods(int key, QString &cancelMethod, QString &restartMethod) const
 {
-    QString queryStr = QString("SELECT cancel_method, restart_method FROM callback WHERE transfer_id='%1';")
-            .arg(QString::number(key));
-
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::callbackMethods: Failed to execute SQL query. Couldn't get callback methods!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    if (!entry) {
         return false;
     }
 
-
-    if (query.isActive() && query.isSelect()) {
-        query.first();
-        cancelMethod = query.value(0).toString();
-        restartMethod = query.value(1).toString();
-        return true;
-    } else {
-        return false;
-    }
+    cancelMethod = entry->callback.value(3);
+    restartMethod = entry->callback.value(4);
+    return true;
 }
 
 // Used only for Sharing atm. If this is needed for Sync and download add fetching the callback too.
 /*!
-    Returns a MediaItem instance from the transfer data with a \a key.
+    Returns a MediaItem instance from the transfer data with a \a key. The caller takes the
+    ownership of the returned instance.
 */
 MediaItem * DbManager::mediaItem(int key) const
 {
-    QString queryStr = QString("SELECT * FROM transfers WHERE transfer_id='%1';")
-            .arg(QString::number(key));
-
-    QSqlQuery query;
-    if (!query.exec(queryStr)) {
-        qWarning() << "DbManager::mediaItem: Failed to execute SQL query. Couldn't update the progress!"
-                   << query.lastError().text() << ": "
-                   << query.lastError().databaseText();
-        return 0;
-    }
-
-    MediaItem *item = new MediaItem;
-    QSqlRecord rec = query.record();
-    if (query.next()) {
-        item->setValue(MediaItem::Url,             query.value(rec.indexOf("url")));
-        item->setValue(MediaItem::MetadataStripped,query.value(rec.indexOf("strip_metadata")));
-        item->setValue(MediaItem::ScalePercent,    query.value(rec.indexOf("scale_percent")));
-        item->setValue(MediaItem::ResourceName,    query.value(rec.indexOf("resource_name")));
-        item->setValue(MediaItem::MimeType,        query.value(rec.indexOf("mime_type")));
-        item->setValue(MediaItem::TransferType,    query.value(rec.indexOf("transfer_type")));
-        item->setValue(MediaItem::FileSize,        query.value(rec.indexOf("file_size")));
-        item->setValue(MediaItem::PluginId,        query.value(rec.indexOf("plugin_id")));
-        item->setValue(MediaItem::AccountId,       query.value(rec.indexOf("account_id")));
-        item->setValue(MediaItem::DisplayName,     query.value(rec.indexOf("display_name")));
-        item->setValue(MediaItem::ServiceIcon,     query.value(rec.indexOf("service_icon")));
-        item->setValue(MediaItem::ApplicationIcon, query.value(rec.indexOf("application_icon")));
-        item->setValue(MediaItem::ThumbnailIcon,   query.value(rec.indexOf("thumbnail_icon")));
-        item->setValue(MediaItem::CancelSupported, query.value(rec.indexOf("cancel_supported")));
-        item->setValue(MediaItem::RestartSupported, query.value(rec.indexOf("restart_supported")));
-    } else {
+    Q_D(const DbManager);
+    const TransferCacheEntry *entry = d->cachedTransfer(key);
+    if (!entry) {
         qWarning() << "DbManager::mediaItem: Failed to get media item data from database!";
-        delete item;
         return 0;
     }
 
-    query.finish();
-
-    // Get metadata part title, description
-    queryStr = QString("SELECT title, description FROM metadata WHERE transfer_id='%1';")
-            .arg(QString::number(key));
-
-    if (!query.exec(queryStr)) {
-            qWarning() << "DbManager::mediaItem: Failed to execute SQL query. Couldn't update the progress!"
-                       << query.lastError().text() << ": "
-                       << query.lastError().databaseText();
-            delete item;
-            return 0;
-    }
-    rec = query.record();
-    // NOTE: There might be that user hasn't set any title or description so let the flow just pass
-    //       this point if there isn't anything...
-    if (query.next()) {
-        item->setValue(MediaItem::Title, query.value(rec.indexOf("title")));
-        item->setValue(MediaItem::Description, query.value(rec.indexOf("description")));
+    MediaItem *item = new MediaItem;
+    QMap<MediaItem::ValueKey, QVariant>::const_iterator i = entry->values.constBegin();
+    for (; i != entry->values.constEnd(); ++i) {
+        item->setValue(i.key(), i.value());
     }
-
-    query.finish();
     return item;
 }
 
+/*!
+    Calls \a callback in the calling thread once all the changes made so far have been written
+    to the database, e.g. to let clients which read the database know about the changes.
+    The callback isn't called if \a context is destroyed before that.
+ */
+void DbManager::whenWritten(QObject *context, const std::function<void()> &callback)
+{
+    Q_D(DbManager);
+    d->flushProgress();
+    d->m_worker.post([] {}, context, callback);
+}
 
+/*!
+    Returns the number of transfer lookups which have been served from the in-memory transfer cache.
+ */
+quint64 DbManager::cacheHits() const
+{
+    Q_D(const DbManager);
+    return d->m_cacheHits;
+}
 
-
+/*!
+    Returns the number of transfer lookups which had to read the transfer from the database.
+ */
+quint64 DbManager::cacheMisses() const
+{
+    Q_D(const DbManager);
+    return d->m_cacheMisses;
+}
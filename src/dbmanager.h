@@ -25,6 +25,9 @@
 #ifndef DBMANAGER_H
 #define DBMANAGER_H
 #include <QObject>
+#include <QUrl>
+
+#include <functional>
 
 #include "transferdbrecord.h"
 #include "mediatransferinterface.h"
@@ -38,6 +41,8 @@ public:
 
     ~DbManager();
 
+    void close();
+
     int createMetadataEntry(int key, const QString &title, const QString &description);
     QStringList callback(int key) const;
 
@@ -48,24 +53,43 @@ public:
                             const QString &cancelMethod,
                             const QString &restartMethod);
 
-    int createTransferEntry(const MediaItem *mediaItem);
+    typedef std::function<void(const QList<int> &keys, bool ok)> CreateCallback;
+
+    int createTransferEntry(const MediaItem *mediaItem, QObject *context = nullptr,
+                            const CreateCallback &done = CreateCallback());
+    QList<int> createTransferEntries(const QList<MediaItem*> &mediaItems, QObject *context = nullptr,
+                                     const CreateCallback &done = CreateCallback());
     bool updateTransferStatus(int key, TransferEngineData::TransferStatus status);
     bool updateProgress(int key, qreal progress);
-    bool removeTransfer(int key);
-    bool clearFailedTransfers(int excludeKey, TransferEngineData::TransferType type);
+    bool flushProgress();
+    void setProgressFlushInterval(int msecs);
+    void removeTransfer(int key);
+    void clearFailedTransfers(int excludeKey, TransferEngineData::TransferType type);
     bool clearTransfer(int key);
-    bool clearTransfers();
+    void clearTransfers();
+    int interruptUnfinishedTransfers(int *activeCount = nullptr);
+    void setRetentionPolicy(int maxTransfers, int maxAge, int failedMaxAge);
+    int pruneTransfers(int batchSize);
+    qint64 incrementalVacuum();
     int transferCount() const;
     int activeTransferCount() const;
     QList<TransferDBRecord> transfers() const;
     QList<TransferDBRecord> activeTransfers() const;
+    QList<TransferDBRecord> transfersPage(int cursor, int limit, TransferEngineData::TransferStatus status) const;
     TransferEngineData::TransferType transferType(int key) const;
     TransferEngineData::TransferStatus transferStatus(int key) const;
     qreal transferProgress(int key) const;
+    int transferPriority(int key) const;
+    QUrl transferUrl(int key) const;
+    QString transferResourceName(int key) const;
+    bool transferCancelSupported(int key) const;
     int notificationId(int key);
-    bool setNotificationId(int key, int notificationId);
+    void setNotificationId(int key, int notificationId);
     bool callbackMethods(int key, QString &cancelMethod, QString &restartMethod) const;
     MediaItem * mediaItem(int key) const;
+    void whenWritten(QObject *context, const std::function<void()> &callback);
+    quint64 cacheHits() const;
+    quint64 cacheMisses() const;
 
 private:
     DbManager();
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "dbmigration.h"
+
+#include <QElapsedTimer>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QtDebug>
+
+// Result codes of SQLite for a damaged database file
+#define SQLITE_CORRUPT_CODE "11"
+#define SQLITE_NOTADB_CODE  "26"
+
+// Table for metadata
+#define DROP_METADATA   "DROP TABLE IF EXISTS metadata;"
+#define TABLE_METADATA  "CREATE TABLE metadata  (metadata_id INTEGER PRIMARY KEY AUTOINCREMENT,\n" \
+                        "title TEXT,\n" \
+                        "description TEXT,\n" \
+                        "transfer_id INTEGER NOT NULL,\n" \
+                        "FOREIGN KEY(transfer_id) REFERENCES transfers(transfer_id) ON DELETE CASCADE\n" \
+                        ");\n"
+
+// Table for callbacks. In practice there are dbus interfaces
+#define DROP_CALLBACK   "DROP TABLE IF EXISTS callback;"
+#define TABLE_CALLBACK  "CREATE TABLE callback	(callback_id INTEGER PRIMARY KEY AUTOINCREMENT,\n" \
+                        "service TEXT,\n" \
+                        "path TEXT,\n" \
+                        "interface TEXT,\n"\
+                        "cancel_method TEXT,\n"\
+                        "restart_method TEXT,\n"\
+                        "transfer_id INTEGER NOT NULL,\n"\
+                        "FOREIGN KEY(transfer_id) REFERENCES transfers(transfer_id) ON DELETE CASCADE\n"\
+                        ");\n"
+
+// Table for all the transfers
+#define DROP_TRANSFERS  "DROP TABLE IF EXISTS transfers;"
+#define TABLE_TRANSFERS "CREATE TABLE transfers (transfer_id INTEGER PRIMARY KEY AUTOINCREMENT,\n" \
+                        "transfer_type INTEGER,\n" \
+                        "timestamp INTEGER,\n" \
+                        "status INTEGER,\n" \
+                        "progress REAL,\n" \
+                        "display_name TEXT,\n" \
+                        "application_icon TEXT,\n"\
+                        "thumbnail_icon TEXT,\n"\
+                        "service_icon TEXT,\n" \
+                        "url TEXT,\n" \
+                        "resource_name TEXT,\n" \
+                        "mime_type TEXT,\n" \
+                        "file_size INTEGER,\n" \
+                        "plugin_id TEXT,\n" \
+                        "account_id TEXT,\n"\
+                        "strip_metadata INTEGER,\n" \
+                        "scale_percent REAL,\n" \
+                        "cancel_supported INTEGER,\n" \
+                        "restart_supported INTEGER,\n" \
+                        "notification_id INTEGER,\n" \
+                        "priority INTEGER DEFAULT 0\n" \
+                        ");\n"
+
+// Cascade trigger i.e. when transfer is removed and it has metadata or callbacks, this
+// trigger make sure that they are also removed
+#define DROP_TRIGGER    "DROP TRIGGER IF EXISTS delete_cascade;"
+#define TRIGGER         "CREATE TRIGGER delete_cascade\n" \
+                        "BEFORE DELETE ON transfers\n" \
+                        "FOR EACH ROW BEGIN\n" \
+                        "    DELETE FROM metadata WHERE transfer_id = OLD.transfer_id;\n" \
+                        "    DELETE FROM callback WHERE transfer_id = OLD.transfer_id;\n" \
+                        "END;\n"
+
+// Indexes for the queries filtering transfers by status and type, and ordering them by time
+#define INDEX_STATUS        "CREATE INDEX IF NOT EXISTS transfers_status ON transfers (status);"
+#define INDEX_TYPE_STATUS   "CREATE INDEX IF NOT EXISTS transfers_type_status ON transfers (transfer_type, status);"
+#define INDEX_TIMESTAMP     "CREATE INDEX IF NOT EXISTS transfers_timestamp ON transfers (timestamp);"
+
+// Indexes for the cascade trigger and the lookups of the metadata and callbacks of a transfer
+#define INDEX_METADATA      "CREATE INDEX IF NOT EXISTS metadata_transfer_id ON metadata (transfer_id);"
+#define INDEX_CALLBACK      "CREATE INDEX IF NOT EXISTS callback_transfer_id ON callback (transfer_id);"
+
+// Update the following version if database schema changes, and add a step upgrading
+// the previous version to the migration steps below.
+#define USER_VERSION 6
+
+namespace {
+
+bool exec(QSqlQuery &query, const char *statement)
+{
+    if (!query.exec(QLatin1String(statement))) {
+        qWarning() << "DbMigration: Failed to execute" << statement
+                   << query.lastError().text() << ":" << query.lastError().databaseText();
+        return false;
+    }
+    return true;
+}
+
+bool setUserVersion(QSqlQuery &query, int version)
+{
+    if (!query.exec(QStringLiteral("PRAGMA user_version=%1").arg(version))) {
+        qWarning() << "DbMigration: pragma user_version update:"
+                   << query.lastError().text() << ":" << query.lastError().databaseText();
+        return false;
+    }
+    return true;
+}
+
+bool createIndexes(QSqlQuery &query)
+{
+    return exec(query, INDEX_STATUS)
+            && exec(query, INDEX_TYPE_STATUS)
+            && exec(query, INDEX_TIMESTAMP)
+            && exec(query, INDEX_METADATA)
+            && exec(query, INDEX_CALLBACK);
+}
+
+// Version 2 added the id of the notification shown for the transfer. The column is the
+// last one, so the rows read by the older declarative model keep their layout.
+bool addNotificationId(QSqlQuery &query)
+{
+    return exec(query, "ALTER TABLE transfers ADD COLUMN notification_id INTEGER");
+}
+
+// Version 3 added the indexes for the status, type and timestamp lookups
+bool addIndexes(QSqlQuery &query)
+{
+    return exec(query, INDEX_STATUS)
+            && exec(query, INDEX_TYPE_STATUS)
+            && exec(query, INDEX_TIMESTAMP);
+}
+
+// Version 4 indexed the transfer ids of the metadata and callbacks, which are looked up
+// by the cascade trigger for every deleted transfer
+bool addTransferIdIndexes(QSqlQuery &query)
+{
+    return exec(query, INDEX_METADATA)
+            && exec(query, INDEX_CALLBACK);
+}
+
+// Version 5 stored the timestamps as milliseconds since the epoch instead of ISO 8601 strings.
+// SQLite can't change the type of a column, so the transfers table is copied to a new one.
+bool convertTimestamps(QSqlQuery &query)
+{
+    return exec(query, "CREATE TABLE transfers_v5 (transfer_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                       "transfer_type INTEGER, timestamp INTEGER, status INTEGER, progress REAL, "
+                       "display_name TEXT, application_icon TEXT, thumbnail_icon TEXT, service_icon TEXT, "
+                       "url TEXT, resource_name TEXT, mime_type TEXT, file_size INTEGER, plugin_id TEXT, "
+                       "account_id TEXT, strip_metadata INTEGER, scale_percent REAL, cancel_supported INTEGER, "
+                       "restart_supported INTEGER, notification_id INTEGER)")
+            && exec(query, "INSERT INTO transfers_v5 SELECT transfer_id, transfer_type, "
+                           "CAST(strftime('%s', timestamp) AS INTEGER) * 1000, status, progress, display_name, "
+                           "application_icon, thumbnail_icon, service_icon, url, resource_name, mime_type, "
+                           "file_size, plugin_id, account_id, strip_metadata, scale_percent, cancel_supported, "
+                           "restart_supported, notification_id FROM transfers")
+            // Keep the ids of the removed transfers unused
+            && exec(query, "UPDATE sqlite_sequence SET seq=(SELECT seq FROM sqlite_sequence WHERE name='transfers') "
+                           "WHERE name='transfers_v5' AND EXISTS (SELECT seq FROM sqlite_sequence WHERE name='transfers')")
+            && exec(query, "DROP TABLE transfers")
+            && exec(query, "ALTER TABLE transfers_v5 RENAME TO transfers")
+            && exec(query, TRIGGER)
+            && exec(query, INDEX_STATUS)
+            && exec(query, INDEX_TYPE_STATUS)
+            && exec(query, INDEX_TIMESTAMP);
+}
+
+// Version 6 stored the priority of the upload in the transfer queue, so that a restarted
+// upload is queued like the original one
+bool addPriority(QSqlQuery &query)
+{
+    return exec(query, "ALTER TABLE transfers ADD COLUMN priority INTEGER DEFAULT 0");
+}
+
+struct MigrationStep
+{
+    int version; // the version the step upgrades the database to
+    bool (*migrate)(QSqlQuery &query);
+    // Dropping the transfers table with foreign keys enabled would delete the metadata and
+    // callbacks, so the steps rebuilding the table run with them disabled
+    bool rebuildsTables;
+};
+
+const MigrationStep migrationSteps[] = {
+    { 2, addNotificationId, false },
+    { 3, addIndexes, false },
+    { 4, addTransferIdIndexes, false },
+    { 5, convertTimestamps, true },
+    { 6, addPriority, false },
+};
+
+// Reads whether foreign keys are enforced on the connection to \a enabled
+bool foreignKeys(QSqlDatabase &db, bool *enabled)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA foreign_keys")) || !query.next()) {
+        qWarning() << "DbMigration: Failed to read foreign keys:"
+                   << query.lastError().text() << ":" << query.lastError().databaseText();
+        return false;
+    }
+    *enabled = query.value(0).toBool();
+    return true;
+}
+
+// Foreign key enforcement can't be changed inside a transaction
+bool setForeignKeys(QSqlDatabase &db, bool enabled)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA foreign_keys=%1").arg(enabled ? "ON" : "OFF"))) {
+        qWarning() << "DbMigration: Failed to set foreign keys:"
+                   << query.lastError().text() << ":" << query.lastError().databaseText();
+        return false;
+    }
+    return true;
+}
+
+// Runs the schema changes and the matching user_version update as one transaction, so
+// that an interrupted upgrade leaves the database at the previous version.
+bool runInTransaction(QSqlDatabase &db, int version, bool (*step)(QSqlQuery &query))
+{
+    if (!db.transaction()) {
+        qWarning() << "DbMigration: Failed to start a transaction:" << db.lastError().text();
+        return false;
+    }
+
+    bool ok;
+    {
+        QSqlQuery query(db);
+        ok = step(query) && setUserVersion(query, version);
+        query.finish();
+    }
+
+    if (ok && db.commit()) {
+        return true;
+    }
+
+    qWarning() << "DbMigration: Failed to migrate to version" << version << db.lastError().text();
+    db.rollback();
+    return false;
+}
+
+bool createTables(QSqlQuery &query)
+{
+    return exec(query, TABLE_METADATA)
+            && exec(query, TABLE_CALLBACK)
+            && exec(query, TABLE_TRANSFERS)
+            && exec(query, TRIGGER)
+            && createIndexes(query);
+}
+
+bool dropAndCreateTables(QSqlQuery &query)
+{
+    return exec(query, DROP_TRIGGER)
+            && exec(query, DROP_METADATA)
+            && exec(query, DROP_CALLBACK)
+            && exec(query, DROP_TRANSFERS)
+            && createTables(query);
+}
+
+}
+
+/*!
+    \class DbMigration
+    \brief The DbMigration class creates and upgrades the schema of the transfer database.
+
+    The schema version is kept in the user_version pragma of the database. Each schema change
+    is a migration step from the previous version, which is run in its own transaction together
+    with the version update, so existing transfers survive the upgrade.
+*/
+
+/*!
+    Returns the schema version the database is migrated to.
+ */
+int DbMigration::latestVersion()
+{
+    return USER_VERSION;
+}
+
+/*!
+    Returns the schema version of the database \a db or -1 on failure. A new, empty database
+    has version 0.
+ */
+int DbMigration::userVersion(QSqlDatabase db)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA user_version")) || !query.next()) {
+        qWarning() << "DbMigration: Failed to execute SQL query for user_version."
+                   << query.lastError().text() << ": "
+                   << query.lastError().databaseText();
+        return -1;
+    }
+    return query.value(0).toInt();
+}
+
+/*!
+    Creates the latest schema to the empty database \a db. Returns true on success.
+ */
+bool DbMigration::createSchema(QSqlDatabase db)
+{
+    return runInTransaction(db, USER_VERSION, createTables);
+}
+
+/*!
+    Upgrades the database \a db step by step from its current version to the latest one,
+    creating the schema if the database is empty.
+
+    Returns false if any of the steps fails, or if the database has been created by a newer
+    version of the engine. The steps done before the failure are kept, so the migration can
+    be retried later. A failure alone doesn't mean that the database is unusable, see
+    isCorrupt().
+ */
+bool DbMigration::migrate(QSqlDatabase db)
+{
+    int version = userVersion(db);
+    if (version < 0) {
+        return false;
+    }
+
+    if (version == 0) {
+        return createSchema(db);
+    }
+
+    if (version > USER_VERSION) {
+        qWarning() << "DbMigration: Unknown database version" << version;
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    const int fromVersion = version;
+
+    for (const MigrationStep &step : migrationSteps) {
+        if (step.version <= version) {
+            continue;
+        }
+        // The connection is left with foreign keys as it was before the step
+        bool foreignKeysEnabled = false;
+        if (step.rebuildsTables && (!foreignKeys(db, &foreignKeysEnabled)
+                                    || (foreignKeysEnabled && !setForeignKeys(db, false)))) {
+            return false;
+        }
+        const bool ok = runInTransaction(db, step.version, step.migrate);
+        if (foreignKeysEnabled) {
+            setForeignKeys(db, true);
+        }
+        if (!ok) {
+            return false;
+        }
+        version = step.version;
+    }
+
+    if (version != USER_VERSION) {
+        qWarning() << "DbMigration: No migration step to version" << version + 1;
+        return false;
+    }
+
+    if (fromVersion != version) {
+        qDebug() << "DbMigration: Migrated the database from version" << fromVersion
+                 << "to" << version << "in" << timer.elapsed() << "ms";
+    }
+    return true;
+}
+
+/*!
+    Returns true if the database \a db is damaged so that its data can't be used anymore,
+    either because the file isn't a database or because the integrity check finds errors.
+    Returns false if the check itself fails for a transient reason, e.g. the database is busy.
+ */
+bool DbMigration::isCorrupt(QSqlDatabase db)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("PRAGMA quick_check(1)")) || !query.next()) {
+        const QString code = query.lastError().nativeErrorCode();
+        qWarning() << "DbMigration: Failed to check the database integrity"
+                   << query.lastError().text() << ":" << query.lastError().databaseText();
+        return code == QLatin1String(SQLITE_CORRUPT_CODE) || code == QLatin1String(SQLITE_NOTADB_CODE);
+    }
+
+    const QString result = query.value(0).toString();
+    if (result != QLatin1String("ok")) {
+        qWarning() << "DbMigration: The database is corrupt:" << result;
+        return true;
+    }
+    return false;
+}
+
+/*!
+    Drops all the tables from the database \a db and creates the latest schema, losing the
+    existing transfers. This is only meant as the last resort when the database is corrupt.
+    Returns true on success.
+ */
+bool DbMigration::recreate(QSqlDatabase db)
+{
+    return runInTransaction(db, USER_VERSION, dropAndCreateTables);
+}
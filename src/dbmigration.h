@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef DBMIGRATION_H
+#define DBMIGRATION_H
+
+#include <QSqlDatabase>
+
+class DbMigration
+{
+public:
+    static int latestVersion();
+    static int userVersion(QSqlDatabase db);
+
+    static bool createSchema(QSqlDatabase db);
+    static bool migrate(QSqlDatabase db);
+    static bool isCorrupt(QSqlDatabase db);
+    static bool recreate(QSqlDatabase db);
+};
+
+#endif // DBMIGRATION_H
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "dbworker.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QPointer>
+#include <QSemaphore>
+#include <QtDebug>
+
+// Carries the callback of a finished job to the thread which posted the job
+class DbCallbackEvent : public QEvent
+{
+public:
+    DbCallbackEvent(const QPointer<QObject> &context, const std::function<void()> &callback)
+        : QEvent(eventType())
+        , context(context)
+        , callback(callback)
+    {
+    }
+
+    static QEvent::Type eventType()
+    {
+        static const QEvent::Type type = static_cast<QEvent::Type>(QEvent::registerEventType());
+        return type;
+    }
+
+    QPointer<QObject> context;
+    std::function<void()> callback;
+};
+
+class DbCallbackReceiver : public QObject
+{
+public:
+    bool event(QEvent *event)
+    {
+        if (event->type() == DbCallbackEvent::eventType()) {
+            DbCallbackEvent *callbackEvent = static_cast<DbCallbackEvent *>(event);
+            // Skip the callback if its context has been destroyed meanwhile
+            if (callbackEvent->context) {
+                callbackEvent->callback();
+            }
+            return true;
+        }
+        return QObject::event(event);
+    }
+};
+
+DbWorker::DbWorker()
+    : m_receiver(new DbCallbackReceiver)
+{
+    start();
+}
+
+DbWorker::~DbWorker()
+{
+    stop();
+    delete m_receiver;
+}
+
+// Queues the job to be run in the worker thread
+void DbWorker::post(const std::function<void()> &job)
+{
+    enqueue(job);
+}
+
+// Queues the job and calls the callback in the thread which created the worker once the job
+// has been run, unless the context object has been destroyed before that.
+void DbWorker::post(const std::function<void()> &job, QObject *context, const std::function<void()> &callback)
+{
+    DbCallbackReceiver *receiver = m_receiver;
+    const QPointer<QObject> guard(context);
+    post([job, guard, callback, receiver] {
+        job();
+        QCoreApplication::postEvent(receiver, new DbCallbackEvent(guard, callback));
+    });
+}
+
+// Runs the job in the worker thread and waits until it has finished. All the jobs posted
+// before are run first.
+void DbWorker::call(const std::function<void()> &job)
+{
+    if (QThread::currentThread() == this) {
+        job();
+        return;
+    }
+
+    QSemaphore done;
+    if (enqueue([&job, &done] {
+        job();
+        done.release();
+    })) {
+        done.acquire();
+    }
+}
+
+// Runs the remaining jobs and stops the worker thread. Jobs posted after this are skipped.
+void DbWorker::stop()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_condition.wakeOne();
+    }
+    wait();
+
+    // Deliver the callbacks of the last jobs while the thread which created the worker can
+    // still receive them
+    if (QCoreApplication::instance() && QThread::currentThread() == m_receiver->thread()) {
+        QCoreApplication::sendPostedEvents(m_receiver, DbCallbackEvent::eventType());
+    }
+}
+
+// Queues the job unless the worker has been stopped. Returns true if the job will be run.
+bool DbWorker::enqueue(const std::function<void()> &job)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_stopping) {
+        qWarning() << "DbWorker: The worker has been stopped, skipping a job";
+        return false;
+    }
+    m_jobs.enqueue(job);
+    m_condition.wakeOne();
+    return true;
+}
+
+void DbWorker::run()
+{
+    forever {
+        std::function<void()> job;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_jobs.isEmpty() && !m_stopping) {
+                m_condition.wait(&m_mutex);
+            }
+            if (m_jobs.isEmpty()) {
+                return;
+            }
+            job = m_jobs.dequeue();
+        }
+        job();
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef DBWORKER_H
+#define DBWORKER_H
+
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <functional>
+
+class DbCallbackReceiver;
+
+// Runs database jobs one after another in a thread of its own, so that the thread posting
+// the jobs doesn't wait on disk. Jobs are run in the order they have been posted.
+class DbWorker : public QThread
+{
+public:
+    DbWorker();
+    ~DbWorker();
+
+    void post(const std::function<void()> &job);
+    void post(const std::function<void()> &job, QObject *context, const std::function<void()> &callback);
+    void call(const std::function<void()> &job);
+    void stop();
+
+protected:
+    void run();
+
+private:
+    bool enqueue(const std::function<void()> &job);
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QQueue<std::function<void()> > m_jobs;
+    bool m_stopping = false;
+    DbCallbackReceiver *m_receiver = nullptr;
+};
+
+#endif // DBWORKER_H
@@ -53,14 +53,22 @@ PRE_TARGETDEPS += ts engineering_english
 # Input
 SOURCES += main.cpp \
     dbmanager.cpp \
+    dbmigration.cpp \
+    dbworker.cpp \
     logging.cpp \
-    transferengine.cpp
+    transferengine.cpp \
+    transferpluginregistry.cpp \
+    transferscheduler.cpp
 
 HEADERS += \
     dbmanager.h \
+    dbmigration.h \
+    dbworker.h \
     logging.h \
     transferengine.h \
-    transferengine_p.h
+    transferengine_p.h \
+    transferpluginregistry.h \
+    transferscheduler.h
 
 DEFINES += TRANSFER_PLUGINS_PATH=\"\\\"$$[QT_INSTALL_LIBS]/nemo-transferengine/plugins/transfer\\\"\"
 
@@ -31,11 +31,14 @@
 #include "logging.h"
 #include "transferengine_adaptor.h"
 #include "transfertypes.h"
+#include "imageoperation.h"
 
 #include <QDir>
 #include <QtDebug>
 #include <QPluginLoader>
 #include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QScopedPointer>
 #include <QFileSystemWatcher>
 #include <QTimer>
 #include <QSettings>
@@ -45,8 +48,16 @@
 #include <signal.h>
 
 #define CONFIG_PATH "/usr/share/nemo-transferengine/nemo-transfer-engine.conf"
-#define ACTIVITY_MONITOR_TIMEOUT 1*60*1000 // 1 minute in ms
-#define TRANSFER_EXPIRATION_THRESHOLD 3*60 // 3 minutes in seconds
+#define PLUGIN_REGISTRY_PATH ".cache/nemo-transferengine/transferplugins.ini"
+#define NOTIFICATION_UPDATE_INTERVAL 1000 // 1 second in ms
+#define PROGRESS_BATCH_INTERVAL 250 // ms
+#define CALLBACK_CALL_TIMEOUT 5000 // 5 seconds in ms
+#define RETENTION_IDLE_DELAY 5000 // 5 seconds in ms
+#define RETENTION_BATCH_SIZE 100
+// The history is kept in full unless a retention policy has been configured
+#define RETENTION_MAX_TRANSFERS 0
+#define RETENTION_MAX_AGE 0 // days
+#define RETENTION_FAILED_MAX_AGE 0 // days
 
 #define TRANSFER_EVENT_CATEGORY "transfer"
 #define TRANSFER_COMPLETE_EVENT_CATEGORY "transfer.complete"
@@ -74,95 +85,52 @@ TransferEngineSignalHandler::TransferEngineSignalHandler()
     signal(SIGUSR1, TransferEngineSignalHandler::signalHandler);
 }
 
-// ---------------------------
-
-// ClientActivityMonitor runs periodic checks if there are transfers which are expired.
-// A transfer can be expired e.g. when a client has been crashed in the middle of Sync,
-// Download or Upload operation or the client API isn't used properly.
-//
-// NOTE: This class only monitors if there are expired transfers and emit signal to indicate
-// that it's cleaning time.  It is up to Transfer Engine to remoce expired ids from the
-// ClientActivityMonitor instance.
-ClientActivityMonitor::ClientActivityMonitor(QObject *parent)
-    : QObject(parent)
-    , m_timer(new QTimer(this))
-{
-    connect(m_timer, SIGNAL(timeout()), this, SLOT(checkActivity()));
-    m_timer->start(ACTIVITY_MONITOR_TIMEOUT);
-}
-
-ClientActivityMonitor::~ClientActivityMonitor()
-{
-    m_activityMap.clear();
-}
-
-void ClientActivityMonitor::newActivity(int transferId)
-{
-    // Update or add a new timestamp
-    m_activityMap.insert(transferId, QDateTime::currentDateTimeUtc().toTime_t());
-}
-
-void ClientActivityMonitor::activityFinished(int transferId)
-{
-    if (!m_activityMap.contains(transferId)) {
-        qCWarning(lcTransferLog) << Q_FUNC_INFO << "Could not find matching TransferId. This is probably an error!";
-        return;
-    }
-
-    m_activityMap.remove(transferId);
-}
-
-bool ClientActivityMonitor::activeTransfers() const
-{
-    return !m_activityMap.isEmpty();
-}
-
-bool ClientActivityMonitor::isActiveTransfer(int transferId) const
-{
-    return m_activityMap.contains(transferId);
-}
-
-void ClientActivityMonitor::checkActivity()
-{
-    // Check if there are existing transfers which are not yet finished and
-    // they've been around too long. Notify TransferEngine about these transfers.
-    QList<int> ids;
-    quint32 currTime = QDateTime::currentDateTimeUtc().toTime_t();
-    QMap<int, quint32>::const_iterator i = m_activityMap.constBegin();
-    while (i != m_activityMap.constEnd()) {
-        if ((currTime - i.value()) >= TRANSFER_EXPIRATION_THRESHOLD) {
-            ids << i.key();
-        }
-        i++;
-    }
-
-    if (!ids.isEmpty()) {
-        emit transfersExpired(ids);
-    }
-}
-
-
 // ----------------------------
 
 TransferEnginePrivate::TransferEnginePrivate(TransferEngine *parent):
+    m_pluginRegistry(TRANSFER_PLUGINS_PATH, QDir::homePath() + QDir::separator() + PLUGIN_REGISTRY_PATH),
     m_notificationsEnabled(true),
+    m_notificationUpdateInterval(NOTIFICATION_UPDATE_INTERVAL),
     q_ptr(parent)
 {
+    m_notificationTimer = new QTimer(this);
+    m_notificationTimer->setSingleShot(true);
+    connect(m_notificationTimer, SIGNAL(timeout()), this, SLOT(publishPendingNotifications()));
+    m_notificationClock.start();
+
+    m_progressBatchTimer = new QTimer(this);
+    m_progressBatchTimer->setSingleShot(true);
+    m_progressBatchTimer->setInterval(PROGRESS_BATCH_INTERVAL);
+    connect(m_progressBatchTimer, SIGNAL(timeout()), this, SLOT(emitProgressBatch()));
+
     m_delayedExitTimer = new QTimer(this);
     m_delayedExitTimer->setSingleShot(true);
     m_delayedExitTimer->setInterval(60000);
     m_delayedExitTimer->start(); // Exit if nothing happens within 60 sec
     connect(m_delayedExitTimer, SIGNAL(timeout()), this, SLOT(delayedExitSafely()));
 
+    // Old transfers are pruned in small batches while the engine is idle
+    m_retentionTimer = new QTimer(this);
+    m_retentionTimer->setSingleShot(true);
+    connect(m_retentionTimer, SIGNAL(timeout()), this, SLOT(pruneTransferHistory()));
+
     // Exit safely stuff if we receive certain signal or there are no active transfers
     Q_Q(TransferEngine);
     connect(TransferEngineSignalHandler::instance(), SIGNAL(exitSafely()), this, SLOT(exitSafely()));
     connect(q, SIGNAL(statusChanged(int,int)), this, SLOT(exitSafely()));
+    // Send pending progress before the status change, this is connected before the DBus adaptor
+    // so clients never receive progress of a transfer after it has finished.
+    connect(q, SIGNAL(statusChanged(int,int)), this, SLOT(emitProgressBatch()));
 
     // Monitor expired transfers and cleanup them if required
     m_activityMonitor = new ClientActivityMonitor(this);
     connect(m_activityMonitor, SIGNAL(transfersExpired(QList<int>)), this, SLOT(cleanupExpiredTransfers(QList<int>)));
 
+    // Uploads are started through the scheduler
+    m_scheduler = new TransferScheduler(this);
+    connect(m_scheduler, SIGNAL(transferReady(int)), this, SLOT(startQueuedTransfer(int)));
+    connect(m_scheduler, SIGNAL(queuedTransfersChanged()), q, SIGNAL(queuedTransfersChanged()));
+
     QSettings settings(CONFIG_PATH, QSettings::IniFormat);
 
     if (settings.status() != QSettings::NoError) {
@@ -173,6 +141,7 @@ TransferEnginePrivate::TransferEnginePrivate(TransferEngine *parent):
         const QString path = settings.value("path").toString();
         const QString iface = settings.value("interface").toString();
         const QString method = settings.value("method").toString();
+        m_legacyProgressSignal = settings.value("progressChangedSignal", true).toBool();
         settings.endGroup();
 
         if (!service.isEmpty() && !path.isEmpty() && !iface.isEmpty() && !method.isEmpty()) {
@@ -181,16 +150,114 @@ TransferEnginePrivate::TransferEnginePrivate(TransferEngine *parent):
             m_showTransfersAction = Notification::remoteAction(QString(), qtTrId("transferengine-no-show_transfers"),
                                                                service, path, iface, method);
         }
+
+        settings.beginGroup("database");
+        bool ok = false;
+        const int flushInterval = settings.value("progressFlushInterval").toInt(&ok);
+        settings.endGroup();
+
+        if (ok) {
+            DbManager::instance()->setProgressFlushInterval(flushInterval);
+        }
+
+        settings.beginGroup("notifications");
+        const int updateInterval = settings.value("updateInterval").toInt(&ok);
+        if (ok) {
+            m_notificationUpdateInterval = updateInterval;
+        }
+        settings.endGroup();
+
+        settings.beginGroup("scheduler");
+        const int maxActive = settings.value("maxActiveTransfers").toInt(&ok);
+        if (ok) {
+            m_scheduler->setMaximumActiveTransfers(maxActive);
+        }
+        settings.endGroup();
+
+        settings.beginGroup("retention");
+        DbManager::instance()->setRetentionPolicy(
+                    settings.value("maxTransfers", RETENTION_MAX_TRANSFERS).toInt(),
+                    settings.value("maxAge", RETENTION_MAX_AGE).toInt(),
+                    settings.value("failedMaxAge", RETENTION_FAILED_MAX_AGE).toInt());
+        settings.endGroup();
+
+        // Cached images are copies of the shared photos, so drop them when the cache is disabled
+        settings.beginGroup("imageCache");
+        const qint64 cacheMaxSize = settings.value("maxSize", 0).toLongLong() * 1024 * 1024;
+        settings.endGroup();
+
+        ImageOperation::setCacheMaxSize(cacheMaxSize);
+        if (cacheMaxSize <= 0) {
+            ImageOperation::clearCache();
+        }
+
+        settings.beginGroup("pluginLimits");
+        Q_FOREACH(const QString &pluginId, settings.childKeys()) {
+            m_scheduler->setPluginLimit(pluginId, settings.value(pluginId).toInt());
+        }
+        settings.endGroup();
     }
 }
 
+// Clients read the transfers from the database, so they are told about the changes only
+// once DbManager has written them.
+void TransferEnginePrivate::emitTransfersChanged()
+{
+    Q_Q(TransferEngine);
+    DbManager::instance()->whenWritten(q, [q] {
+        emit q->transfersChanged();
+    });
+}
+
+void TransferEnginePrivate::emitActiveTransfersChanged()
+{
+    Q_Q(TransferEngine);
+    DbManager::instance()->whenWritten(q, [q] {
+        emit q->activeTransfersChanged();
+    });
+}
+
 void TransferEnginePrivate::exitSafely()
 {
-    if (!m_activityMonitor->activeTransfers()) {
+    if (!m_activityMonitor->activeTransfers() && m_scheduler->queuedCount() == 0) {
         qCDebug(lcTransferLog) << "Scheduling exit in" << m_delayedExitTimer->interval() << "ms";
         m_delayedExitTimer->start();
+        if (!m_historyPruned) {
+            m_retentionTimer->start(RETENTION_IDLE_DELAY);
+        }
     } else {
         m_delayedExitTimer->stop();
+        m_retentionTimer->stop();
+        m_historyPruned = false;
+    }
+}
+
+void TransferEnginePrivate::pruneTransferHistory()
+{
+    // Give way to the transfers started meanwhile, the pass continues when idle again
+    if (m_activityMonitor->activeTransfers() || m_scheduler->queuedCount() > 0) {
+        return;
+    }
+
+    const int pruned = DbManager::instance()->pruneTransfers(RETENTION_BATCH_SIZE);
+    if (pruned > 0) {
+        m_prunedTransfers += pruned;
+    }
+
+    if (pruned == RETENTION_BATCH_SIZE) {
+        // Let the event loop dispatch the pending DBus calls before the next batch
+        m_retentionTimer->start(0);
+        return;
+    }
+
+    m_historyPruned = true;
+    if (m_prunedTransfers > 0) {
+        const qint64 reclaimed = DbManager::instance()->incrementalVacuum();
+        qCDebug(lcTransferLog) << "Pruned" << m_prunedTransfers << "transfers from the history,"
+                               << "reclaimed" << reclaimed << "bytes";
+        m_prunedTransfers = 0;
+
+        emitTransfersChanged();
     }
 }
 
@@ -211,30 +278,62 @@ void TransferEnginePrivate::cleanupExpiredTransfers(const QList<int> &expiredIds
     // user manually from the UI.
     Q_Q(TransferEngine);
     Q_FOREACH(int id, expiredIds) {
+        // Free the scheduler slot of an expired upload, otherwise the stalled uploads keep
+        // the queued ones from starting and the engine from exiting.
+        releaseTransfer(id);
         if (DbManager::instance()->updateTransferStatus(id, TransferEngineData::TransferInterrupted)) {
-            if (m_activityMonitor->isActiveTransfer(id)) {
-                m_activityMonitor->activityFinished(id);
-            }
             emit q->statusChanged(id, TransferEngineData::TransferInterrupted);
         }
     }
+    exitSafely();
 }
 
-void TransferEnginePrivate::recoveryCheck()
+// Stops the plugin of the transfer, if any, and releases its scheduler slot and activity.
+void TransferEnginePrivate::releaseTransfer(int transferId)
+{
+    m_scheduler->transferFinished(transferId);
+    if (m_activityMonitor->isActiveTransfer(transferId)) {
+        m_activityMonitor->activityFinished(transferId);
+    }
+
+    MediaTransferInterface *muif = m_plugins.key(transferId);
+    if (muif) {
+        m_plugins.remove(muif);
+        muif->disconnect();
+        if (muif->status() == MediaTransferInterface::TransferStarted) {
+            muif->cancel();
+        }
+        muif->deleteLater();
+    }
+}
+
+// The transfers couldn't be written to the database, so they don't exist. Stop them and tell the
+// clients which already got the ids that they have failed.
+void TransferEnginePrivate::transferEntriesFailed(const QList<int> &transferIds)
 {
-    QList<TransferDBRecord> records = DbManager::instance()->transfers();
-    // Check all transfer which are not properly finished and mark those as
-    //  interrupted
     Q_Q(TransferEngine);
-    Q_FOREACH(TransferDBRecord record, records) {
-        if (record.status == TransferEngineData::TransferStarted ||
-            record.status == TransferEngineData::NotStarted) {
-            if (DbManager::instance()->updateTransferStatus(record.transfer_id, TransferEngineData::TransferInterrupted)) {
-                emit q->statusChanged(record.transfer_id, TransferEngineData::TransferInterrupted);
-                if (record.status == TransferEngineData::TransferStarted) {
-                    emit q_ptr->activeTransfersChanged(); // It's not active anymore
-                }
-            }
+    qCWarning(lcTransferLog) << "Failed to create transfers" << transferIds << "to the transfer database!";
+    Q_FOREACH (int transferId, transferIds) {
+        m_keyTypeCache.remove(transferId);
+        releaseTransfer(transferId);
+        emit q->statusChanged(transferId, TransferEngineData::TransferInterrupted);
+    }
+    emitTransfersChanged();
+    emitActiveTransfersChanged();
+    exitSafely();
+}
+
+void TransferEnginePrivate::recoveryCheck()
+{
+    // Mark all the transfers which are not properly finished as interrupted. Clients reload
+    // the transfers on a single change signal instead of a status change of each transfer.
+    int active = 0;
+    const int interrupted = DbManager::instance()->interruptUnfinishedTransfers(&active);
+    if (interrupted > 0) {
+        qCDebug(lcTransferLog) << "Interrupted" << interrupted << "unfinished transfers";
+        emitTransfersChanged();
+        if (active > 0) {
+            emitActiveTransfersChanged(); // They're not active anymore
         }
     }
 }
@@ -251,6 +350,92 @@ void TransferEnginePrivate::sendNotification(TransferEngineData::TransferType ty
         return;
     }
 
+    // Ongoing transfers update their notification at most once per interval, the latest
+    // update within the interval is published when it ends. Other states always go through
+    // right away and replace any pending update.
+    if (status != TransferEngineData::TransferStarted || m_notificationUpdateInterval <= 0) {
+        if (m_pendingNotifications.remove(transferId) > 0) {
+            ++m_suppressedNotifications[transferId];
+        }
+        m_lastNotificationUpdate.remove(transferId);
+        if (status == TransferEngineData::TransferFinished
+                || status == TransferEngineData::TransferCanceled
+                || status == TransferEngineData::TransferInterrupted) {
+            const int suppressed = m_suppressedNotifications.take(transferId);
+            if (suppressed > 0) {
+                qCDebug(lcTransferLog) << "Suppressed" << suppressed << "notification updates of transfer" << transferId;
+            }
+        }
+        publishNotification(type, status, progress, fileName, transferId, canCancel, localFileUrl);
+        return;
+    }
+
+    const qint64 now = m_notificationClock.elapsed();
+    QHash<int, qint64>::const_iterator last = m_lastNotificationUpdate.constFind(transferId);
+    if (last == m_lastNotificationUpdate.constEnd() || now - last.value() >= m_notificationUpdateInterval) {
+        if (m_pendingNotifications.remove(transferId) > 0) {
+            ++m_suppressedNotifications[transferId];
+        }
+        m_lastNotificationUpdate.insert(transferId, now);
+        publishNotification(type, status, progress, fileName, transferId, canCancel, localFileUrl);
+        return;
+    }
+
+    if (m_pendingNotifications.contains(transferId)) {
+        ++m_suppressedNotifications[transferId];
+    }
+
+    PendingNotification pending;
+    pending.type = type;
+    pending.status = status;
+    pending.progress = progress;
+    pending.fileName = fileName;
+    pending.canCancel = canCancel;
+    pending.localFileUrl = localFileUrl;
+    m_pendingNotifications.insert(transferId, pending);
+
+    const int remaining = m_notificationUpdateInterval - (now - last.value());
+    if (!m_notificationTimer->isActive() || m_notificationTimer->remainingTime() > remaining) {
+        m_notificationTimer->start(remaining);
+    }
+}
+
+void TransferEnginePrivate::publishPendingNotifications()
+{
+    const qint64 now = m_notificationClock.elapsed();
+    qint64 nextDue = -1;
+
+    QHash<int, PendingNotification>::iterator it = m_pendingNotifications.begin();
+    while (it != m_pendingNotifications.end()) {
+        const qint64 due = m_lastNotificationUpdate.value(it.key()) + m_notificationUpdateInterval;
+        if (due > now) {
+            nextDue = (nextDue < 0) ? due : qMin(nextDue, due);
+            ++it;
+            continue;
+        }
+
+        const int transferId = it.key();
+        const PendingNotification pending = it.value();
+        it = m_pendingNotifications.erase(it);
+        m_lastNotificationUpdate.insert(transferId, now);
+        publishNotification(pending.type, pending.status, pending.progress, pending.fileName,
+                            transferId, pending.canCancel, pending.localFileUrl);
+    }
+
+    if (nextDue >= 0) {
+        m_notificationTimer->start(nextDue - now);
+    }
+}
+
+void TransferEnginePrivate::publishNotification(TransferEngineData::TransferType type,
+                                                TransferEngineData::TransferStatus status,
+                                                qreal progress,
+                                                const QString &fileName,
+                                                int transferId,
+                                                bool canCancel,
+                                                const QUrl &localFileUrl)
+{
+
     QString category;
     QString body;
     QString summary;
@@ -443,6 +628,63 @@ int TransferEnginePrivate::uploadMediaItem(MediaItem *mediaItem,
         return -1;
     }
 
+    prepareUpload(mediaItem, muif, userData);
+
+    // Let's create an entry into Transfer DB. The entry is written in the background, and the
+    // transfer is failed if that doesn't succeed.
+    const int key = DbManager::instance()->createTransferEntry(mediaItem, this, [this](const QList<int> &transferIds, bool ok) {
+        if (!ok) {
+            transferEntriesFailed(transferIds);
+        }
+    });
+    m_keyTypeCache.insert(key, TransferEngineData::Upload);
+
+    emitTransfersChanged();
+    emit q->statusChanged(key, TransferEngineData::NotStarted);
+
+    // For now, we just store our uploader to a map. It'll be removed from it when
+    // the upload has finished. The upload stays NotStarted until the scheduler starts it.
+    m_plugins.insert(muif, key);
+    m_scheduler->enqueue(key, mediaItem->value(MediaItem::PluginId).toString(),
+                         userData.value("priority").toInt());
+    return key;
+}
+
+QList<int> TransferEnginePrivate::uploadMediaItems(const QList<MediaItem*> &mediaItems,
+                                                   const QList<MediaTransferInterface*> &muifs,
+                                                   const QVariantMap &userData)
+{
+    Q_Q(TransferEngine);
+
+    for (int i = 0; i < mediaItems.count(); ++i) {
+        prepareUpload(mediaItems.at(i), muifs.at(i), userData);
+    }
+
+    // All the entries are created in one transaction, which fails all of them on error
+    const QList<int> keys = DbManager::instance()->createTransferEntries(mediaItems, this, [this](const QList<int> &transferIds, bool ok) {
+        if (!ok) {
+            transferEntriesFailed(transferIds);
+        }
+    });
+
+    emitTransfersChanged();
+
+    const QString pluginId = mediaItems.first()->value(MediaItem::PluginId).toString();
+    const int priority = userData.value("priority").toInt();
+    for (int i = 0; i < keys.count(); ++i) {
+        const int key = keys.at(i);
+        m_keyTypeCache.insert(key, TransferEngineData::Upload);
+        emit q->statusChanged(key, TransferEngineData::NotStarted);
+        m_plugins.insert(muifs.at(i), key);
+        m_scheduler->enqueue(key, pluginId, priority);
+    }
+    return keys;
+}
+
+void TransferEnginePrivate::prepareUpload(MediaItem *mediaItem,
+                                          MediaTransferInterface *muif,
+                                          const QVariantMap &userData)
+{
     mediaItem->setValue(MediaItem::TransferType,        TransferEngineData::Upload);
     mediaItem->setValue(MediaItem::DisplayName,         muif->displayName());
     mediaItem->setValue(MediaItem::ServiceIcon,         muif->serviceIcon());
@@ -468,53 +710,34 @@ int TransferEnginePrivate::uploadMediaItem(MediaItem *mediaItem,
             this, SLOT(uploadItemStatusChanged(MediaTransferInterface::TransferStatus)));
     connect(muif, SIGNAL(progressUpdated(qreal)),
             this, SLOT(updateProgress(qreal)));
-
-    // Let's create an entry into Transfer DB
-    const int key = DbManager::instance()->createTransferEntry(mediaItem);
-    m_keyTypeCache.insert(key, TransferEngineData::Upload);
-
-    if (key < 0) {
-        qCWarning(lcTransferLog) << "TransferEngine::uploadMediaItem: Failed to create an entry to transfer database!";
-        delete muif;
-        return key;
-    }
-
-    m_activityMonitor->newActivity(key);
-    emit q->transfersChanged();
-    emit q->statusChanged(key, TransferEngineData::NotStarted);
-
-    // For now, we just store our uploader to a map. It'll be removed from it when
-    // the upload has finished.
-    m_plugins.insert(muif, key);
-    muif->start();
-    return key;
 }
 
-QStringList TransferEnginePrivate::pluginList() const
+MediaTransferInterface *TransferEnginePrivate::loadPlugin(const QString &pluginId)
 {
-    QDir dir(TRANSFER_PLUGINS_PATH);
-    QStringList plugins = dir.entryList(QStringList() << "*.so",
-                                        QDir::Files,
-                                        QDir::NoSort);
-    QStringList filePaths;
-    Q_FOREACH(QString plugin, plugins) {
-        filePaths << dir.absolutePath() + QDir::separator() + plugin;
-    }
-
-    return filePaths;
+    TransferPluginInterface *interface = loadPluginInterface(pluginId);
+    return interface ? interface->transferObject() : 0;
 }
 
-MediaTransferInterface *TransferEnginePrivate::loadPlugin(const QString &pluginId) const
+TransferPluginInterface *TransferEnginePrivate::loadPluginInterface(const QString &pluginId)
 {
-    QPluginLoader loader;
-    loader.setLoadHints(QLibrary::ResolveAllSymbolsHint | QLibrary::ExportExternalSymbolsHint);
-    for (QString plugin : pluginList()) {
-        loader.setFileName(plugin);
-        TransferPluginInterface *interface = qobject_cast<TransferPluginInterface*>(loader.instance());
+    // The registry may be out of date if a library has been replaced without changing the
+    // plugin directory, so rescan the directory once if the lookup doesn't match.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (attempt > 0) {
+            m_pluginRegistry.invalidate(pluginId);
+        }
 
+        const QString plugin = m_pluginRegistry.pluginFile(pluginId);
+        if (plugin.isEmpty()) {
+            continue;
+        }
+
+        QPluginLoader loader(plugin);
+        loader.setLoadHints(QLibrary::ResolveAllSymbolsHint | QLibrary::ExportExternalSymbolsHint);
+        TransferPluginInterface *interface = qobject_cast<TransferPluginInterface*>(loader.instance());
 
         if (interface && interface->pluginId() == pluginId) {
-            return interface->transferObject();
+            return interface;
         }
 
         if (!interface) {
@@ -526,6 +749,7 @@ MediaTransferInterface *TransferEnginePrivate::loadPlugin(const QString &pluginI
         }
     }
 
+    qCWarning(lcTransferLog) << "TransferEngine::loadPlugin: No transfer plugin for" << pluginId;
     return 0;
 }
 
@@ -534,12 +758,17 @@ QString TransferEnginePrivate::mediaFileOrResourceName(MediaItem *mediaItem) con
     if (!mediaItem) {
         return QString();
     }
-    QUrl url = mediaItem->value(MediaItem::Url).toUrl();
+    return mediaFileOrResourceName(mediaItem->value(MediaItem::Url).toUrl(),
+                                   mediaItem->value(MediaItem::ResourceName).toString());
+}
+
+QString TransferEnginePrivate::mediaFileOrResourceName(const QUrl &url, const QString &resourceName) const
+{
     if (!url.isEmpty()) {
         QStringList split = url.toString().split(QDir::separator());
         return split.at(split.length()-1);
     }
-    return mediaItem->value(MediaItem::ResourceName).toString();
+    return resourceName;
 }
 
 void TransferEnginePrivate::uploadItemStatusChanged(MediaTransferInterface::TransferStatus status)
@@ -574,6 +803,7 @@ void TransferEnginePrivate::uploadItemStatusChanged(MediaTransferInterface::Tran
         muif->deleteLater();
         muif = 0;
         m_activityMonitor->activityFinished(key);
+        m_scheduler->transferFinished(key);
     } break;
 
     default:
@@ -605,6 +835,50 @@ void TransferEnginePrivate::updateProgress(qreal progress)
     q->updateTransferProgress(key, progress);
 }
 
+void TransferEnginePrivate::startQueuedTransfer(int transferId)
+{
+    MediaTransferInterface *muif = m_plugins.key(transferId);
+    if (muif == 0) {
+        qCWarning(lcTransferLog) << "TransferEnginePrivate::startQueuedTransfer: No upload object for" << transferId;
+        m_scheduler->transferFinished(transferId);
+        return;
+    }
+
+    m_activityMonitor->newActivity(transferId);
+    muif->start();
+}
+
+void TransferEnginePrivate::queueProgress(int transferId, double progress)
+{
+    Q_Q(TransferEngine);
+    if (m_legacyProgressSignal) {
+        emit q->progressChanged(transferId, progress);
+    }
+
+    m_progressBatch.insert(transferId, progress);
+    if (!m_progressBatchTimer->isActive()) {
+        m_progressBatchTimer->start();
+    }
+}
+
+void TransferEnginePrivate::emitProgressBatch()
+{
+    m_progressBatchTimer->stop();
+    if (m_progressBatch.isEmpty()) {
+        return;
+    }
+
+    QList<TransferProgress> batch;
+    batch.reserve(m_progressBatch.count());
+    for (QMap<int, double>::const_iterator i = m_progressBatch.constBegin(); i != m_progressBatch.constEnd(); ++i) {
+        batch << TransferProgress(i.key(), i.value());
+    }
+    m_progressBatch.clear();
+
+    Q_Q(TransferEngine);
+    emit q->progressBatch(batch);
+}
+
 TransferEngineData::TransferType TransferEnginePrivate::transferType(int transferId)
 {
     if (!m_keyTypeCache.contains(transferId)) {
@@ -628,15 +902,6 @@ void TransferEnginePrivate::callbackCall(int transferId, CallbackMethodType meth
         return;
     }
 
-    QDBusInterface remoteInterface(callback.at(Service),
-                                   callback.at(Path),
-                                   callback.at(Interface));
-
-    if (!remoteInterface.isValid()) {
-        qCWarning(lcTransferLog) << "TransferEnginePrivate::callbackCall: DBus interface is not valid!";
-        return;
-    }
-
     if (method >= callback.size()) {
         qCWarning(lcTransferLog) << "TransferEnginePrivate::callbackCall: method index out of range!";
         return;
@@ -646,8 +911,26 @@ void TransferEnginePrivate::callbackCall(int transferId, CallbackMethodType meth
     if (methodName.isEmpty()) {
         qCWarning(lcTransferLog) << "TransferEnginePrivate::callbackCall: Failed to get callback method name!";
         return;
-    }    
-    remoteInterface.call(methodName, transferId);    
+    }
+
+    // Call the client without introspecting it first and don't wait for the reply, a slow
+    // or hung client must not block the engine.
+    QDBusMessage message = QDBusMessage::createMethodCall(callback.at(Service),
+                                                          callback.at(Path),
+                                                          callback.at(Interface),
+                                                          methodName);
+    message << transferId;
+
+    QDBusPendingCall call = QDBusConnection::sessionBus().asyncCall(message, CALLBACK_CALL_TIMEOUT);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(call, this);
+    connect(watcher, &QDBusPendingCallWatcher::finished,
+            this, [transferId, methodName](QDBusPendingCallWatcher *watcher) {
+        if (watcher->isError()) {
+            qCWarning(lcTransferLog) << "TransferEnginePrivate::callbackCall: Failed to call" << methodName
+                                     << "for transfer" << transferId << ":" << watcher->error().message();
+        }
+        watcher->deleteLater();
+    });
 }
 
 
@@ -679,6 +962,17 @@ void TransferEnginePrivate::callbackCall(int transferId, CallbackMethodType meth
     \fn void TransferEngine::progressChanged(int transferId, double progress)
 
     The signal is emitted when \a progress for a transfer with a \a transferId has changed.
+
+    The signal is emitted only if it hasn't been disabled with the progressChangedSignal key in
+    the transfers group of the engine configuration. New clients should use progressBatch() instead.
+*/
+
+/*!
+    \fn void TransferEngine::progressBatch(const QList<TransferProgress> &progress)
+
+    The signal is emitted with the latest \a progress of the transfers which have changed their
+    progress during a short period of time. Pending progress changes are always emitted before
+    statusChanged().
 */
 
 /*!
@@ -687,6 +981,13 @@ void TransferEnginePrivate::callbackCall(int transferId, CallbackMethodType meth
     The signal is emitted when \a status for a transfer with a \a transferId has changed.
 */
 
+/*!
+    \fn void TransferEngine::queuedTransfersChanged()
+
+    The signal is emitted when an upload has been added to or removed from the queue of uploads
+    waiting to be started.
+*/
+
 /*!
     \fn void TransferEngine::transfersChanged()
 
@@ -702,6 +1003,7 @@ TransferEngine::TransferEngine(QObject *parent) :
     d_ptr(new TransferEnginePrivate(this))
 {
     TransferDBRecord::registerType();
+    TransferProgress::registerType();
 
     new TransferEngineAdaptor(this);
 
@@ -727,10 +1029,17 @@ TransferEngine::TransferEngine(QObject *parent) :
 TransferEngine::~TransferEngine()
 {
     Q_D(TransferEngine);
+    DbManager::instance()->flushProgress();
     d->recoveryCheck();
+    qCDebug(lcTransferLog) << "Transfer cache hits:" << DbManager::instance()->cacheHits()
+                           << "misses:" << DbManager::instance()->cacheMisses();
     delete d_ptr;
     d_ptr = 0;
 
+    // The DbManager instance outlives the application object, so close the database while the
+    // last writes can still report back
+    DbManager::instance()->close();
+
     QDBusConnection connection = QDBusConnection::sessionBus();
     connection.unregisterObject("/org/nemo/transferengine");
 
@@ -758,11 +1067,17 @@ TransferEngine::~TransferEngine()
         \li "scalePercent" The scale percent e.g. downscale image to 50% from original before uploading.
     \endlist
 
+    The optional "priority" user data value orders the upload in the transfer queue, uploads with
+    a higher priority are started first.
+
     In practice this method instantiates a transfer plugin with \a serviceId and passes a MediaItem instance filled
-    with required data to it. When the plugin has been loaded, the MediaTransferInterface::start() method is called
-    and the actual uploading starts.
+    with required data to it. The upload is then queued and it stays in TransferEngineData::NotStarted
+    state until the number of running uploads, both in total and for the plugin, allows it to be
+    started. At that point the MediaTransferInterface::start() method is called and the actual uploading starts.
 
     This method returns a transfer ID which can be used later to fetch information of this specific transfer.
+    The transfer is written to the database in the background. If that fails, the statusChanged() signal
+    is emitted with TransferEngineData::TransferInterrupted and the ID is not valid anymore.
  */
 int TransferEngine::uploadMediaItem(const QString &source,
                                     const QString &serviceId,
@@ -796,6 +1111,78 @@ int TransferEngine::uploadMediaItem(const QString &source,
     return d->uploadMediaItem(mediaItem, muif, userData);
 }
 
+/*!
+    DBus adaptor calls this method to start uploading several media items with the same transfer
+    plugin at once. \a sources are the paths to the media items to be uploaded and \a mimeTypes
+    their MimeTypes, either one for each source or a single MimeType used for all of them.
+    \a serviceId, \a metadataStripped and \a userData are applied to every item and have the same
+    meaning as in uploadMediaItem().
+
+    Compared to calling uploadMediaItem() for each file, the transfer plugin is loaded only once,
+    all the database entries are created in a single transaction and transfersChanged() is emitted
+    only once. Share UIs should use this method when SharingMethodInfo::supportsMultipleFiles()
+    is true for the selected sharing method.
+
+    This method returns the transfer IDs in the same order as \a sources, or an empty list if
+    the uploads could not be created. If writing the entries fails later, statusChanged() is
+    emitted with TransferEngineData::TransferInterrupted for each of the IDs.
+ */
+QList<int> TransferEngine::uploadMediaItems(const QStringList &sources,
+                                            const QString &serviceId,
+                                            const QStringList &mimeTypes,
+                                            bool metadataStripped,
+                                            const QVariantMap &userData)
+{
+    Q_D(TransferEngine);
+    d->exitSafely();
+
+    if (sources.isEmpty()) {
+        return QList<int>();
+    }
+
+    if (mimeTypes.count() != sources.count() && mimeTypes.count() != 1) {
+        qCWarning(lcTransferLog) << "TransferEngine::uploadMediaItems: MimeType count doesn't match the sources";
+        return QList<int>();
+    }
+
+    TransferPluginInterface *interface = d->loadPluginInterface(serviceId);
+    if (interface == 0) {
+        qCWarning(lcTransferLog) << "TransferEngine::uploadMediaItems Failed to get TransferPluginInterface";
+        return QList<int>();
+    }
+
+    QList<MediaItem*> mediaItems;
+    QList<MediaTransferInterface*> muifs;
+    for (int i = 0; i < sources.count(); ++i) {
+        MediaTransferInterface *muif = interface->transferObject();
+        if (muif == 0) {
+            qCWarning(lcTransferLog) << "TransferEngine::uploadMediaItems Failed to get MediaTransferInterface";
+            qDeleteAll(muifs);
+            return QList<int>();
+        }
+
+        QUrl filePath(sources.at(i));
+        QFileInfo fileInfo(filePath.toLocalFile());
+        if (!fileInfo.exists()) {
+            qCWarning(lcTransferLog) << "TransferEngine::uploadMediaItems file " << sources.at(i) << " doesn't exist!";
+        }
+
+        MediaItem *mediaItem = new MediaItem(muif);
+        mediaItem->setValue(MediaItem::Url,                 filePath);
+        mediaItem->setValue(MediaItem::MetadataStripped,    metadataStripped);
+        mediaItem->setValue(MediaItem::ResourceName,        fileInfo.fileName());
+        mediaItem->setValue(MediaItem::MimeType,            mimeTypes.value(i, mimeTypes.first()));
+        mediaItem->setValue(MediaItem::FileSize,            fileInfo.size());
+        mediaItem->setValue(MediaItem::PluginId,            serviceId);
+        mediaItem->setValue(MediaItem::UserData,            userData);
+
+        mediaItems << mediaItem;
+        muifs << muif;
+    }
+
+    return d->uploadMediaItems(mediaItems, muifs, userData);
+}
+
 /*!
     DBus adaptor calls this method to start uploading media item content. Sometimes the content
     to be transferred is not a file, but data e.g. contact information in vcard format. In order to
@@ -850,7 +1237,8 @@ int TransferEngine::uploadMediaItemContent(const QVariantMap &content,
 
     This method returns the transfer id of the created Download transfer. Note that this method only
     creates an entry to the database. To start the actual transfer, the startTransfer() method must
-    be called.
+    be called. If the entry can't be written, the statusChanged() signal is emitted with
+    TransferEngineData::TransferInterrupted.
 
     \sa startTransfer(), restartTransfer(), finishTransfer(), updateTransferProgress()
  */
@@ -883,10 +1271,14 @@ int TransferEngine::createDownload(const QString &displayName,
     mediaItem->setValue(MediaItem::CancelSupported, !cancelMethod.isEmpty());
     mediaItem->setValue(MediaItem::RestartSupported,!restartMethod.isEmpty());
 
-    const int key = DbManager::instance()->createTransferEntry(mediaItem);
+    const int key = DbManager::instance()->createTransferEntry(mediaItem, d, [d](const QList<int> &transferIds, bool ok) {
+        if (!ok) {
+            d->transferEntriesFailed(transferIds);
+        }
+    });
     d->m_activityMonitor->newActivity(key);
     d->m_keyTypeCache.insert(key, TransferEngineData::Download);
-    emit transfersChanged();
+    d->emitTransfersChanged();
     emit statusChanged(key, TransferEngineData::NotStarted);    
     return key;
 }
@@ -907,7 +1299,8 @@ int TransferEngine::createDownload(const QString &displayName,
 
     This method returns the transfer id of the created Download transfer. Note that this method only
     creates an entry to the database. To start the actual transfer, the startTransfer() method must
-    be called.
+    be called. If the entry can't be written, the statusChanged() signal is emitted with
+    TransferEngineData::TransferInterrupted.
 
     \sa startTransfer(), restartTransfer(), finishTransfer(), updateTransferProgress()
  */
@@ -929,13 +1322,17 @@ int TransferEngine::createSync(const QString &displayName,
     mediaItem->setValue(MediaItem::CancelSupported, !cancelMethod.isEmpty());
     mediaItem->setValue(MediaItem::RestartSupported,!restartMethod.isEmpty());
 
-    const int key = DbManager::instance()->createTransferEntry(mediaItem);
+    Q_D(TransferEngine);
+    const int key = DbManager::instance()->createTransferEntry(mediaItem, d, [d](const QList<int> &transferIds, bool ok) {
+        if (!ok) {
+            d->transferEntriesFailed(transferIds);
+        }
+    });
     delete mediaItem;
 
-    Q_D(TransferEngine);
     d->m_activityMonitor->newActivity(key);
     d->m_keyTypeCache.insert(key, TransferEngineData::Sync);
-    emit transfersChanged();
+    d->emitTransfersChanged();
     emit statusChanged(key, TransferEngineData::NotStarted);
     return key;
 }
@@ -971,7 +1368,7 @@ void TransferEngine::startTransfer(int transferId)
         d->m_activityMonitor->newActivity(transferId);
         DbManager::instance()->updateTransferStatus(transferId, TransferEngineData::TransferStarted);
         emit statusChanged(transferId, TransferEngineData::TransferStarted);
-        emit activeTransfersChanged();
+        d->emitActiveTransfersChanged();
     } else {
         qCWarning(lcTransferLog) << "TransferEngine::startTransfer: could not start transfer";
     }
@@ -1005,8 +1402,12 @@ void TransferEngine::restartTransfer(int transferId)
             return;
         }
 
-        Q_D(TransferEngine);
         MediaTransferInterface *muif = d->loadPlugin(item->value(MediaItem::PluginId).toString());
+        if (muif == 0) {
+            qCWarning(lcTransferLog) << "TransferEngine::restartTransfer: failed to get MediaTransferInterface";
+            delete item;
+            return;
+        }
         muif->setMediaItem(item);
 
         connect(muif, SIGNAL(statusChanged(MediaTransferInterface::TransferStatus)),
@@ -1014,10 +1415,13 @@ void TransferEngine::restartTransfer(int transferId)
         connect(muif, SIGNAL(progressUpdated(qreal)),
                 d, SLOT(updateProgress(qreal)));
 
-        d->m_activityMonitor->newActivity(transferId);
         d->m_keyTypeCache.insert(transferId, TransferEngineData::Upload);
         d->m_plugins.insert(muif, transferId);
-        muif->start();
+        if (DbManager::instance()->updateTransferStatus(transferId, TransferEngineData::NotStarted)) {
+            emit statusChanged(transferId, TransferEngineData::NotStarted);
+        }
+        d->m_scheduler->enqueue(transferId, item->value(MediaItem::PluginId).toString(),
+                                DbManager::instance()->transferPriority(transferId));
         return;
     }
 
@@ -1060,12 +1464,12 @@ void TransferEngine::finishTransfer(int transferId, int status, const QString &r
 
     // Read the file path from the database for download
     if (type == TransferEngineData::Download) {
-        MediaItem *mediaItem = DbManager::instance()->mediaItem(transferId);
+        QScopedPointer<MediaItem> mediaItem(DbManager::instance()->mediaItem(transferId));
         if (!mediaItem) {
             qCWarning(lcTransferLog) << "TransferEngine::finishTransfer: Failed to fetch MediaItem";
             return;
         }
-        fileName = d->mediaFileOrResourceName(mediaItem);
+        fileName = d->mediaFileOrResourceName(mediaItem.data());
         QString mediaUrl = mediaItem->value(MediaItem::Url).toString();
 
         if (mediaUrl.startsWith(QLatin1String("/"))) {
@@ -1087,26 +1491,20 @@ void TransferEngine::finishTransfer(int transferId, int status, const QString &r
         }
         emit statusChanged(transferId, status);
 
-        bool notify = false;
-
         // Clean up old failed syncs from the database and leave only the latest one there
         if (type == TransferEngineData::Sync) {
-            if (DbManager::instance()->clearFailedTransfers(transferId, type)) {
-                notify = true;
-            }
+            DbManager::instance()->clearFailedTransfers(transferId, type);
 
             // We don't want to leave successfully finished syncs to populate the database, just remove it.
             if (transferStatus == TransferEngineData::TransferFinished) {
-                if (DbManager::instance()->removeTransfer(transferId)) {
-                    notify = true;
-                }
+                DbManager::instance()->removeTransfer(transferId);
             }
         }
 
-        emit activeTransfersChanged(); // Assume that the transfer was active
+        d->emitActiveTransfersChanged(); // Assume that the transfer was active
 
-        if (notify) {
-            emit transfersChanged();
+        if (type == TransferEngineData::Sync) {
+            d->emitTransfersChanged();
         }
     }
 }
@@ -1125,20 +1523,17 @@ void TransferEngine::updateTransferProgress(int transferId, double progress)
         return;
     }
 
-    MediaItem *mediaItem = DbManager::instance()->mediaItem(transferId);
-    if (!mediaItem) {
-        qCWarning(lcTransferLog) << "TransferEngine::finishTransfer: Failed to fetch MediaItem";
-        return;
-    }
-    QString fileName = d->mediaFileOrResourceName(mediaItem);
-
     int oldProgressPercentage = DbManager::instance()->transferProgress(transferId) * 100;
     if (DbManager::instance()->updateProgress(transferId, progress)) {
         d->m_activityMonitor->newActivity(transferId);
-        emit progressChanged(transferId, progress);
+        d->queueProgress(transferId, progress);
 
         if (oldProgressPercentage != (progress * 100)) {
-            bool canCancel = mediaItem->value(MediaItem::CancelSupported).toBool();
+            // Read from the transfer cache of DbManager, progress is updated too often to
+            // load the whole media item every time
+            const QString fileName = d->mediaFileOrResourceName(DbManager::instance()->transferUrl(transferId),
+                                                                DbManager::instance()->transferResourceName(transferId));
+            bool canCancel = DbManager::instance()->transferCancelSupported(transferId);
             d->sendNotification(type, DbManager::instance()->transferStatus(transferId), progress, fileName, transferId, canCancel);
         }
     } else {
@@ -1156,6 +1551,19 @@ QList<TransferDBRecord> TransferEngine::transfers()
     return DbManager::instance()->transfers();
 }
 
+/*!
+    DBus adaptor calls this method to fetch a page of at most \a limit transfers older than the
+    transfer with the id \a cursor. Clients pass the id of the last transfer they received to
+    get the next page, or 0 to get the newest transfers. If \a status is not 0 only the transfers
+    with that status are returned.
+ */
+QList<TransferDBRecord> TransferEngine::transfersPage(int cursor, int limit, int status)
+{
+    Q_D(TransferEngine);
+    d->exitSafely();
+    return DbManager::instance()->transfersPage(cursor, limit, static_cast<TransferEngineData::TransferStatus>(status));
+}
+
 /*!
     DBus adaptor calls this method to fetch a list of active transfers. This method returns QList<TransferDBRecord>.
  */
@@ -1176,12 +1584,11 @@ void TransferEngine::clearTransfers()
     const int count = DbManager::instance()->transferCount();
     if (count > 0) {
         const int active = DbManager::instance()->activeTransferCount();
-        if (DbManager::instance()->clearTransfers()) {
-            if (active > 0) {
-                emit activeTransfersChanged();
-            }
-            emit transfersChanged();
+        DbManager::instance()->clearTransfers();
+        if (active > 0) {
+            d->emitActiveTransfersChanged();
         }
+        d->emitTransfersChanged();
     }
 }
 
@@ -1193,7 +1600,7 @@ void TransferEngine::clearTransfer(int transferId)
     Q_D(TransferEngine);
     d->exitSafely();
     if (DbManager::instance()->clearTransfer(transferId)) {
-        emit transfersChanged();
+        d->emitTransfersChanged();
     }
 }
 
@@ -1227,10 +1634,46 @@ void TransferEngine::cancelTransfer(int transferId)
             qCWarning(lcTransferLog) << "TransferEngine::cancelTransfer: Failed to get MediaTransferInterface!";
             return;
         }
+
+        // Upload hasn't been started yet, just drop it from the queue
+        if (d->m_scheduler->remove(transferId)) {
+            muif->disconnect();
+            d->m_plugins.remove(muif);
+            muif->deleteLater();
+            if (DbManager::instance()->updateTransferStatus(transferId, TransferEngineData::TransferCanceled)) {
+                emit statusChanged(transferId, TransferEngineData::TransferCanceled);
+            }
+            return;
+        }
+
         d->m_activityMonitor->activityFinished(transferId);
+        muif->cancelImageProcessing();
         muif->cancel();
     }
 }
+/*!
+    DBus adaptor calls this method to get the number of uploads which are waiting to be started.
+
+    \sa queuedTransferWaitTime()
+*/
+int TransferEngine::queuedTransferCount()
+{
+    Q_D(TransferEngine);
+    d->exitSafely();
+    return d->m_scheduler->queuedCount();
+}
+
+/*!
+    DBus adaptor calls this method to get the time in milliseconds the upload with a \a transferId
+    has been waiting to be started. Returns -1 if the upload is not queued.
+*/
+qlonglong TransferEngine::queuedTransferWaitTime(int transferId)
+{
+    Q_D(TransferEngine);
+    d->exitSafely();
+    return d->m_scheduler->waitTime(transferId);
+}
+
 /*!
     DBus adaptor calls this method to enable or disable transfer specific notifications
     based on \a enable argument.
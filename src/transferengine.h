@@ -32,6 +32,7 @@
 
 #include "mediatransferinterface.h"
 #include "transferdbrecord.h"
+#include "transferprogress.h"
 
 class MediaTransferInterface;
 class TransferEnginePrivate;
@@ -49,6 +50,12 @@ public Q_SLOTS:
                          bool metadataStripped,
                          const QVariantMap &userData);
 
+    QList<int> uploadMediaItems(const QStringList &sources,
+                                const QString &serviceId,
+                                const QStringList &mimeTypes,
+                                bool metadataStripped,
+                                const QVariantMap &userData);
+
     int uploadMediaItemContent(const QVariantMap &content,
                                const QString &serviceId,
                                const QVariantMap &userData);
@@ -80,6 +87,8 @@ public Q_SLOTS:
 
     QList<TransferDBRecord> transfers();
 
+    QList<TransferDBRecord> transfersPage(int cursor, int limit, int status);
+
     QList<TransferDBRecord> activeTransfers();
 
     void clearTransfers();
@@ -92,15 +101,23 @@ public Q_SLOTS:
 
     bool notificationsEnabled();
 
+    int queuedTransferCount();
+
+    qlonglong queuedTransferWaitTime(int transferId);
+
 Q_SIGNALS:
     void progressChanged(int transferId, double progress);
 
+    void progressBatch(const QList<TransferProgress> &progress);
+
     void statusChanged(int transferId, int status);
 
     void transfersChanged();
 
     void activeTransfersChanged();
 
+    void queuedTransfersChanged();
+
 private:
     TransferEnginePrivate *d_ptr = nullptr;
     Q_DECLARE_PRIVATE(TransferEngine)
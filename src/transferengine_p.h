@@ -27,15 +27,20 @@
 #define TRANSFERENGINE_P_H
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QMap>
+#include <QUrl>
 #include <QVariantList>
 
 #include "mediatransferinterface.h"
+#include "transferpluginregistry.h"
+#include "transferscheduler.h"
 
 class QFileSystemWatcher;
 class QTimer;
-class QUrl;
 class TransferEngine;
+class TransferPluginInterface;
 
 class TransferEngineSignalHandler: public QObject
 {
@@ -51,31 +56,6 @@ private:
     TransferEngineSignalHandler();
 };
 
-class ClientActivityMonitor: public QObject
-{
-    Q_OBJECT
-public:
-    ClientActivityMonitor(QObject *parent = 0);
-    ~ClientActivityMonitor();
-
-    void newActivity(int transferId);
-    void activityFinished(int transferId);
-
-    bool activeTransfers() const;
-    bool isActiveTransfer(int transferId) const;
-
-public Q_SLOTS:
-    void checkActivity();
-
-Q_SIGNALS:
-    void transfersExpired(const QList<int> &transferIds);
-
-private:
-    // Map for transferId, timestamps
-    QMap<int, quint32> m_activityMap;
-    QTimer *m_timer = nullptr;
-};
-
 class TransferEnginePrivate: QObject
 {
     Q_OBJECT
@@ -107,8 +87,23 @@ public:
     int uploadMediaItem(MediaItem *mediaItem,
                         MediaTransferInterface *muif,
                         const QVariantMap &userData);
+    QList<int> uploadMediaItems(const QList<MediaItem*> &mediaItems,
+                                const QList<MediaTransferInterface*> &muifs,
+                                const QVariantMap &userData);
+    void prepareUpload(MediaItem *mediaItem,
+                       MediaTransferInterface *muif,
+                       const QVariantMap &userData);
+    void publishNotification(TransferEngineData::TransferType type,
+                             TransferEngineData::TransferStatus status,
+                             qreal progress,
+                             const QString &fileName,
+                             int transferId,
+                             bool canCancel,
+                             const QUrl &localFileUrl);
+    void releaseTransfer(int transferId);
     inline TransferEngineData::TransferType transferType(int transferId);
     void callbackCall(int transferId, CallbackMethodType method);
+    void transferEntriesFailed(const QList<int> &transferIds);
 
 public Q_SLOTS:
     void exitSafely();
@@ -116,18 +111,53 @@ public Q_SLOTS:
     void cleanupExpiredTransfers(const QList<int> &expiredIds);
     void uploadItemStatusChanged(MediaTransferInterface::TransferStatus status);
     void updateProgress(qreal progress);
+    void startQueuedTransfer(int transferId);
+    void emitProgressBatch();
+    void publishPendingNotifications();
+    void pruneTransferHistory();
 
 public:
-    QStringList pluginList() const;
-    MediaTransferInterface *loadPlugin(const QString &pluginId) const;
+    MediaTransferInterface *loadPlugin(const QString &pluginId);
+    TransferPluginInterface *loadPluginInterface(const QString &pluginId);
     QString mediaFileOrResourceName(MediaItem *mediaItem) const;
+    QString mediaFileOrResourceName(const QUrl &url, const QString &resourceName) const;
+    void queueProgress(int transferId, double progress);
+    void emitTransfersChanged();
+    void emitActiveTransfersChanged();
 
 private:
+    struct PendingNotification {
+        TransferEngineData::TransferType type;
+        TransferEngineData::TransferStatus status;
+        qreal progress;
+        QString fileName;
+        bool canCancel;
+        QUrl localFileUrl;
+    };
+
     QMap <MediaTransferInterface*, int> m_plugins;
     QMap <int, TransferEngineData::TransferType> m_keyTypeCache;
+    TransferPluginRegistry m_pluginRegistry;
     bool m_notificationsEnabled = false;
     QTimer *m_delayedExitTimer = nullptr;
     ClientActivityMonitor *m_activityMonitor = nullptr;
+    TransferScheduler *m_scheduler = nullptr;
+    // Notification rate limiting, transferId -> time of the last published update
+    QHash<int, qint64> m_lastNotificationUpdate;
+    QHash<int, PendingNotification> m_pendingNotifications;
+    QElapsedTimer m_notificationClock;
+    QTimer *m_notificationTimer = nullptr;
+    int m_notificationUpdateInterval = 0;
+    // transferId -> number of updates replaced by a later one before they were published
+    QHash<int, int> m_suppressedNotifications;
+    // Progress changes waiting to be sent with the next progressBatch signal
+    QMap<int, double> m_progressBatch;
+    QTimer *m_progressBatchTimer = nullptr;
+    bool m_legacyProgressSignal = true;
+    // History retention, see pruneTransferHistory()
+    QTimer *m_retentionTimer = nullptr;
+    int m_prunedTransfers = 0;
+    bool m_historyPruned = false;
     TransferEngine *q_ptr = nullptr;
     QVariantList m_defaultActions;
     QVariant m_showTransfersAction;
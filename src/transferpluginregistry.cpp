@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "transferpluginregistry.h"
+#include "transferplugininterface.h"
+#include "logging.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonObject>
+#include <QPluginLoader>
+#include <QSettings>
+
+TransferPluginRegistry::TransferPluginRegistry(const QString &pluginPath, const QString &registryFile)
+    : m_pluginPath(pluginPath)
+    , m_registryFile(registryFile)
+{
+}
+
+// Returns the path of the library implementing the transfer plugin with the pluginId or
+// an empty string if there is no such plugin.
+QString TransferPluginRegistry::pluginFile(const QString &pluginId)
+{
+    if (!m_loaded) {
+        load();
+    }
+
+    // A library removed without changing the directory modification time, e.g. within the
+    // same second, is noticed here instead of failing to load it
+    const QString filePath = m_pluginFiles.value(pluginId);
+    if (!filePath.isEmpty() && !isPluginFile(filePath)) {
+        invalidate(pluginId);
+    }
+
+    const qint64 directoryModified = QFileInfo(m_pluginPath).lastModified().toMSecsSinceEpoch();
+    if (directoryModified != m_directoryModified) {
+        refresh();
+        m_directoryModified = directoryModified;
+        save();
+    }
+
+    return m_pluginFiles.value(pluginId);
+}
+
+// Forces the plugin directory to be rescanned on the next lookup e.g. when the library
+// returned by pluginFile() turned out to implement some other plugin. Only the library of
+// the pluginId is read again, the other libraries keep their remembered ids.
+void TransferPluginRegistry::invalidate(const QString &pluginId)
+{
+    m_directoryModified = -1;
+    m_entries.remove(m_pluginFiles.take(pluginId));
+}
+
+// Returns true if the filePath is an existing library directly in the plugin directory. The
+// registry file is writable by the user, so its paths are checked before they are loaded.
+bool TransferPluginRegistry::isPluginFile(const QString &filePath) const
+{
+    const QFileInfo info(QDir::cleanPath(filePath));
+    return info.isAbsolute()
+            && info.absolutePath() == QDir(m_pluginPath).absolutePath()
+            && info.isFile();
+}
+
+void TransferPluginRegistry::refresh()
+{
+    QDir dir(m_pluginPath);
+    const QStringList plugins = dir.entryList(QStringList() << "*.so", QDir::Files, QDir::NoSort);
+
+    QHash<QString, PluginEntry> entries;
+    m_pluginFiles.clear();
+
+    for (const QString &plugin : plugins) {
+        const QString filePath = dir.absoluteFilePath(plugin);
+        const qint64 modified = QFileInfo(filePath).lastModified().toMSecsSinceEpoch();
+
+        PluginEntry entry = m_entries.value(filePath);
+        if (entry.modified != modified) {
+            entry.pluginId = readPluginId(filePath);
+            entry.modified = modified;
+        }
+
+        entries.insert(filePath, entry);
+        if (!entry.pluginId.isEmpty()) {
+            m_pluginFiles.insert(entry.pluginId, filePath);
+        }
+    }
+
+    m_entries = entries;
+}
+
+// Reads the plugin id from the "pluginId" key of the plugin metadata json, which doesn't
+// require loading the library. Plugins which don't provide the metadata are loaded once
+// to ask the id and the result is remembered until the library changes.
+QString TransferPluginRegistry::readPluginId(const QString &filePath)
+{
+    QPluginLoader loader(filePath);
+    const QString pluginId = loader.metaData().value(QStringLiteral("MetaData")).toObject()
+            .value(QStringLiteral("pluginId")).toString();
+    if (!pluginId.isEmpty()) {
+        return pluginId;
+    }
+
+    loader.setLoadHints(QLibrary::ResolveAllSymbolsHint | QLibrary::ExportExternalSymbolsHint);
+    TransferPluginInterface *interface = qobject_cast<TransferPluginInterface*>(loader.instance());
+    if (!interface) {
+        qCWarning(lcTransferLog) << "TransferPluginRegistry::readPluginId:" << loader.errorString();
+        return QString();
+    }
+
+    const QString id = interface->pluginId();
+    loader.unload();
+    return id;
+}
+
+void TransferPluginRegistry::load()
+{
+    m_loaded = true;
+
+    QSettings settings(m_registryFile, QSettings::IniFormat);
+    m_directoryModified = settings.value("directoryModified", -1).toLongLong();
+
+    const int count = settings.beginReadArray("plugins");
+    for (int i = 0; i < count; ++i) {
+        settings.setArrayIndex(i);
+        PluginEntry entry;
+        entry.pluginId = settings.value("pluginId").toString();
+        entry.modified = settings.value("modified").toLongLong();
+        const QString filePath = settings.value("file").toString();
+        if (!isPluginFile(filePath)) {
+            qCWarning(lcTransferLog) << "TransferPluginRegistry::load: Ignoring" << filePath;
+            m_directoryModified = -1;
+            continue;
+        }
+        m_entries.insert(filePath, entry);
+        if (!entry.pluginId.isEmpty()) {
+            m_pluginFiles.insert(entry.pluginId, filePath);
+        }
+    }
+    settings.endArray();
+}
+
+void TransferPluginRegistry::save() const
+{
+    QDir().mkpath(QFileInfo(m_registryFile).absolutePath());
+
+    QSettings settings(m_registryFile, QSettings::IniFormat);
+    settings.clear();
+    settings.setValue("directoryModified", m_directoryModified);
+
+    settings.beginWriteArray("plugins", m_entries.count());
+    int i = 0;
+    for (QHash<QString, PluginEntry>::const_iterator it = m_entries.constBegin(); it != m_entries.constEnd(); ++it) {
+        settings.setArrayIndex(i++);
+        settings.setValue("file", it.key());
+        settings.setValue("pluginId", it.value().pluginId);
+        settings.setValue("modified", it.value().modified);
+    }
+    settings.endArray();
+    settings.sync();
+
+    if (settings.status() != QSettings::NoError) {
+        qCWarning(lcTransferLog) << "TransferPluginRegistry::save: Failed to write" << m_registryFile;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef TRANSFERPLUGINREGISTRY_H
+#define TRANSFERPLUGINREGISTRY_H
+
+#include <QHash>
+#include <QString>
+
+// TransferPluginRegistry keeps track of which library in the transfer plugin directory
+// implements which plugin id, so that only the matching library needs to be loaded when
+// a transfer is started. The registry is persisted together with the modification times
+// of the libraries and it is rebuilt only when the plugin directory changes.
+class TransferPluginRegistry
+{
+public:
+    TransferPluginRegistry(const QString &pluginPath, const QString &registryFile);
+
+    QString pluginFile(const QString &pluginId);
+    void invalidate(const QString &pluginId);
+
+private:
+    struct PluginEntry {
+        QString pluginId;
+        qint64 modified = 0;
+    };
+
+    void refresh();
+    void load();
+    void save() const;
+    bool isPluginFile(const QString &filePath) const;
+    static QString readPluginId(const QString &filePath);
+
+    QString m_pluginPath;
+    QString m_registryFile;
+    qint64 m_directoryModified = -1;
+    bool m_loaded = false;
+
+    // Library file path -> plugin id and modification time of the library
+    QHash<QString, PluginEntry> m_entries;
+    // Plugin id -> library file path
+    QHash<QString, QString> m_pluginFiles;
+};
+
+#endif // TRANSFERPLUGINREGISTRY_H
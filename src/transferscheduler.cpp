@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "transferscheduler.h"
+#include "logging.h"
+
+#include <QDateTime>
+#include <QTimer>
+
+#define ACTIVITY_MONITOR_TIMEOUT 1*60*1000 // 1 minute in ms
+#define TRANSFER_EXPIRATION_THRESHOLD 3*60 // 3 minutes in seconds
+#define MAX_ACTIVE_TRANSFERS 3
+
+// ClientActivityMonitor runs periodic checks if there are transfers which are expired.
+// A transfer can be expired e.g. when a client has been crashed in the middle of Sync,
+// Download or Upload operation or the client API isn't used properly.
+//
+// NOTE: This class only monitors if there are expired transfers and emit signal to indicate
+// that it's cleaning time.  It is up to Transfer Engine to remoce expired ids from the
+// ClientActivityMonitor instance.
+ClientActivityMonitor::ClientActivityMonitor(QObject *parent)
+    : QObject(parent)
+    , m_timer(new QTimer(this))
+    , m_expirationThreshold(TRANSFER_EXPIRATION_THRESHOLD)
+{
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(checkActivity()));
+    m_timer->start(ACTIVITY_MONITOR_TIMEOUT);
+}
+
+ClientActivityMonitor::~ClientActivityMonitor()
+{
+    m_activityMap.clear();
+}
+
+void ClientActivityMonitor::setExpirationThreshold(quint32 seconds)
+{
+    m_expirationThreshold = seconds;
+}
+
+void ClientActivityMonitor::newActivity(int transferId)
+{
+    // Update or add a new timestamp
+    m_activityMap.insert(transferId, QDateTime::currentDateTimeUtc().toTime_t());
+}
+
+void ClientActivityMonitor::activityFinished(int transferId)
+{
+    if (!m_activityMap.contains(transferId)) {
+        qCWarning(lcTransferLog) << Q_FUNC_INFO << "Could not find matching TransferId. This is probably an error!";
+        return;
+    }
+
+    m_activityMap.remove(transferId);
+}
+
+bool ClientActivityMonitor::activeTransfers() const
+{
+    return !m_activityMap.isEmpty();
+}
+
+bool ClientActivityMonitor::isActiveTransfer(int transferId) const
+{
+    return m_activityMap.contains(transferId);
+}
+
+void ClientActivityMonitor::checkActivity()
+{
+    // Check if there are existing transfers which are not yet finished and
+    // they've been around too long. Notify TransferEngine about these transfers.
+    QList<int> ids;
+    quint32 currTime = QDateTime::currentDateTimeUtc().toTime_t();
+    QMap<int, quint32>::const_iterator i = m_activityMap.constBegin();
+    while (i != m_activityMap.constEnd()) {
+        if ((currTime - i.value()) >= m_expirationThreshold) {
+            ids << i.key();
+        }
+        i++;
+    }
+
+    if (!ids.isEmpty()) {
+        emit transfersExpired(ids);
+    }
+}
+
+// TransferScheduler limits the number of uploads running at the same time, both in total
+// and per transfer plugin. Uploads exceeding the limits are kept in a queue ordered by
+// priority and started in FIFO order when a running upload finishes.
+//
+// NOTE: The scheduler only keeps track of transfer ids. It emits transferReady() when
+// a transfer may be started and it's up to Transfer Engine to start it and to report
+// back with transferFinished() once the transfer has ended.
+TransferScheduler::TransferScheduler(QObject *parent)
+    : QObject(parent)
+    , m_maximumActive(MAX_ACTIVE_TRANSFERS)
+{
+}
+
+void TransferScheduler::setMaximumActiveTransfers(int count)
+{
+    // Zero or negative count means no limit
+    m_maximumActive = count;
+    schedule();
+}
+
+void TransferScheduler::setPluginLimit(const QString &pluginId, int count)
+{
+    if (count > 0) {
+        m_pluginLimits.insert(pluginId, count);
+    } else {
+        m_pluginLimits.remove(pluginId);
+    }
+    schedule();
+}
+
+void TransferScheduler::enqueue(int transferId, const QString &pluginId, int priority)
+{
+    QueuedTransfer transfer;
+    transfer.transferId = transferId;
+    transfer.priority = priority;
+    transfer.pluginId = pluginId;
+    transfer.queued.start();
+
+    int index = m_queue.count();
+    while (index > 0 && m_queue.at(index - 1).priority < priority) {
+        --index;
+    }
+    m_queue.insert(index, transfer);
+
+    emit queuedTransfersChanged();
+    schedule();
+}
+
+bool TransferScheduler::remove(int transferId)
+{
+    for (int i = 0; i < m_queue.count(); ++i) {
+        if (m_queue.at(i).transferId == transferId) {
+            m_queue.removeAt(i);
+            emit queuedTransfersChanged();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TransferScheduler::transferFinished(int transferId)
+{
+    if (remove(transferId)) {
+        return;
+    }
+
+    QHash<int, QString>::iterator it = m_running.find(transferId);
+    if (it == m_running.end()) {
+        return;
+    }
+
+    if (--m_runningPerPlugin[it.value()] <= 0) {
+        m_runningPerPlugin.remove(it.value());
+    }
+    m_running.erase(it);
+    schedule();
+}
+
+bool TransferScheduler::isQueued(int transferId) const
+{
+    Q_FOREACH(const QueuedTransfer &transfer, m_queue) {
+        if (transfer.transferId == transferId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int TransferScheduler::queuedCount() const
+{
+    return m_queue.count();
+}
+
+qint64 TransferScheduler::waitTime(int transferId) const
+{
+    Q_FOREACH(const QueuedTransfer &transfer, m_queue) {
+        if (transfer.transferId == transferId) {
+            return transfer.queued.elapsed();
+        }
+    }
+    return -1;
+}
+
+void TransferScheduler::schedule()
+{
+    // Pick the transfers to start before notifying anyone, a transfer may finish
+    // synchronously when it's started which calls back to the scheduler.
+    QList<int> ready;
+    for (int i = 0; i < m_queue.count(); ) {
+        if (m_maximumActive > 0 && m_running.count() >= m_maximumActive) {
+            break;
+        }
+
+        const QueuedTransfer &transfer = m_queue.at(i);
+        if (canStart(transfer.pluginId)) {
+            m_running.insert(transfer.transferId, transfer.pluginId);
+            ++m_runningPerPlugin[transfer.pluginId];
+            ready << transfer.transferId;
+            m_queue.removeAt(i);
+        } else {
+            // Skip over the plugin which is at its limit, others may still start
+            ++i;
+        }
+    }
+
+    if (ready.isEmpty()) {
+        return;
+    }
+
+    emit queuedTransfersChanged();
+    Q_FOREACH(int transferId, ready) {
+        emit transferReady(transferId);
+    }
+}
+
+bool TransferScheduler::canStart(const QString &pluginId) const
+{
+    const int limit = m_pluginLimits.value(pluginId);
+    return limit <= 0 || m_runningPerPlugin.value(pluginId) < limit;
+}
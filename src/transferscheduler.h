@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QString>
+
+class QTimer;
+
+class ClientActivityMonitor: public QObject
+{
+    Q_OBJECT
+public:
+    ClientActivityMonitor(QObject *parent = 0);
+    ~ClientActivityMonitor();
+
+    void setExpirationThreshold(quint32 seconds);
+
+    void newActivity(int transferId);
+    void activityFinished(int transferId);
+
+    bool activeTransfers() const;
+    bool isActiveTransfer(int transferId) const;
+
+public Q_SLOTS:
+    void checkActivity();
+
+Q_SIGNALS:
+    void transfersExpired(const QList<int> &transferIds);
+
+private:
+    // Map for transferId, timestamps
+    QMap<int, quint32> m_activityMap;
+    QTimer *m_timer = nullptr;
+    quint32 m_expirationThreshold;
+};
+
+class TransferScheduler: public QObject
+{
+    Q_OBJECT
+public:
+    TransferScheduler(QObject *parent = 0);
+
+    void setMaximumActiveTransfers(int count);
+    void setPluginLimit(const QString &pluginId, int count);
+
+    void enqueue(int transferId, const QString &pluginId, int priority);
+    bool remove(int transferId);
+    void transferFinished(int transferId);
+
+    bool isQueued(int transferId) const;
+    int queuedCount() const;
+    qint64 waitTime(int transferId) const;
+
+Q_SIGNALS:
+    void transferReady(int transferId);
+    void queuedTransfersChanged();
+
+private:
+    struct QueuedTransfer {
+        int transferId;
+        int priority;
+        QString pluginId;
+        QElapsedTimer queued;
+    };
+
+    void schedule();
+    bool canStart(const QString &pluginId) const;
+
+    // Ordered by priority, FIFO within the same priority
+    QList<QueuedTransfer> m_queue;
+    // Map for transferId, pluginId of the started transfers
+    QHash<int, QString> m_running;
+    QHash<QString, int> m_runningPerPlugin;
+    QHash<QString, int> m_pluginLimits;
+    int m_maximumActive = 0;
+};
+
+#endif // TRANSFERSCHEDULER_H
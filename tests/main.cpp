@@ -22,14 +22,19 @@
  * Lesser General Public License for more details.
  */
 
+#include <QCoreApplication>
 #include <QTest>
+#include "ut_dbmanager.h"
+#include "ut_dbmigration.h"
 #include "ut_imageoperation.h"
 #include "ut_mediatransferinterface.h"
+#include "ut_transferrecord.h"
+#include "ut_transferscheduler.h"
 
 int main(int argc, char *argv[])
 {
-    Q_UNUSED(argc)
-    Q_UNUSED(argv)
+    // Needed for loading the SQL driver plugin
+    QCoreApplication app(argc, argv);
 
     ut_imageoperation t1;
     int res = QTest::qExec(&t1);
@@ -37,5 +42,17 @@ int main(int argc, char *argv[])
     ut_mediatransferinterface t2;
     res += QTest::qExec(&t2);
 
+    ut_dbmanager t3;
+    res += QTest::qExec(&t3);
+
+    ut_dbmigration t4;
+    res += QTest::qExec(&t4);
+
+    ut_transferscheduler t5;
+    res += QTest::qExec(&t5);
+
+    ut_transferrecord t6;
+    res += QTest::qExec(&t6);
+
     return res;
 }
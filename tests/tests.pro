@@ -3,34 +3,58 @@ PACKAGENAME = nemo-transfer-engine-qt5
 TEMPLATE = app
 TARGET = ut_nemo-transfer-engine
 DEPENDPATH += .
-INCLUDEPATH += . ../src ../lib
+INCLUDEPATH += . ../src ../lib ../declarative
 CONFIG += link_pkgconfig
 PKGCONFIG += quillmetadata-qt5
 
 # Test files
 HEADERS += \
+    ut_dbmanager.h \
+    ut_dbmigration.h \
     ut_imageoperation.h \
-    ut_mediatransferinterface.h
+    ut_mediatransferinterface.h \
+    ut_transferrecord.h \
+    ut_transferscheduler.h
 
 SOURCES += \
     main.cpp \
+    ut_dbmanager.cpp \
+    ut_dbmigration.cpp \
     ut_imageoperation.cpp \
-    ut_mediatransferinterface.cpp
+    ut_mediatransferinterface.cpp \
+    ut_transferrecord.cpp \
+    ut_transferscheduler.cpp
 
 
 # Import filess from the actual project
 HEADERS += \
+    ../declarative/transferrecord_p.h \
     ../lib/imageoperation.h \
+    ../lib/imagecache_p.h \
+    ../lib/imageoperation_p.h \
     ../lib/mediatransferinterface.h \
-    ../lib/mediaitem.h
+    ../lib/mediaitem.h \
+    ../lib/transferdbrecord.h \
+    ../src/dbmanager.h \
+    ../src/dbmigration.h \
+    ../src/dbworker.h \
+    ../src/logging.h \
+    ../src/transferscheduler.h
 
 SOURCES += \
     ../lib/imageoperation.cpp \
+    ../lib/imagecache.cpp \
     ../lib/mediatransferinterface.cpp \
-    ../lib/mediaitem.cpp
+    ../lib/mediaitem.cpp \
+    ../lib/transferdbrecord.cpp \
+    ../src/dbmanager.cpp \
+    ../src/dbmigration.cpp \
+    ../src/dbworker.cpp \
+    ../src/logging.cpp \
+    ../src/transferscheduler.cpp
 
 
-QT += testlib
+QT += dbus sql testlib
 
 PATH = /opt/tests/$${PACKAGENAME}
 
@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "ut_dbmanager.h"
+#include "dbmanager.h"
+#include "mediaitem.h"
+#include "transfertypes.h"
+#include <QtTest/QTest>
+#include <QAtomicInt>
+#include <QEventLoop>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+#include <QUrl>
+#include <QtDebug>
+
+#include <climits>
+
+#define BENCHMARK_TRANSFERS 50
+#define BENCHMARK_UPDATES 500
+#define BENCHMARK_TABLE_SIZE 10000
+
+// Reads the transfers table in a loop the same way TransferModel does
+class DatabaseReader : public QThread
+{
+public:
+    DatabaseReader(const QString &path)
+        : m_path(path)
+    {
+    }
+
+    void stop()
+    {
+        m_stop.storeRelease(1);
+        wait();
+    }
+
+    int failures() const { return m_failures; }
+
+protected:
+    void run()
+    {
+        {
+            QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("reader"));
+            db.setDatabaseName(m_path);
+            db.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=1000"));
+            if (!db.open()) {
+                ++m_failures;
+            }
+
+            while (db.isOpen() && !m_stop.loadAcquire()) {
+                QSqlQuery query(db);
+                query.setForwardOnly(true);
+                if (query.exec(QStringLiteral("SELECT * FROM transfers ORDER BY transfer_id DESC"))) {
+                    while (query.next()) {
+                    }
+                } else {
+                    ++m_failures;
+                }
+            }
+            db.close();
+        }
+        QSqlDatabase::removeDatabase(QStringLiteral("reader"));
+    }
+
+private:
+    QString m_path;
+    QAtomicInt m_stop;
+    int m_failures = 0;
+};
+
+void ut_dbmanager::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+
+    // DbManager creates its database under the home directory
+    qputenv("HOME", m_dir.path().toUtf8());
+    DbManager *db = DbManager::instance();
+
+    QList<MediaItem*> items;
+    for (int i = 0; i < BENCHMARK_TABLE_SIZE; ++i) {
+        MediaItem *item = new MediaItem;
+        item->setValue(MediaItem::TransferType,  TransferEngineData::Upload);
+        item->setValue(MediaItem::Url,           QUrl::fromLocalFile(QStringLiteral("/home/nemo/Pictures/img_%1.jpg").arg(i)));
+        item->setValue(MediaItem::ResourceName,  QStringLiteral("img_%1.jpg").arg(i));
+        item->setValue(MediaItem::MimeType,      QStringLiteral("image/jpeg"));
+        item->setValue(MediaItem::PluginId,      QStringLiteral("Example-Share-Method-ID"));
+        item->setValue(MediaItem::DisplayName,   QStringLiteral("Example"));
+        items << item;
+    }
+    m_keys = db->createTransferEntries(items);
+    qDeleteAll(items);
+    QCOMPARE(m_keys.count(), BENCHMARK_TABLE_SIZE);
+}
+
+void ut_dbmanager::cleanupTestCase()
+{
+    // Closing writes the buffered progress and delivers the callbacks of the last writes
+    DbManager *db = DbManager::instance();
+    db->setProgressFlushInterval(60 * 1000);
+    QVERIFY(db->updateProgress(m_keys.first(), 0.5));
+    bool written = false;
+    db->whenWritten(this, [&written] {
+        written = true;
+    });
+    db->close();
+    QVERIFY(written);
+
+    {
+        QSqlDatabase other = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("closed"));
+        other.setDatabaseName(m_dir.path() + QStringLiteral("/.local/nemo-transferengine/transferdb.sqlite"));
+        QVERIFY(other.open());
+        QSqlQuery query(other);
+        QVERIFY(query.exec(QStringLiteral("SELECT progress FROM transfers WHERE transfer_id=%1").arg(m_keys.first())));
+        QVERIFY(query.next());
+        QCOMPARE(query.value(0).toDouble(), 0.5);
+        query.finish();
+        other.close();
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("closed"));
+}
+
+void ut_dbmanager::benchmarkProgressWithReader_data()
+{
+    QTest::addColumn<QString>("journalMode");
+    QTest::addColumn<QString>("synchronous");
+
+    // Defaults used before DbManager enabled write-ahead logging
+    QTest::newRow("rollback journal") << "DELETE" << "FULL";
+    // Same pragmas as DbManager
+    QTest::newRow("wal") << "WAL" << "NORMAL";
+}
+
+void ut_dbmanager::benchmarkProgressWithReader()
+{
+    QFETCH(QString, journalMode);
+    QFETCH(QString, synchronous);
+    QVERIFY(m_dir.isValid());
+
+    const QString path = m_dir.path() + QStringLiteral("/transferdb-%1.sqlite").arg(journalMode.toLower());
+    bool ok = true;
+    int readFailures = 0;
+
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("writer"));
+        db.setDatabaseName(path);
+        db.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=5000"));
+        QVERIFY(db.open());
+
+        QSqlQuery query(db);
+        QVERIFY(query.exec(QStringLiteral("PRAGMA journal_mode=%1").arg(journalMode)));
+        QVERIFY(query.exec(QStringLiteral("PRAGMA synchronous=%1").arg(synchronous)));
+        QVERIFY(query.exec(QStringLiteral("CREATE TABLE transfers (transfer_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                          "status INTEGER, progress REAL, display_name TEXT, url TEXT)")));
+
+        QVERIFY(query.prepare(QStringLiteral("INSERT INTO transfers (status, progress, display_name, url) "
+                                             "VALUES (1, 0, :display_name, :url)")));
+        for (int i = 0; i < BENCHMARK_TRANSFERS; ++i) {
+            query.bindValue(QStringLiteral(":display_name"), QStringLiteral("Transfer %1").arg(i));
+            query.bindValue(QStringLiteral(":url"), QStringLiteral("file:///home/nemo/Pictures/img_%1.jpg").arg(i));
+            QVERIFY(query.exec());
+        }
+        query.finish();
+
+        DatabaseReader reader(path);
+        reader.start();
+
+        // Every progress update is a separate commit like in DbManager
+        QSqlQuery update(db);
+        update.prepare(QStringLiteral("UPDATE transfers SET progress=:progress WHERE transfer_id=:transfer_id"));
+        QBENCHMARK {
+            for (int i = 0; i < BENCHMARK_UPDATES; ++i) {
+                update.bindValue(QStringLiteral(":progress"), qreal(i) / BENCHMARK_UPDATES);
+                update.bindValue(QStringLiteral(":transfer_id"), i % BENCHMARK_TRANSFERS + 1);
+                if (!update.exec()) {
+                    qWarning() << "Update failed:" << update.lastError().text();
+                    ok = false;
+                }
+            }
+        }
+        update.finish();
+
+        reader.stop();
+        readFailures = reader.failures();
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("writer"));
+
+    QVERIFY(ok);
+    QCOMPARE(readFailures, 0);
+}
+
+void ut_dbmanager::benchmarkUpdateProgress_data()
+{
+    QTest::addColumn<int>("flushInterval");
+
+    QTest::newRow("buffered") << 2000;
+    QTest::newRow("immediate") << 0;
+}
+
+void ut_dbmanager::benchmarkUpdateProgress()
+{
+    QFETCH(int, flushInterval);
+    DbManager *db = DbManager::instance();
+    db->setProgressFlushInterval(flushInterval);
+
+    bool ok = true;
+    int i = 0;
+    QBENCHMARK {
+        const int key = m_keys.at(i++ % m_keys.count());
+        ok &= db->updateProgress(key, qreal(i % 100) / 100);
+    }
+
+    QVERIFY(db->flushProgress());
+    QVERIFY(ok);
+}
+
+void ut_dbmanager::benchmarkTransferStatus_data()
+{
+    QTest::addColumn<bool>("cached");
+
+    QTest::newRow("cached") << true;
+    // Looks up every transfer in turn, which is more than the transfer cache holds
+    QTest::newRow("uncached") << false;
+}
+
+void ut_dbmanager::benchmarkTransferStatus()
+{
+    QFETCH(bool, cached);
+    DbManager *db = DbManager::instance();
+
+    bool ok = true;
+    int i = 0;
+    QBENCHMARK {
+        const int key = cached ? m_keys.first() : m_keys.at(i++ % m_keys.count());
+        ok &= db->transferStatus(key) == TransferEngineData::NotStarted;
+    }
+
+    QVERIFY(ok);
+}
+
+void ut_dbmanager::transfersPage()
+{
+    DbManager *db = DbManager::instance();
+    const int count = db->transferCount();
+    QVERIFY(count > 0);
+
+    // Following the cursor returns each transfer once, newest first
+    QList<TransferDBRecord> page = db->transfersPage(0, 100, TransferEngineData::Unknown);
+    QCOMPARE(page.count(), qMin(count, 100));
+    QCOMPARE(page.first().transfer_id, m_keys.last());
+
+    // The timestamp is an ISO 8601 string of the same time as timestamp_msecs
+    const TransferDBRecord &newest = page.first();
+    QVERIFY(newest.timestamp_msecs > 0);
+    QCOMPARE(newest.value(TransferDBRecord::Timestamp).type(), QVariant::String);
+    QCOMPARE(QDateTime::fromString(newest.timestamp, Qt::ISODate).toMSecsSinceEpoch(),
+             newest.timestamp_msecs / 1000 * 1000);
+
+    int total = 0;
+    int previousId = INT_MAX;
+    while (!page.isEmpty()) {
+        for (const TransferDBRecord &record : page) {
+            QVERIFY(record.transfer_id < previousId);
+            previousId = record.transfer_id;
+        }
+        total += page.count();
+        page = db->transfersPage(previousId, 100, TransferEngineData::Unknown);
+    }
+    QCOMPARE(total, count);
+
+    // Filtered pages contain only the transfers with the status
+    QVERIFY(db->updateTransferStatus(m_keys.at(10), TransferEngineData::TransferCanceled));
+    QVERIFY(db->updateTransferStatus(m_keys.at(20), TransferEngineData::TransferCanceled));
+    page = db->transfersPage(0, 1, TransferEngineData::TransferCanceled);
+    QCOMPARE(page.count(), 1);
+    QCOMPARE(page.first().transfer_id, m_keys.at(20));
+    page = db->transfersPage(page.first().transfer_id, 1, TransferEngineData::TransferCanceled);
+    QCOMPARE(page.count(), 1);
+    QCOMPARE(page.first().transfer_id, m_keys.at(10));
+    QVERIFY(db->transfersPage(m_keys.at(10), 1, TransferEngineData::TransferCanceled).isEmpty());
+    QVERIFY(db->updateTransferStatus(m_keys.at(10), TransferEngineData::NotStarted));
+    QVERIFY(db->updateTransferStatus(m_keys.at(20), TransferEngineData::NotStarted));
+
+    // The values used on every progress update are read without a MediaItem
+    QCOMPARE(db->transferUrl(m_keys.at(3)), QUrl::fromLocalFile(QStringLiteral("/home/nemo/Pictures/img_3.jpg")));
+    QCOMPARE(db->transferResourceName(m_keys.at(3)), QStringLiteral("img_3.jpg"));
+    QVERIFY(!db->transferCancelSupported(m_keys.at(3)));
+    QCOMPARE(db->transferUrl(-1), QUrl());
+}
+
+void ut_dbmanager::pruneTransfers()
+{
+    DbManager *db = DbManager::instance();
+    const int finished = 500;
+    for (int i = 0; i < finished; ++i) {
+        QVERIFY(db->updateTransferStatus(m_keys.at(i), TransferEngineData::TransferFinished));
+    }
+
+    // Only the finished transfers beyond the newest ones are removed
+    db->setRetentionPolicy(BENCHMARK_TABLE_SIZE - 300, 0, 0);
+    int pruned = 0;
+    int batch;
+    QBENCHMARK_ONCE {
+        while ((batch = db->pruneTransfers(100)) > 0) {
+            pruned += batch;
+        }
+    }
+    QCOMPARE(batch, 0);
+    QCOMPARE(pruned, 300);
+    QCOMPARE(db->transferCount(), BENCHMARK_TABLE_SIZE - 300);
+    QCOMPARE(db->transferStatus(m_keys.at(0)), TransferEngineData::Unknown);
+
+    // Transfers which haven't finished are kept regardless of the limit
+    db->setRetentionPolicy(1, 0, 0);
+    while ((batch = db->pruneTransfers(100)) > 0) {
+        pruned += batch;
+    }
+    QCOMPARE(pruned, finished);
+    QCOMPARE(db->transferCount(), BENCHMARK_TABLE_SIZE - finished);
+    QCOMPARE(db->transferStatus(m_keys.at(finished)), TransferEngineData::NotStarted);
+
+    QVERIFY(db->incrementalVacuum() >= 0);
+    db->setRetentionPolicy(0, 0, 0);
+}
+
+void ut_dbmanager::whenWritten()
+{
+    DbManager *db = DbManager::instance();
+    const int count = db->transferCount();
+
+    MediaItem item;
+    item.setValue(MediaItem::TransferType,  TransferEngineData::Download);
+    item.setValue(MediaItem::Url,           QUrl::fromLocalFile(QStringLiteral("/home/nemo/Downloads/file.txt")));
+    item.setValue(MediaItem::DisplayName,   QStringLiteral("Example"));
+    item.setValue(MediaItem::Title,         QStringLiteral("Title"));
+    item.setValue(MediaItem::UserData,      QVariantMap { { QStringLiteral("priority"), 5 } });
+
+    // The key is returned before the transfer has been written
+    const int key = db->createTransferEntry(&item);
+    QVERIFY(key > m_keys.last());
+    QVERIFY(db->updateTransferStatus(key, TransferEngineData::TransferStarted));
+    QCOMPARE(db->transferStatus(key), TransferEngineData::TransferStarted);
+    QCOMPARE(db->transferPriority(key), 5);
+    QCOMPARE(db->transferUrl(key), QUrl::fromLocalFile(QStringLiteral("/home/nemo/Downloads/file.txt")));
+    QCOMPARE(db->transferResourceName(key), QString());
+    QVERIFY(!db->transferCancelSupported(key));
+
+    bool written = false;
+    db->whenWritten(this, [&written] {
+        written = true;
+    });
+    QVERIFY(!written);
+    QTRY_VERIFY(written);
+
+    QCOMPARE(db->transferCount(), count + 1);
+    QCOMPARE(db->activeTransferCount(), 1);
+    QCOMPARE(db->activeTransfers().first().transfer_id, key);
+}
+
+void ut_dbmanager::createTransferFailure()
+{
+    DbManager *db = DbManager::instance();
+
+    MediaItem item;
+    item.setValue(MediaItem::TransferType,  TransferEngineData::Download);
+    item.setValue(MediaItem::Url,           QUrl::fromLocalFile(QStringLiteral("/home/nemo/Downloads/file.txt")));
+    item.setValue(MediaItem::DisplayName,   QStringLiteral("Example"));
+
+    QList<int> writtenKeys;
+    bool written = false;
+    const int key = db->createTransferEntry(&item, this, [&](const QList<int> &keys, bool ok) {
+        writtenKeys = keys;
+        written = ok;
+    });
+    QTRY_COMPARE(writtenKeys, QList<int>() << key);
+    QVERIFY(written);
+
+    // Take the next key behind DbManager's back, so that writing the next transfer fails
+    {
+        QSqlDatabase other = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("other"));
+        other.setDatabaseName(m_dir.path() + QStringLiteral("/.local/nemo-transferengine/transferdb.sqlite"));
+        QVERIFY(other.open());
+        QSqlQuery query(other);
+        QVERIFY2(query.exec(QStringLiteral("INSERT INTO transfers (transfer_id, transfer_type, status) VALUES (%1, %2, %3)")
+                            .arg(key + 1).arg(TransferEngineData::Sync).arg(TransferEngineData::TransferFinished)),
+                 qPrintable(query.lastError().text()));
+        query.finish();
+        other.close();
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("other"));
+
+    writtenKeys.clear();
+    written = true;
+    const QList<int> keys = db->createTransferEntries(QList<MediaItem*>() << &item << &item, this,
+                                                      [&](const QList<int> &keys, bool ok) {
+        writtenKeys = keys;
+        written = ok;
+    });
+    QCOMPARE(keys, QList<int>() << key + 1 << key + 2);
+    QCOMPARE(db->transferStatus(key + 2), TransferEngineData::NotStarted);
+
+    // Neither of the transfers is stored and the cache doesn't claim otherwise
+    QTRY_COMPARE(writtenKeys, keys);
+    QVERIFY(!written);
+    QCOMPARE(db->transferType(key + 1), TransferEngineData::Sync);
+    QCOMPARE(db->transferStatus(key + 2), TransferEngineData::Unknown);
+}
+
+void ut_dbmanager::benchmarkCreateTransfer()
+{
+    DbManager *db = DbManager::instance();
+
+    MediaItem item;
+    item.setValue(MediaItem::TransferType,      TransferEngineData::Download);
+    item.setValue(MediaItem::Url,               QUrl::fromLocalFile(QStringLiteral("/home/nemo/Downloads/file.txt")));
+    item.setValue(MediaItem::DisplayName,       QStringLiteral("Example"));
+    item.setValue(MediaItem::Title,             QStringLiteral("Title"));
+    item.setValue(MediaItem::Description,       QStringLiteral("Description"));
+    item.setValue(MediaItem::Callback,          QStringList() << QStringLiteral("com.example.app")
+                                                              << QStringLiteral("/com/example/app")
+                                                              << QStringLiteral("com.example.app"));
+    item.setValue(MediaItem::CancelCBMethod,    QStringLiteral("cancel"));
+    item.setValue(MediaItem::RestartCBMethod,   QStringLiteral("restart"));
+
+    const int count = db->transferCount();
+    int created = 0;
+    // Every creation writes a transfer, metadata and callback row, wait for the commits
+    QBENCHMARK {
+        for (int i = 0; i < BENCHMARK_TRANSFERS; ++i) {
+            db->createTransferEntry(&item);
+        }
+        created += BENCHMARK_TRANSFERS;
+
+        QEventLoop loop;
+        db->whenWritten(this, [&loop] {
+            loop.quit();
+        });
+        loop.exec();
+    }
+    QCOMPARE(db->transferCount(), count + created);
+}
+
+void ut_dbmanager::interruptUnfinishedTransfers()
+{
+    DbManager *db = DbManager::instance();
+    const int finishedKey = m_keys.at(m_keys.count() - 2);
+    QVERIFY(db->updateTransferStatus(m_keys.last(), TransferEngineData::TransferStarted));
+    QVERIFY(db->updateTransferStatus(finishedKey, TransferEngineData::TransferFinished));
+
+    const int started = db->activeTransferCount();
+    QVERIFY(started > 0);
+    const int unfinished = started + db->transfersPage(0, -1, TransferEngineData::NotStarted).count();
+
+    // All the unfinished transfers are interrupted at once
+    int active = 0;
+    int interrupted = 0;
+    QBENCHMARK_ONCE {
+        interrupted = db->interruptUnfinishedTransfers(&active);
+    }
+    QCOMPARE(interrupted, unfinished);
+    QCOMPARE(active, started);
+    QCOMPARE(db->activeTransferCount(), 0);
+    QCOMPARE(db->transferStatus(m_keys.last()), TransferEngineData::TransferInterrupted);
+    QCOMPARE(db->transferStatus(finishedKey), TransferEngineData::TransferFinished);
+
+    QCOMPARE(db->interruptUnfinishedTransfers(), 0);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef UT_DBMANAGER_H
+#define UT_DBMANAGER_H
+
+#include <QList>
+#include <QObject>
+#include <QTemporaryDir>
+
+class ut_dbmanager : public QObject
+{
+    Q_OBJECT
+public:
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void benchmarkProgressWithReader_data();
+    void benchmarkProgressWithReader();
+    void benchmarkUpdateProgress_data();
+    void benchmarkUpdateProgress();
+    void benchmarkTransferStatus_data();
+    void benchmarkTransferStatus();
+    void transfersPage();
+    void pruneTransfers();
+    void whenWritten();
+    void createTransferFailure();
+    void benchmarkCreateTransfer();
+    void interruptUnfinishedTransfers();
+
+private:
+    QTemporaryDir m_dir;
+    QList<int> m_keys;
+};
+
+#endif // UT_DBMANAGER_H
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "ut_dbmigration.h"
+#include "dbmigration.h"
+#include <QtTest/QTest>
+#include <QFile>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QStringList>
+
+#define MIGRATION_TABLE_SIZE 10000
+
+namespace {
+
+// Schemas of the released database versions, which the migration must be able to upgrade
+const char * const metadataV1 =
+        "CREATE TABLE metadata  (metadata_id INTEGER PRIMARY KEY AUTOINCREMENT, title TEXT, "
+        "description TEXT, transfer_id INTEGER NOT NULL, "
+        "FOREIGN KEY(transfer_id) REFERENCES transfers(transfer_id) ON DELETE CASCADE);";
+const char * const callbackV1 =
+        "CREATE TABLE callback (callback_id INTEGER PRIMARY KEY AUTOINCREMENT, service TEXT, "
+        "path TEXT, interface TEXT, cancel_method TEXT, restart_method TEXT, "
+        "transfer_id INTEGER NOT NULL, "
+        "FOREIGN KEY(transfer_id) REFERENCES transfers(transfer_id) ON DELETE CASCADE);";
+const char * const transfersV1 =
+        "CREATE TABLE transfers (transfer_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "transfer_type INTEGER, timestamp TEXT, status INTEGER, progress REAL, display_name TEXT, "
+        "application_icon TEXT, thumbnail_icon TEXT, service_icon TEXT, url TEXT, "
+        "resource_name TEXT, mime_type TEXT, file_size INTEGER, plugin_id TEXT, account_id TEXT, "
+        "strip_metadata INTEGER, scale_percent REAL, cancel_supported INTEGER, "
+        "restart_supported INTEGER);";
+const char * const transfersV2 =
+        "CREATE TABLE transfers (transfer_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "transfer_type INTEGER, timestamp TEXT, status INTEGER, progress REAL, display_name TEXT, "
+        "application_icon TEXT, thumbnail_icon TEXT, service_icon TEXT, url TEXT, "
+        "resource_name TEXT, mime_type TEXT, file_size INTEGER, plugin_id TEXT, account_id TEXT, "
+        "strip_metadata INTEGER, scale_percent REAL, cancel_supported INTEGER, "
+        "restart_supported INTEGER, notification_id INTEGER);";
+const char * const triggerV1 =
+        "CREATE TRIGGER delete_cascade BEFORE DELETE ON transfers FOR EACH ROW BEGIN "
+        "DELETE FROM metadata WHERE transfer_id = OLD.transfer_id; "
+        "DELETE FROM callback WHERE transfer_id = OLD.transfer_id; END;";
+const char * const indexesV3[] = {
+    "CREATE INDEX transfers_status ON transfers (status);",
+    "CREATE INDEX transfers_type_status ON transfers (transfer_type, status);",
+    "CREATE INDEX transfers_timestamp ON transfers (timestamp);"
+};
+const char * const indexesV4[] = {
+    "CREATE INDEX metadata_transfer_id ON metadata (transfer_id);",
+    "CREATE INDEX callback_transfer_id ON callback (transfer_id);"
+};
+
+bool exec(QSqlQuery &query, const QString &statement)
+{
+    if (!query.exec(statement)) {
+        qWarning() << statement << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+int rowCount(const QSqlDatabase &db, const QString &table)
+{
+    QSqlQuery query(db);
+    if (!query.exec(QStringLiteral("SELECT COUNT(*) FROM %1").arg(table)) || !query.next()) {
+        return -1;
+    }
+    return query.value(0).toInt();
+}
+
+QStringList indexes(const QSqlDatabase &db)
+{
+    QStringList names;
+    QSqlQuery query(db);
+    query.exec(QStringLiteral("SELECT name FROM sqlite_master WHERE type = 'index' AND name NOT LIKE 'sqlite_%'"));
+    while (query.next()) {
+        names.append(query.value(0).toString());
+    }
+    return names;
+}
+
+}
+
+void ut_dbmigration::init()
+{
+    QVERIFY(m_dir.isValid());
+    const QString name = QStringLiteral("migration%1").arg(++m_databases);
+    m_db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), name);
+    m_db.setDatabaseName(m_dir.filePath(name + QStringLiteral(".sqlite")));
+    QVERIFY(m_db.open());
+}
+
+void ut_dbmigration::cleanup()
+{
+    const QString name = m_db.connectionName();
+    m_db.close();
+    m_db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(name);
+}
+
+void ut_dbmigration::createSchema()
+{
+    QCOMPARE(DbMigration::userVersion(m_db), 0);
+    QVERIFY(DbMigration::migrate(m_db));
+    QCOMPARE(DbMigration::userVersion(m_db), DbMigration::latestVersion());
+    QCOMPARE(rowCount(m_db, QStringLiteral("transfers")), 0);
+    QCOMPARE(indexes(m_db).count(), 5);
+}
+
+void ut_dbmigration::migrate_data()
+{
+    QTest::addColumn<int>("version");
+
+    QTest::newRow("version 1") << 1;
+    QTest::newRow("version 2") << 2;
+    QTest::newRow("version 3") << 3;
+    QTest::newRow("version 4") << 4;
+}
+
+void ut_dbmigration::migrate()
+{
+    QFETCH(int, version);
+
+    // Fill a database of the old version with transfers
+    QSqlQuery query(m_db);
+    QVERIFY(m_db.transaction());
+    QVERIFY(exec(query, QLatin1String(metadataV1)));
+    QVERIFY(exec(query, QLatin1String(callbackV1)));
+    QVERIFY(exec(query, QLatin1String(version == 1 ? transfersV1 : transfersV2)));
+    QVERIFY(exec(query, QLatin1String(triggerV1)));
+    if (version >= 3) {
+        for (const char *index : indexesV3) {
+            QVERIFY(exec(query, QLatin1String(index)));
+        }
+    }
+    if (version >= 4) {
+        for (const char *index : indexesV4) {
+            QVERIFY(exec(query, QLatin1String(index)));
+        }
+    }
+    QVERIFY(exec(query, QStringLiteral("PRAGMA user_version=%1").arg(version)));
+
+    QVERIFY(query.prepare(QStringLiteral(
+            "INSERT INTO transfers (transfer_type, timestamp, status, progress, display_name, url, mime_type, "
+            "file_size, plugin_id) VALUES (1, :timestamp, 3, 1.0, 'Display name', :url, 'image/jpeg', 1024, 'plugin')")));
+    for (int i = 0; i < MIGRATION_TABLE_SIZE; ++i) {
+        query.bindValue(QStringLiteral(":timestamp"), QStringLiteral("2021-01-01T00:00:00Z"));
+        query.bindValue(QStringLiteral(":url"), QStringLiteral("file:///tmp/image%1.jpg").arg(i));
+        QVERIFY(query.exec());
+    }
+    QVERIFY(exec(query, QStringLiteral(
+            "INSERT INTO metadata (title, description, transfer_id) SELECT 'title', 'description', transfer_id FROM transfers")));
+    query.finish();
+    QVERIFY(m_db.commit());
+
+    QCOMPARE(DbMigration::userVersion(m_db), version);
+
+    bool ok = false;
+    QBENCHMARK_ONCE {
+        ok = DbMigration::migrate(m_db);
+    }
+    QVERIFY(ok);
+
+    // The transfers are kept and the schema matches the latest version
+    QCOMPARE(DbMigration::userVersion(m_db), DbMigration::latestVersion());
+    QCOMPARE(rowCount(m_db, QStringLiteral("transfers")), MIGRATION_TABLE_SIZE);
+    QCOMPARE(rowCount(m_db, QStringLiteral("metadata")), MIGRATION_TABLE_SIZE);
+    QVERIFY(m_db.record(QStringLiteral("transfers")).contains(QStringLiteral("notification_id")));
+    QVERIFY(m_db.record(QStringLiteral("transfers")).contains(QStringLiteral("priority")));
+    QCOMPARE(indexes(m_db).count(), 5);
+
+    // Rebuilding the tables leaves foreign key enforcement off as it was
+    QVERIFY(exec(query, QStringLiteral("PRAGMA foreign_keys")));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), 0);
+    query.finish();
+
+    // The timestamps are converted to milliseconds since the epoch and the metadata survives
+    // rebuilding the transfers table
+    QVERIFY(exec(query, QStringLiteral("SELECT COUNT(*) FROM transfers WHERE typeof(timestamp) = 'integer' "
+                                       "AND timestamp = 1609459200000")));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), MIGRATION_TABLE_SIZE);
+    QVERIFY(exec(query, QStringLiteral("SELECT COUNT(*) FROM metadata JOIN transfers USING (transfer_id)")));
+    QVERIFY(query.next());
+    QCOMPARE(query.value(0).toInt(), MIGRATION_TABLE_SIZE);
+    query.finish();
+
+    // Migrating the latest version is a no-op
+    QVERIFY(DbMigration::migrate(m_db));
+    QCOMPARE(rowCount(m_db, QStringLiteral("transfers")), MIGRATION_TABLE_SIZE);
+}
+
+void ut_dbmigration::newerVersion()
+{
+    QVERIFY(DbMigration::migrate(m_db));
+    QSqlQuery query(m_db);
+    QVERIFY(exec(query, QStringLiteral("PRAGMA user_version=%1").arg(DbMigration::latestVersion() + 1)));
+    query.finish();
+
+    // A database from a newer engine can't be migrated, but it isn't corrupt so its
+    // transfers are kept
+    QVERIFY(exec(query, QStringLiteral("INSERT INTO transfers (transfer_type, status) VALUES (1, 3)")));
+    query.finish();
+    QVERIFY(!DbMigration::migrate(m_db));
+    QVERIFY(!DbMigration::isCorrupt(m_db));
+    QCOMPARE(DbMigration::userVersion(m_db), DbMigration::latestVersion() + 1);
+    QCOMPARE(rowCount(m_db, QStringLiteral("transfers")), 1);
+
+    // It can still be recreated
+    QVERIFY(DbMigration::recreate(m_db));
+    QCOMPARE(DbMigration::userVersion(m_db), DbMigration::latestVersion());
+    QCOMPARE(rowCount(m_db, QStringLiteral("transfers")), 0);
+}
+
+void ut_dbmigration::corruptDatabase()
+{
+    const QString name = m_db.connectionName();
+    const QString path = m_db.databaseName();
+    m_db.close();
+
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QVERIFY(file.write(QByteArray(4096, 'x')) == 4096);
+    file.close();
+
+    m_db = QSqlDatabase::database(name);
+    QVERIFY(m_db.isOpen());
+    QVERIFY(!DbMigration::migrate(m_db));
+    QVERIFY(DbMigration::isCorrupt(m_db));
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef UT_DBMIGRATION_H
+#define UT_DBMIGRATION_H
+
+#include <QObject>
+#include <QSqlDatabase>
+#include <QTemporaryDir>
+
+class ut_dbmigration : public QObject
+{
+    Q_OBJECT
+public:
+
+private slots:
+    void init();
+    void cleanup();
+    void createSchema();
+    void migrate_data();
+    void migrate();
+    void newerVersion();
+    void corruptDatabase();
+
+private:
+    QTemporaryDir m_dir;
+    QSqlDatabase m_db;
+    int m_databases = 0;
+};
+
+#endif // UT_DBMIGRATION_H
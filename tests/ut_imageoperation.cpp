@@ -26,8 +26,44 @@
 #include <qtest.h>
 #include <QuillMetadata>
 #include "imageoperation.h"
+#include "imageoperation_p.h"
 #include <QtDebug>
+#include <QBuffer>
 #include <QDir>
+#include <QImageReader>
+#include <QSet>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+
+namespace {
+
+// Returns the compressed image data of a JPEG file, starting from the start of scan marker
+QByteArray scanData(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    const QByteArray data = file.readAll();
+    const int start = data.indexOf(QByteArray("\xff\xda", 2));
+    return start >= 0 ? data.mid(start) : QByteArray();
+}
+
+QByteArray fileContent(const QString &filePath)
+{
+    QFile file(filePath);
+    return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+}
+
+}
+
+void ut_imageoperation::initTestCase()
+{
+    // Keep the cache out of the user's cache directory, and disabled in the test cases
+    // measuring the operations
+    QStandardPaths::setTestModeEnabled(true);
+    ImageOperation::setCacheMaxSize(0);
+}
 
 QString ut_imageoperation::createTestFile(const QString &fileName, bool writeContent)
 {
@@ -53,35 +89,47 @@ void ut_imageoperation::testUniqueFilePath()
     // Non existing file
     QCOMPARE(ImageOperation::uniqueFilePath(QLatin1String("/home/nemo/Pictures/img_001.jpg")), QString());
 
-    // Existing file
+    // Existing file, the path keeps the file name and doesn't exist yet
     QStringList tmp;
     tmp << ImageOperation::uniqueFilePath(tempFiles.at(0));
-    QCOMPARE(tmp.last().endsWith(QLatin1String("_1.jpg")), true);
-    tmp.clear();
-
-    // Add two more files
-    tempFiles << createTestFile("img_002.jpg")
-              << createTestFile("img_004.jpg");
-
-    // Create couple of temp files from the same source file. Note files must exists
-    // on a disk
-    tmp << ImageOperation::uniqueFilePath(tempFiles.at(2));
-    QFile::copy(tempFiles.at(2), tmp.last());
-    QCOMPARE(tmp.last().endsWith(QLatin1String("_1.jpg")), true);
-
-    tmp << ImageOperation::uniqueFilePath(tempFiles.at(2));
-    QFile::copy(tempFiles.at(2), tmp.last());
-    QCOMPARE(tmp.last().endsWith(QLatin1String("_2.jpg")), true);
-
-    // Remove the first file. This should handle the case that we are not getting
-    // a new temp file with _2.jpg as a suffix because this should take into account
-    // the removed files too.
-    QFile::remove(tmp.first());
-    QCOMPARE(ImageOperation::uniqueFilePath(tempFiles.at(2)).endsWith("_3.jpg"), true);
+    QCOMPARE(QFileInfo(tmp.last()).fileName(), QStringLiteral("img_001.jpg"));
+    QVERIFY(!QFile::exists(tmp.last()));
+    QVERIFY(QFileInfo(tmp.last()).dir().exists());
+    QVERIFY(tmp.last() != tempFiles.at(0));
+
+    // Create couple of temp files from the same source file. They never get the same
+    // path, even if some of the previous files have been removed.
+    tempFiles << createTestFile("img_004.jpg");
+    tmp << ImageOperation::uniqueFilePath(tempFiles.at(1));
+    QVERIFY(QFile::copy(tempFiles.at(1), tmp.last()));
+    tmp << ImageOperation::uniqueFilePath(tempFiles.at(1));
+    QVERIFY(QFile::copy(tempFiles.at(1), tmp.last()));
+    QFile::remove(tmp.at(1));
+    tmp << ImageOperation::uniqueFilePath(tempFiles.at(1));
+    QVERIFY(QFile::copy(tempFiles.at(1), tmp.last()));
+    QCOMPARE(tmp.toSet().count(), tmp.count());
+
+    // The file is reserved directly to the given location, keeping the suffix
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    tmp << ImageOperation::uniqueFilePath(tempFiles.at(1), dir.path());
+    QCOMPARE(QFileInfo(tmp.last()).path(), QDir(dir.path()).absolutePath());
+    QVERIFY(QFileInfo(tmp.last()).fileName().startsWith(QStringLiteral("img_004_")));
+    QCOMPARE(QFileInfo(tmp.last()).suffix(), QStringLiteral("jpg"));
+    QVERIFY(QFile::exists(tmp.last()));
+    QVERIFY(QFile::remove(tmp.last()));
+    QVERIFY(QFile::rename(tempFiles.at(1), tmp.last()));
+    tempFiles.removeLast();
+    tmp << ImageOperation::uniqueFilePath(tmp.last(), dir.path());
+    QVERIFY(tmp.last() != tmp.at(tmp.count() - 2));
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Dirs | QDir::NoDotAndDotDot).count(), 0);
 
     // Remove all the files generated for this test case
     foreach(QString f, tmp) {
         QFile::remove(f);
+        if (QFileInfo(f).path() != QDir(dir.path()).absolutePath()) {
+            QDir().rmdir(QFileInfo(f).path());
+        }
     }
 
     foreach(QString f, tempFiles) {
@@ -89,6 +137,27 @@ void ut_imageoperation::testUniqueFilePath()
     }
 }
 
+void ut_imageoperation::benchmarkUniqueFilePath()
+{
+    // Allocating paths doesn't slow down as the directory fills up, and only files are left
+    // for the caller to remove
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString source = createTestFile("img_bench.jpg");
+
+    QSet<QString> paths;
+    QBENCHMARK_ONCE {
+        for (int i = 0; i < 1000; ++i) {
+            paths.insert(ImageOperation::uniqueFilePath(source, dir.path()));
+        }
+    }
+    QCOMPARE(paths.count(), 1000);
+    QVERIFY(!paths.contains(QString()));
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Files).count(), 1000);
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Dirs | QDir::NoDotAndDotDot).count(), 0);
+    QFile::remove(source);
+}
+
 
 void ut_imageoperation::testScale()
 {
@@ -185,6 +254,92 @@ void ut_imageoperation::testScaleToSize()
     QFile::remove(result);
 }
 
+void ut_imageoperation::testScaleToSizeBudget_data()
+{
+    QTest::addColumn<QString>("filePath");
+    QTest::addColumn<qreal>("fraction");
+
+    QTest::newRow("half") << QStringLiteral("images/testimage.jpg") << 0.5;
+    QTest::newRow("fifth") << QStringLiteral("images/testimage.jpg") << 0.2;
+    QTest::newRow("tiny") << QStringLiteral("images/testimage.jpg") << 0.02;
+    QTest::newRow("rotated") << QStringLiteral("images/testimage-90.jpg") << 0.3;
+    QTest::newRow("mirrored") << QStringLiteral("images/testimage-270-mirrored.jpg") << 0.3;
+}
+
+void ut_imageoperation::testScaleToSizeBudget()
+{
+    QFETCH(QString, filePath);
+    QFETCH(qreal, fraction);
+
+    const quint64 targetSize = QFileInfo(filePath).size() * fraction;
+    const QString target = ImageOperation::uniqueFilePath(filePath);
+    QVERIFY(!target.isEmpty());
+
+    const QString result = ImageOperation::scaleImageToSize(filePath, targetSize, target);
+    QCOMPARE(result, target);
+
+    // The budget is never exceeded. The dimensions are estimated from the compression of the
+    // source, so the image may not fill the budget even at the highest quality. The encoder
+    // itself is held to ENCODE_SIZE_TOLERANCE in testEncodeToSize().
+    const quint64 size = QFileInfo(result).size();
+    QVERIFY2(size <= targetSize, qPrintable(QStringLiteral("%1 > %2").arg(size).arg(targetSize)));
+    QVERIFY2(size >= targetSize * 3 / 4, qPrintable(QStringLiteral("%1 < 3/4 * %2").arg(size).arg(targetSize)));
+    QVERIFY(!QImage(result).isNull());
+    QFile::remove(result);
+}
+
+void ut_imageoperation::testEncodeToSize_data()
+{
+    QTest::addColumn<qreal>("fraction");
+
+    // Fractions of the size at the highest quality, reached by searching the quality first and
+    // the dimensions when even the lowest quality is too large
+    QTest::newRow("quality high") << 0.9;
+    QTest::newRow("quality") << 0.7;
+    QTest::newRow("dimensions") << 0.1;
+    QTest::newRow("dimensions small") << 0.03;
+}
+
+void ut_imageoperation::testEncodeToSize()
+{
+    QFETCH(qreal, fraction);
+
+    QImageReader reader(QStringLiteral("images/testimage.jpg"));
+    reader.setScaledSize(reader.size() / 2);
+    const QImage image = reader.read();
+    QVERIFY(!image.isNull());
+
+    QByteArray highestQuality;
+    QBuffer buffer(&highestQuality);
+    QVERIFY(buffer.open(QIODevice::WriteOnly));
+    QVERIFY(image.save(&buffer, "jpg", ENCODE_MAX_QUALITY));
+
+    const quint64 targetSize = highestQuality.size() * fraction;
+    int encodes = 0;
+    const QByteArray data = encodeImageToSize(image, "jpg", targetSize, &encodes);
+    QVERIFY(!data.isEmpty());
+
+    const quint64 size = data.size();
+    QVERIFY2(size <= targetSize, qPrintable(QStringLiteral("%1 > %2").arg(size).arg(targetSize)));
+    QVERIFY2(size >= targetSize * (1 - ENCODE_SIZE_TOLERANCE),
+             qPrintable(QStringLiteral("%1 < %2 - %3%").arg(size).arg(targetSize).arg(ENCODE_SIZE_TOLERANCE * 100)));
+    QVERIFY2(encodes <= ENCODE_MAX_ATTEMPTS, qPrintable(QStringLiteral("%1 encodes").arg(encodes)));
+    QVERIFY(!QImage::fromData(data).isNull());
+}
+
+void ut_imageoperation::testEncodeToSizeTooSmall()
+{
+    QImageReader reader(QStringLiteral("images/testimage.jpg"));
+    reader.setScaledSize(reader.size() / 8);
+    const QImage image = reader.read();
+    QVERIFY(!image.isNull());
+
+    // The headers alone are larger than the target, so nothing fits
+    int encodes = 0;
+    QVERIFY(encodeImageToSize(image, "jpg", 100, &encodes).isEmpty());
+    QVERIFY(encodes > 0);
+}
+
 
 void ut_imageoperation::testDropMetadata()
 {
@@ -235,10 +390,30 @@ void ut_imageoperation::testDropMetadata()
     QCOMPARE(lat.isNull(), true);
     QCOMPARE(lon.isNull(), true);
 
+    // The orientation is kept and the image data is not touched
+    int angle;
+    bool mirror;
+    ImageOperation::imageOrientation(path, &angle, &mirror);
+    QCOMPARE(angle, 90);
+    QCOMPARE(mirror, false);
+    const QByteArray originalData = scanData("images/testimage.jpg");
+    QVERIFY(!originalData.isEmpty());
+    QVERIFY(scanData(path) == originalData);
+
     // Remove the test image
     QFile::remove(path);
 }
 
+void ut_imageoperation::benchmarkDropMetadata()
+{
+    const QString filePath("images/testimage.jpg");
+    QBENCHMARK {
+        const QString path = ImageOperation::removeImageMetadata(filePath);
+        QVERIFY(!path.isEmpty());
+        QFile::remove(path);
+    }
+}
+
 void ut_imageoperation::testOrientation()
 {
     int angle;
@@ -281,3 +456,81 @@ QTEST_MAIN(ut_imageoperation)
 
 #include "ut_imageoperation.moc"
 */
+
+void ut_imageoperation::testCache()
+{
+    ImageOperation::clearCache();
+    ImageOperation::setCacheMaxSize(Q_INT64_C(100) * 1024 * 1024);
+
+    // Work on a copy of the image which can be modified
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString source = dir.path() + QStringLiteral("/testimage.jpg");
+    QVERIFY(QFile::copy(QStringLiteral("images/testimage.jpg"), source));
+
+    const quint64 hits = ImageOperation::cacheHits();
+    const quint64 misses = ImageOperation::cacheMisses();
+    QStringList results;
+
+    results << ImageOperation::scaleImage(source, 0.5);
+    QVERIFY(!results.last().isEmpty());
+    QCOMPARE(ImageOperation::cacheMisses(), misses + 1);
+    QCOMPARE(ImageOperation::cacheHits(), hits);
+
+    // The same operation is copied from the cache to a new file
+    results << ImageOperation::scaleImage(source, 0.5);
+    QVERIFY(!results.last().isEmpty());
+    QVERIFY(results.last() != results.first());
+    QCOMPARE(ImageOperation::cacheHits(), hits + 1);
+    QCOMPARE(fileContent(results.last()), fileContent(results.first()));
+
+    // The results are copies, so modifying one doesn't change the cached result
+    const QByteArray content = fileContent(results.last());
+    QFile result(results.last());
+    QVERIFY(result.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QVERIFY(result.write("modified") > 0);
+    result.close();
+    results << ImageOperation::scaleImage(source, 0.5);
+    QCOMPARE(ImageOperation::cacheHits(), hits + 2);
+    QCOMPARE(fileContent(results.last()), content);
+
+    // Or to the given target file
+    const QString target = ImageOperation::uniqueFilePath(source, dir.path());
+    QCOMPARE(ImageOperation::scaleImage(source, 0.5, target), target);
+    QCOMPARE(ImageOperation::cacheHits(), hits + 3);
+    QCOMPARE(fileContent(target), fileContent(results.first()));
+
+    // Other parameters and operations are cached separately
+    results << ImageOperation::scaleImage(source, 0.25);
+    QVERIFY(!results.last().isEmpty());
+    results << ImageOperation::removeImageMetadata(source);
+    QVERIFY(!results.last().isEmpty());
+    QCOMPARE(ImageOperation::cacheMisses(), misses + 3);
+    results << ImageOperation::removeImageMetadata(source);
+    QCOMPARE(ImageOperation::cacheHits(), hits + 4);
+    QCOMPARE(fileContent(results.last()), fileContent(results.at(results.count() - 2)));
+
+    // A modified source is processed again
+    QFile file(source);
+    QVERIFY(file.open(QIODevice::Append));
+    QVERIFY(file.write("modified") > 0);
+    file.close();
+    results << ImageOperation::scaleImage(source, 0.5);
+    QVERIFY(!results.last().isEmpty());
+    QCOMPARE(ImageOperation::cacheMisses(), misses + 4);
+
+    // The least recently used results are evicted when the cache is full
+    ImageOperation::setCacheMaxSize(QFileInfo(results.last()).size());
+    results << ImageOperation::scaleImage(source, 0.25);
+    QCOMPARE(ImageOperation::cacheMisses(), misses + 5);
+    results << ImageOperation::scaleImage(source, 0.25);
+    QCOMPARE(ImageOperation::cacheHits(), hits + 5);
+    results << ImageOperation::scaleImage(source, 0.5);
+    QCOMPARE(ImageOperation::cacheMisses(), misses + 6);
+
+    foreach (const QString &result, results) {
+        QFile::remove(result);
+    }
+    ImageOperation::clearCache();
+    ImageOperation::setCacheMaxSize(0);
+}
@@ -35,11 +35,20 @@ public:
     QString createTestFile(const QString &fileName, bool writeContent = true);
 
 private slots:
+    void initTestCase();
     void testScale();
     void testScaleToSize();
+    void testScaleToSizeBudget_data();
+    void testScaleToSizeBudget();
+    void testEncodeToSize_data();
+    void testEncodeToSize();
+    void testEncodeToSizeTooSmall();
     void testDropMetadata();
+    void benchmarkDropMetadata();
     void testUniqueFilePath();
+    void benchmarkUniqueFilePath();
     void testOrientation();
+    void testCache();
 };
 
 #endif // UT_IMAGEOPERATION_H
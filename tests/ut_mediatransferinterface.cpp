@@ -24,9 +24,13 @@
 
 #include "ut_mediatransferinterface.h"
 #include "mediaitem.h"
+#include "imageoperation.h"
 #include <QtTest/QTest>
+#include <QFile>
+#include <QFileInfo>
 #include <QVariantMap>
 #include <QtDebug>
+#include <QSet>
 #include <QSignalSpy>
 
 
@@ -145,6 +149,58 @@ void ut_mediatransferinterface::testProgress()
     QVERIFY(tf->progress() == 0);
 }
 
+void ut_mediatransferinterface::testProcessImage()
+{
+    QVERIFY(tf != 0);
+
+    QSignalSpy spy(tf, SIGNAL(imageProcessed(int,QString)));
+
+    // The processed images are delivered to the transfer with the ids of their operations
+    const int scaled = tf->processImage(ImageOperation::scaleImageAsync(QStringLiteral("images/testimage.jpg"), 0.5));
+    const int stripped = tf->processImage(ImageOperation::removeImageMetadataAsync(QStringLiteral("images/testimage.jpg")));
+    QVERIFY(scaled != stripped);
+    QTRY_COMPARE(spy.count(), 2);
+    QSet<int> operationIds;
+    for (const QList<QVariant> &arguments : spy) {
+        operationIds.insert(arguments.at(0).toInt());
+        const QString path = arguments.at(1).toString();
+        QVERIFY(!path.isEmpty());
+        QVERIFY(QFile::exists(path));
+        QFile::remove(path);
+    }
+    QCOMPARE(operationIds, QSet<int>() << scaled << stripped);
+
+    // Canceling the transfer cancels the processing
+    QFuture<QString> operation = ImageOperation::scaleImageAsync(QStringLiteral("images/testimage.jpg"), 0.5);
+    tf->processImage(operation);
+    tf->setStatus(MediaTransferInterface::TransferCanceled);
+    QVERIFY(operation.isCanceled());
+    operation.waitForFinished();
+    QTest::qWait(10);
+    QCOMPARE(spy.count(), 2);
+}
+
+void ut_mediatransferinterface::testScratchDirectory()
+{
+    QVERIFY(tf != 0);
+
+    // The directory is kept while the transfer is in progress
+    const QString path = tf->scratchDirectory();
+    QVERIFY(!path.isEmpty());
+    QCOMPARE(tf->scratchDirectory(), path);
+    const QString file = ImageOperation::uniqueFilePath(QStringLiteral("images/testimage.jpg"), path);
+    QVERIFY(file.startsWith(path));
+    QCOMPARE(QFileInfo(file).fileName(), QStringLiteral("testimage.jpg"));
+    QVERIFY(QFile::copy(QStringLiteral("images/testimage.jpg"), file));
+    tf->setStatus(MediaTransferInterface::TransferStarted);
+    QVERIFY(QFile::exists(file));
+
+    // It's removed with the files when the transfer ends
+    tf->setStatus(MediaTransferInterface::TransferFinished);
+    QVERIFY(!QFile::exists(file));
+    QVERIFY(!QFile::exists(path));
+}
+
 
 
 #if QT_VERSION < QT_VERSION_CHECK(5,0,0)
@@ -57,6 +57,8 @@ private slots:
     void cleanup();
     void testSetMediaItem();
     void testProgress();
+    void testProcessImage();
+    void testScratchDirectory();
 #if QT_VERSION < QT_VERSION_CHECK(5,0,0)
     void testStatus_data();
     void testStatus();
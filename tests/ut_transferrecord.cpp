@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "ut_transferrecord.h"
+#include "dbmigration.h"
+#include "transferrecord_p.h"
+#include <QtTest/QTest>
+#include <QSqlError>
+#include <QVector>
+
+#include <malloc.h>
+
+// The number of transfers TransferModel has loaded after scrolling through a long history
+#define TRANSFER_TABLE_SIZE 10000
+
+namespace {
+
+// Bytes allocated from the heap, including the blocks allocated with mmap
+qint64 heapUsed()
+{
+#if __GLIBC_PREREQ(2, 33)
+    const struct mallinfo2 info = mallinfo2();
+#else
+    const struct mallinfo info = mallinfo();
+#endif
+    return qint64(info.uordblks) + qint64(info.hblkhd);
+}
+
+bool readRows(QSqlDatabase db, QSet<QString> *pool, QVector<TransferDBRecord> *rows)
+{
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    if (!query.exec(QStringLiteral("SELECT * FROM transfers ORDER BY transfer_id DESC"))) {
+        qWarning() << "Failed to query transfers" << query.lastError().text();
+        return false;
+    }
+    while (query.next()) {
+        rows->append(::readRecord(query, pool));
+    }
+    query.finish();
+    return true;
+}
+
+// Returns the heap used by the rows read with or without a string pool
+qint64 rowsHeap(QSqlDatabase db, bool stringPool)
+{
+    QSet<QString> pool;
+    QVector<TransferDBRecord> rows;
+    const qint64 before = heapUsed();
+    if (!readRows(db, stringPool ? &pool : nullptr, &rows) || rows.count() != TRANSFER_TABLE_SIZE) {
+        return -1;
+    }
+    return heapUsed() - before;
+}
+
+}
+
+void ut_transferrecord::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    m_db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("transferrecord"));
+    m_db.setDatabaseName(m_dir.filePath(QStringLiteral("transfers.sqlite")));
+    QVERIFY(m_db.open());
+    QVERIFY(DbMigration::createSchema(m_db));
+
+    // The icons, mime types and plugins repeat across the transfers while the rest varies
+    QVERIFY(m_db.transaction());
+    QSqlQuery query(m_db);
+    QVERIFY(query.prepare(QStringLiteral(
+            "INSERT INTO transfers (transfer_type, timestamp, status, progress, display_name, application_icon, "
+            "thumbnail_icon, service_icon, url, resource_name, mime_type, file_size, plugin_id, "
+            "cancel_supported, restart_supported) VALUES (1, :timestamp, 3, 1.0, :display_name, "
+            ":application_icon, :thumbnail_icon, :service_icon, :url, :resource_name, :mime_type, 1024, "
+            ":plugin_id, 1, 1)")));
+    for (int i = 0; i < TRANSFER_TABLE_SIZE; ++i) {
+        const QString name = QStringLiteral("image%1.jpg").arg(i);
+        query.bindValue(QStringLiteral(":timestamp"), qint64(1609459200000) + i);
+        query.bindValue(QStringLiteral(":display_name"), QStringLiteral("Display name %1").arg(i % 10));
+        query.bindValue(QStringLiteral(":application_icon"), QStringLiteral("/usr/share/icons/hicolor/86x86/apps/jolla-gallery.png"));
+        query.bindValue(QStringLiteral(":thumbnail_icon"), QStringLiteral("/home/nemo/Pictures/") + name);
+        query.bindValue(QStringLiteral(":service_icon"), QStringLiteral("image://theme/graphic-s-service-account%1").arg(i % 4));
+        query.bindValue(QStringLiteral(":url"), QStringLiteral("file:///home/nemo/Pictures/") + name);
+        query.bindValue(QStringLiteral(":resource_name"), name);
+        query.bindValue(QStringLiteral(":mime_type"), QStringLiteral("image/jpeg"));
+        query.bindValue(QStringLiteral(":plugin_id"), QStringLiteral("org.sailfishos.transfer.plugin%1").arg(i % 4));
+        QVERIFY(query.exec());
+    }
+    query.finish();
+    QVERIFY(m_db.commit());
+}
+
+void ut_transferrecord::cleanupTestCase()
+{
+    m_db.close();
+    m_db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(QStringLiteral("transferrecord"));
+}
+
+void ut_transferrecord::readRecord()
+{
+    QSet<QString> pool;
+    QVector<TransferDBRecord> rows;
+    QVERIFY(readRows(m_db, &pool, &rows));
+    QCOMPARE(rows.count(), TRANSFER_TABLE_SIZE);
+
+    const TransferDBRecord &newest = rows.first();
+    QCOMPARE(newest.transfer_type, 1);
+    QCOMPARE(newest.status, 3);
+    QCOMPARE(newest.timestamp_msecs, qint64(1609459200000) + TRANSFER_TABLE_SIZE - 1);
+    QCOMPARE(newest.mime_type, QStringLiteral("image/jpeg"));
+    QCOMPARE(newest.size, qint64(1024));
+    QVERIFY(newest.cancel_supported);
+    QVERIFY(newest.restart_supported);
+
+    // The repeated values share the data of the pooled string
+    QCOMPARE(pool.count(), 1 + 4 + 1 + 4);
+    QVERIFY(rows.at(0).application_icon.constData() == rows.at(1).application_icon.constData());
+    QVERIFY(rows.at(0).mime_type.constData() == rows.at(1).mime_type.constData());
+    QVERIFY(rows.at(0).plugin_id.constData() == rows.at(4).plugin_id.constData());
+    QVERIFY(rows.at(0).url.constData() != rows.at(1).url.constData());
+}
+
+void ut_transferrecord::benchmarkRowsHeap_data()
+{
+    QTest::addColumn<bool>("stringPool");
+
+    QTest::newRow("string pool") << true;
+    QTest::newRow("no string pool") << false;
+}
+
+void ut_transferrecord::benchmarkRowsHeap()
+{
+    QFETCH(bool, stringPool);
+
+    const qint64 heap = rowsHeap(m_db, stringPool);
+    QVERIFY(heap > 0);
+    QTest::setBenchmarkResult(heap, QTest::BytesAllocated);
+
+    // Sharing the repeated values saves at least their strings in every row
+    if (stringPool) {
+        QVERIFY(heap < rowsHeap(m_db, false));
+    }
+}
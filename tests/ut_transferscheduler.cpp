@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2021 Open Mobile Platform LLC.
+ *
+ * All rights reserved.
+ *
+ * This file is part of Sailfish Transfer Engine package.
+ *
+ * You may use this file under the terms of the GNU Lesser General
+ * Public License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1 as published by the Free Software Foundation
+ * and appearing in the file license.lgpl included in the packaging
+ * of this file.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "ut_transferscheduler.h"
+#include "transferscheduler.h"
+#include <QtTest/QTest>
+#include <QSignalSpy>
+
+namespace {
+
+QList<int> readyIds(const QSignalSpy &spy)
+{
+    QList<int> ids;
+    for (const QList<QVariant> &arguments : spy) {
+        ids << arguments.at(0).toInt();
+    }
+    return ids;
+}
+
+}
+
+void ut_transferscheduler::limits()
+{
+    TransferScheduler scheduler;
+    scheduler.setMaximumActiveTransfers(3);
+    scheduler.setPluginLimit(QStringLiteral("b"), 1);
+    QSignalSpy spy(&scheduler, SIGNAL(transferReady(int)));
+
+    scheduler.enqueue(1, QStringLiteral("b"), 0);
+    scheduler.enqueue(2, QStringLiteral("b"), 0);
+    scheduler.enqueue(3, QStringLiteral("a"), 0);
+    scheduler.enqueue(4, QStringLiteral("a"), 0);
+    scheduler.enqueue(5, QStringLiteral("a"), 0);
+    QCOMPARE(readyIds(spy), QList<int>() << 1 << 3 << 4);
+    QCOMPARE(scheduler.queuedCount(), 2);
+    QVERIFY(scheduler.isQueued(2));
+
+    // The plugin limit keeps 2 waiting when 1 finishes
+    spy.clear();
+    scheduler.transferFinished(3);
+    QCOMPARE(readyIds(spy), QList<int>() << 5);
+
+    spy.clear();
+    scheduler.transferFinished(1);
+    QCOMPARE(readyIds(spy), QList<int>() << 2);
+    QCOMPARE(scheduler.queuedCount(), 0);
+}
+
+void ut_transferscheduler::priority()
+{
+    TransferScheduler scheduler;
+    scheduler.setMaximumActiveTransfers(1);
+    QSignalSpy spy(&scheduler, SIGNAL(transferReady(int)));
+
+    scheduler.enqueue(1, QStringLiteral("a"), 0);
+    scheduler.enqueue(2, QStringLiteral("a"), 0);
+    scheduler.enqueue(3, QStringLiteral("a"), 5);
+    scheduler.enqueue(4, QStringLiteral("a"), 5);
+
+    scheduler.transferFinished(1);
+    scheduler.transferFinished(3);
+    scheduler.transferFinished(4);
+    QCOMPARE(readyIds(spy), QList<int>() << 1 << 3 << 4 << 2);
+}
+
+void ut_transferscheduler::expiredTransferStartsQueued()
+{
+    TransferScheduler scheduler;
+    scheduler.setMaximumActiveTransfers(3);
+    ClientActivityMonitor monitor;
+
+    // Started uploads are monitored and expired ones are released like Transfer Engine does
+    connect(&scheduler, &TransferScheduler::transferReady, &monitor, &ClientActivityMonitor::newActivity);
+    connect(&monitor, &ClientActivityMonitor::transfersExpired, [&](const QList<int> &transferIds) {
+        for (int transferId : transferIds) {
+            scheduler.transferFinished(transferId);
+            monitor.activityFinished(transferId);
+        }
+    });
+    QSignalSpy spy(&scheduler, SIGNAL(transferReady(int)));
+
+    for (int i = 1; i <= 4; ++i) {
+        scheduler.enqueue(i, QStringLiteral("a"), 0);
+    }
+    QCOMPARE(readyIds(spy), QList<int>() << 1 << 2 << 3);
+    QCOMPARE(scheduler.queuedCount(), 1);
+
+    // Nothing has expired yet
+    monitor.checkActivity();
+    QCOMPARE(spy.count(), 3);
+
+    monitor.setExpirationThreshold(0);
+    monitor.checkActivity();
+    QCOMPARE(readyIds(spy), QList<int>() << 1 << 2 << 3 << 4);
+    QCOMPARE(scheduler.queuedCount(), 0);
+    QVERIFY(monitor.isActiveTransfer(4));
+    QVERIFY(!monitor.isActiveTransfer(1));
+}